@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+/**
+ * Bump allocator. Memory comes from a chain of large blocks and is only
+ * given back all at once, so allocating is a pointer increment and freeing
+ * costs one free() per block rather than per object. Objects placed in an
+ * arena must not need their destructors run.
+ */
+class Arena
+{
+public:
+	explicit Arena(size_t blockSize = 1 << 20)
+		: m_blockSize(blockSize), m_blocks(nullptr), m_pos(nullptr), m_end(nullptr)
+	{
+	}
+
+	~Arena() { clear(); }
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t size, size_t align = alignof(std::max_align_t))
+	{
+		size_t pad = (align - (size_t)m_pos % align) % align;
+		if (! m_pos || size + pad > (size_t)(m_end - m_pos)) {
+			newBlock(size + align);
+			pad = (align - (size_t)m_pos % align) % align;
+		}
+		char* p = m_pos + pad;
+		m_pos = p + size;
+		return p;
+	}
+
+	template<typename T>
+	T* allocate(size_t n)
+	{
+		return (T*)allocate(n * sizeof(T), alignof(T));
+	}
+
+	void clear()
+	{
+		while (m_blocks) {
+			Block* next = m_blocks->next;
+			std::free(m_blocks);
+			m_blocks = next;
+		}
+		m_pos = m_end = nullptr;
+	}
+
+private:
+	struct Block
+	{
+		Block* next;
+		std::max_align_t data[1];
+	};
+
+	void newBlock(size_t minSize)
+	{
+		size_t size = minSize > m_blockSize ? minSize : m_blockSize;
+		Block* block = (Block*)std::malloc(offsetof(Block, data) + size);
+		if (! block) {
+			throw std::bad_alloc();
+		}
+		block->next = m_blocks;
+		m_blocks = block;
+		m_pos = (char*)block->data;
+		m_end = m_pos + size;
+	}
+
+	size_t m_blockSize;
+	Block* m_blocks;
+	char* m_pos;
+	char* m_end;
+};
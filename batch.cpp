@@ -0,0 +1,114 @@
+#include "batch.h"
+
+OwnedTable::OwnedTable(const TableInfo* table)
+	: name(table->tableName), PKs(table->PKs, table->PKs + table->nCol)
+{
+	if (table->columnNames) {
+		for (int i=0; i < table->nCol; i++) {
+			columns.push_back(table->columnNames[i]);
+		}
+		for (const auto& column : columns) {
+			columnPtrs.push_back(column.c_str());
+		}
+	}
+
+	info.tableName = name.c_str();
+	info.nCol = table->nCol;
+	info.PKs = PKs.data();
+	info.columnNames = columnPtrs.empty() ? nullptr : columnPtrs.data();
+	info.bProjected = table->bProjected;
+}
+
+static int appendData(void* out, const void* data, int n)
+{
+	const char* bytes = (const char*)data;
+	((std::vector<char>*)out)->insert(((std::vector<char>*)out)->end(), bytes, bytes + n);
+	return SQLITE_OK;
+}
+
+void InstructionBatch::reset(std::shared_ptr<const OwnedTable> table)
+{
+	m_table = std::move(table);
+	m_types.clear();
+	m_firstValue.clear();
+	m_values.clear();
+	m_dataOffset.clear();
+	m_flags.clear();
+	m_data.clear();
+}
+
+int InstructionBatch::add(const Instruction* instr)
+{
+	int nCol = m_table->info.nCol;
+	int nVal = instr->iType == SQLITE_UPDATE ? nCol * 2 : nCol;
+	size_t nValues = m_values.size();
+	size_t nData = m_data.size();
+
+	m_types.push_back(instr->iType);
+	m_firstValue.push_back(m_values.size());
+
+	for (int i=0; i < nVal; i++) {
+		sqlite_value val = instr->values[i];
+		size_t offset = 0;
+
+		if (instr->iType == SQLITE_UPDATE && instr->valFlag) {
+			int iCol = i % nCol;
+			if (! instr->valFlag[iCol] && ! (i < nCol && m_table->PKs[iCol])) {
+				val.type = 0;
+			}
+		}
+
+		int base = val.type & ~SQLITEDIFF_DELTA;
+		if (base == SQLITE_TEXT || base == SQLITE_BLOB) {
+			/* A delta is copied like the value it encodes */
+			offset = m_data.size();
+			m_data.insert(m_data.end(), val.data2, val.data2 + val.data1.iVal);
+		} else if (val.type == SQLITEDIFF_BLOBREF) {
+			offset = m_data.size();
+			m_data.reserve(offset + val.data1.iVal);
+			int rc = sqlitediff_blob_stream((const BlobRef*)val.data2, val.data1.iVal, appendData, &m_data);
+			if (rc != SQLITE_OK) {
+				m_types.pop_back();
+				m_firstValue.pop_back();
+				m_values.resize(nValues);
+				m_dataOffset.resize(nValues);
+				m_data.resize(nData);
+				return rc;
+			}
+			val.type = SQLITE_BLOB;
+			val.data1.iVal = m_data.size() - offset;
+		}
+		val.data2 = nullptr;
+
+		m_values.push_back(val);
+		m_dataOffset.push_back(offset);
+	}
+
+	for (int i=0; i < nCol; i++) {
+		int flag = 0;
+		if (instr->iType == SQLITE_UPDATE) {
+			flag = instr->valFlag ? instr->valFlag[i] : instr->values[nCol + i].type != 0;
+		}
+		m_flags.push_back(flag);
+	}
+	return SQLITE_OK;
+}
+
+void InstructionBatch::seal()
+{
+	for (size_t i=0; i < m_values.size(); i++) {
+		sqlite_value& val = m_values[i];
+		int base = val.type & ~SQLITEDIFF_DELTA;
+		if (base == SQLITE_TEXT || base == SQLITE_BLOB) {
+			val.data2 = m_data.data() + m_dataOffset[i];
+		}
+	}
+}
+
+void InstructionBatch::get(size_t i, Instruction* instr) const
+{
+	instr->table = const_cast<TableInfo*>(&m_table->info);
+	instr->iType = m_types[i];
+	instr->values = const_cast<sqlite_value*>(&m_values[m_firstValue[i]]);
+	instr->valFlag = const_cast<int*>(&m_flags[i * m_table->info.nCol]);
+}
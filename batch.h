@@ -0,0 +1,61 @@
+#pragma once
+
+#include "diff.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Owned copy of a TableInfo, so that instructions can outlive the diff query
+ * or changeset buffer they were produced from.
+ */
+struct OwnedTable
+{
+	explicit OwnedTable(const TableInfo* table);
+
+	std::string name;
+	std::vector<int> PKs;
+	std::vector<std::string> columns;
+	std::vector<const char*> columnPtrs;
+	TableInfo info;
+};
+
+/**
+ * Deep copies of a run of instructions belonging to one table.
+ *
+ * The values of all instructions are stored contiguously and their BLOB/TEXT
+ * data in a single byte buffer, so a batch that is reset() and refilled does
+ * not allocate once it has grown to its working size.
+ */
+class InstructionBatch
+{
+public:
+	void reset(std::shared_ptr<const OwnedTable> table);
+
+	/* Copies instr. UPDATEs are normalized the way sqlitediff_write_instruction
+	 * writes them: unchanged non-PK columns are blanked out. Instructions
+	 * read from a changeset have no valFlag and are already normalized.
+	 * Returns the error of a streamed BLOB that cannot be read, leaving the
+	 * batch as it was. */
+	int add(const Instruction* instr);
+
+	/* Resolves BLOB/TEXT pointers. Must be called after the last add(). */
+	void seal();
+
+	size_t size() const { return m_types.size(); }
+	const TableInfo* table() const { return &m_table->info; }
+	/* Shared by the batches of one table block */
+	const std::shared_ptr<const OwnedTable>& ownedTable() const { return m_table; }
+
+	void get(size_t i, Instruction* instr) const;
+
+private:
+	std::shared_ptr<const OwnedTable> m_table;
+	std::vector<uint8_t> m_types;
+	std::vector<size_t> m_firstValue;
+	std::vector<sqlite_value> m_values;
+	std::vector<size_t> m_dataOffset;
+	std::vector<int> m_flags;
+	std::vector<char> m_data;
+};
@@ -0,0 +1,126 @@
+/*
+ * Compare the apply backends of sqlite-patch on generated workloads: the
+ * hand-written applyChangeset() and SQLite's sqlite3changeset_apply_v2(),
+ * both reading the same session format changeset.
+ *
+ * Usage: sqldiff-bench-apply [rows]
+ */
+#include <diff.h>
+#include <patch.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#define F(X) do {															\
+	int rc_ = X; 															\
+	if (rc_ != 0) {															\
+		std::cerr << "Error: " << #X << " returned " << rc_ << std::endl;	\
+		exit(1);															\
+	}																		\
+} while(0)
+
+struct Workload
+{
+	const char* name;
+	const char* sql; //< Turns base into target, ?1 is the number of rows
+};
+
+const Workload workloads[] = {
+	{"update 10%", "UPDATE T SET b = b + 1 WHERE id % 10 = 0"},
+	{"update 100%", "UPDATE T SET a = a || 'x'"},
+	{"insert 50%", "INSERT INTO T SELECT id + ?1, a, b, c FROM T WHERE id % 2 = 0"},
+	{"delete 50%", "DELETE FROM T WHERE id % 2 = 0"},
+	{"mixed", "UPDATE T SET c = c * 2 WHERE id % 3 = 0;"
+	          "DELETE FROM T WHERE id % 7 = 0;"
+	          "INSERT INTO T SELECT id + ?1, a, b, c FROM T WHERE id % 5 = 0"},
+};
+
+void exec(sqlite3* db, const char* sql, int nRow)
+{
+	while (*sql) {
+		sqlite3_stmt* stmt;
+		const char* tail;
+		F(sqlite3_prepare_v2(db, sql, -1, &stmt, &tail));
+		if (stmt) {
+			if (sqlite3_bind_parameter_count(stmt) > 0) {
+				sqlite3_bind_int(stmt, 1, nRow);
+			}
+			sqlite3_step(stmt);
+			F(sqlite3_finalize(stmt));
+		}
+		sql = tail;
+	}
+}
+
+void copyDb(const char* from, const char* to)
+{
+	sqlite3* src;
+	sqlite3* dst;
+	F(sqlite3_open(from, &src));
+	F(sqlite3_open(to, &dst));
+	sqlite3_backup* backup = sqlite3_backup_init(dst, "main", src, "main");
+	sqlite3_backup_step(backup, -1);
+	F(sqlite3_backup_finish(backup));
+	sqlite3_close(src);
+	sqlite3_close(dst);
+}
+
+double timeApply(const char* base, const char* target, bool session)
+{
+	copyDb(base, "bench-target.sqlite");
+
+	sqlite3* db;
+	F(sqlite3_open("bench-target.sqlite", &db));
+	auto t1 = std::chrono::steady_clock::now();
+	F(session ? applySessionChangeset(db, "bench.diff") : applyChangeset(db, "bench.diff"));
+	auto t2 = std::chrono::steady_clock::now();
+	sqlite3_close(db);
+
+	int differ;
+	F(sqlitediff_check("bench-target.sqlite", target, "T", &differ));
+	if (differ) {
+		std::cerr << "Error: " << (session ? "session" : "patch.cpp") << " backend gave a different result" << std::endl;
+		exit(1);
+	}
+	return std::chrono::duration<double, std::milli>(t2 - t1).count();
+}
+
+int main(int argc, char const *argv[])
+{
+	int nRow = argc > 1 ? atoi(argv[1]) : 100000;
+
+	remove("bench-base.sqlite");
+	sqlite3* db;
+	F(sqlite3_open("bench-base.sqlite", &db));
+	exec(db,
+		"CREATE TABLE T (id INTEGER PRIMARY KEY, a TEXT, b INTEGER, c REAL);"
+		"BEGIN;"
+		"WITH RECURSIVE r(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM r WHERE i < ?1)"
+		" INSERT INTO T SELECT i, hex(randomblob(16)), i * 7, i / 3.0 FROM r;"
+		"COMMIT;", nRow);
+	sqlite3_close(db);
+
+	DiffOptions options = {};
+	options.bSessionFormat = 1;
+	sqlitediff_set_options(&options);
+
+	std::printf("%-14s %10s %12s %12s\n", "workload", "changes", "patch.cpp", "session");
+	for (const Workload& workload : workloads) {
+		copyDb("bench-base.sqlite", "bench-new.sqlite");
+		F(sqlite3_open("bench-new.sqlite", &db));
+		exec(db, (std::string("BEGIN;") + workload.sql + ";COMMIT;").c_str(), nRow);
+		int nChange = sqlite3_total_changes(db);
+		sqlite3_close(db);
+
+		F(sqlitediff_diff_file("bench-base.sqlite", "bench-new.sqlite", "T", "bench.diff"));
+
+		double patchMs = timeApply("bench-base.sqlite", "bench-new.sqlite", false);
+		double sessionMs = timeApply("bench-base.sqlite", "bench-new.sqlite", true);
+		std::printf("%-14s %10d %10.1fms %10.1fms\n", workload.name, nChange, patchMs, sessionMs);
+	}
+
+	return 0;
+}
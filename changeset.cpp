@@ -0,0 +1,192 @@
+#include "changeset.h"
+
+#include "patch.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+int compareValues(const sqlite_value& a, const sqlite_value& b)
+{
+	if (a.type != b.type) {
+		return a.type < b.type ? -1 : 1;
+	}
+	switch (a.type) {
+	case SQLITE_INTEGER:
+		return a.data1.iVal < b.data1.iVal ? -1 : a.data1.iVal > b.data1.iVal;
+	case SQLITE_FLOAT:
+		return a.data1.dVal < b.data1.dVal ? -1 : a.data1.dVal > b.data1.dVal;
+	case SQLITE_TEXT:
+	case SQLITE_BLOB: {
+		size_t n = std::min(a.data1.iVal, b.data1.iVal);
+		int c = n ? std::memcmp(a.data2, b.data2, n) : 0;
+		if (c) {
+			return c;
+		}
+		return a.data1.iVal < b.data1.iVal ? -1 : a.data1.iVal > b.data1.iVal;
+	}
+	default:
+		return 0;
+	}
+}
+
+/* Compare the PRIMARY KEY of instr with pk, one value per PK column */
+int comparePk(const Instruction& instr, const sqlite_value* pk)
+{
+	for (int i=0, k=0; i < instr.table->nCol; i++) {
+		if (instr.table->PKs[i]) {
+			int c = compareValues(instr.values[i], pk[k++]);
+			if (c) {
+				return c;
+			}
+		}
+	}
+	return 0;
+}
+
+int comparePk(const Instruction& a, const Instruction& b)
+{
+	for (int i=0; i < a.table->nCol; i++) {
+		if (a.table->PKs[i]) {
+			int c = compareValues(a.values[i], b.values[i]);
+			if (c) {
+				return c;
+			}
+		}
+	}
+	return 0;
+}
+
+} // namespace
+
+int ParsedChangeset::collect(const Instruction* instr, void* context)
+{
+	ParsedChangeset* self = (ParsedChangeset*)context;
+	const TableInfo* src = instr->table;
+
+	/* Table names point into the changeset, so they identify a table block */
+	if (src->tableName != self->m_lastTableName) {
+		TableInfo* table = self->m_arena.allocate<TableInfo>(1);
+		*table = *src;
+		int* PKs = self->m_arena.allocate<int>(src->nCol);
+		std::copy(src->PKs, src->PKs + src->nCol, PKs);
+		table->PKs = PKs;
+		if (src->columnNames) {
+			const char** names = self->m_arena.allocate<const char*>(src->nCol);
+			std::copy(src->columnNames, src->columnNames + src->nCol, names);
+			table->columnNames = names;
+		}
+		self->m_blocks.push_back(Block{table, self->m_instrs.size(), 0});
+		self->m_lastTableName = src->tableName;
+	}
+
+	Block& block = self->m_blocks.back();
+	int nVal = instr->iType == SQLITE_UPDATE ? src->nCol * 2 : src->nCol;
+	sqlite_value* values = self->m_arena.allocate<sqlite_value>(nVal);
+	std::copy(instr->values, instr->values + nVal, values);
+
+	Instruction copy;
+	copy.table = const_cast<TableInfo*>(block.table);
+	copy.iType = instr->iType;
+	copy.values = values;
+	copy.valFlag = nullptr;
+	self->m_instrs.push_back(copy);
+	block.count++;
+
+	return 0;
+}
+
+int ParsedChangeset::parseOwned(const char* buf, size_t size)
+{
+	size_t nInstr = m_instrs.size();
+	size_t nBlock = m_blocks.size();
+	m_lastTableName = nullptr;
+	m_pkIndex.clear();
+
+	int rc = readChangeset(buf, size, collect, this);
+	if (rc) {
+		m_instrs.resize(nInstr);
+		m_blocks.resize(nBlock);
+	}
+	return rc;
+}
+
+int ParsedChangeset::parse(const char* buf, size_t size)
+{
+	char* copy = m_arena.allocate<char>(size);
+	std::memcpy(copy, buf, size);
+
+	return parseOwned(copy, size);
+}
+
+int ParsedChangeset::parse(const char* filename)
+{
+	FILE* in = fopen(filename, "rb");
+	if (! in) {
+		return 1;
+	}
+
+	int rc = 1;
+	long size = -1;
+	if (fseek(in, 0, SEEK_END) == 0) {
+		size = ftell(in);
+		rewind(in);
+	}
+	if (size >= 0) {
+		char* buf = m_arena.allocate<char>(size);
+		if (fread(buf, 1, size, in) == (size_t)size) {
+			rc = parseOwned(buf, size);
+		}
+	}
+	fclose(in);
+
+	return rc;
+}
+
+void ParsedChangeset::clear()
+{
+	m_instrs.clear();
+	m_blocks.clear();
+	m_pkIndex.clear();
+	m_lastTableName = nullptr;
+	m_arena.clear();
+}
+
+const std::vector<size_t>& ParsedChangeset::pkIndex(const char* zTab)
+{
+	auto it = m_pkIndex.find(zTab);
+	if (it != m_pkIndex.end()) {
+		return it->second;
+	}
+
+	std::vector<size_t>& index = m_pkIndex[zTab];
+	for (const Block& block : m_blocks) {
+		if (std::strcmp(zTab, block.table->tableName) == 0) {
+			for (size_t i=block.first; i < block.first + block.count; i++) {
+				index.push_back(i);
+			}
+		}
+	}
+	std::stable_sort(index.begin(), index.end(), [this](size_t a, size_t b) {
+		return comparePk(m_instrs[a], m_instrs[b]) < 0;
+	});
+
+	return index;
+}
+
+std::vector<const Instruction*> ParsedChangeset::findByPk(const char* zTab, const sqlite_value* pk)
+{
+	const std::vector<size_t>& index = pkIndex(zTab);
+
+	auto first = std::lower_bound(index.begin(), index.end(), pk, [this](size_t i, const sqlite_value* pk) {
+		return comparePk(m_instrs[i], pk) < 0;
+	});
+
+	std::vector<const Instruction*> result;
+	for (auto it = first; it != index.end() && comparePk(m_instrs[*it], pk) == 0; ++it) {
+		result.push_back(&m_instrs[*it]);
+	}
+	return result;
+}
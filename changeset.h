@@ -0,0 +1,79 @@
+#pragma once
+
+#include "arena.h"
+#include "diff.h"
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * A changeset parsed into memory for inspection, filtering and combining.
+ *
+ * The changeset bytes, tables and instruction values all live in one Arena,
+ * so parsing is a single pass over the buffer without an allocation per
+ * instruction, and clear() releases everything at once. Values point into
+ * the arena's copy of the changeset and stay valid until clear().
+ */
+class ParsedChangeset
+{
+public:
+	/* Instructions of one table header, consecutive in changeset order */
+	struct Block
+	{
+		const TableInfo* table;
+		size_t first;
+		size_t count;
+	};
+
+	ParsedChangeset() : m_lastTableName(nullptr) {}
+
+	/* Parse a changeset and append its instructions. Returns 0 on success
+	 * and readChangeset()'s error otherwise, leaving earlier ones intact. */
+	int parse(const char* buf, size_t size);
+	int parse(const char* filename);
+
+	void clear();
+
+	size_t size() const { return m_instrs.size(); }
+	const Instruction& operator[](size_t i) const { return m_instrs[i]; }
+
+	const std::vector<Block>& blocks() const { return m_blocks; }
+
+	/* Call f(const Instruction&) for every instruction of zTab (NULL for all
+	 * tables) of type iType (0 for all types), in changeset order. */
+	template<typename F>
+	void forEach(const char* zTab, int iType, F f) const
+	{
+		for (const Block& block : m_blocks) {
+			if (zTab && std::strcmp(zTab, block.table->tableName) != 0) {
+				continue;
+			}
+			for (size_t i=block.first; i < block.first + block.count; i++) {
+				if (! iType || m_instrs[i].iType == iType) {
+					f(m_instrs[i]);
+				}
+			}
+		}
+	}
+
+	/* Indices of zTab's instructions sorted by PRIMARY KEY, then changeset
+	 * order. Built on first use and dropped by parse() and clear(). */
+	const std::vector<size_t>& pkIndex(const char* zTab);
+
+	/* Instructions of zTab whose PRIMARY KEY equals pk, one value per PK
+	 * column in column order */
+	std::vector<const Instruction*> findByPk(const char* zTab, const sqlite_value* pk);
+
+private:
+	/* Parse a changeset already copied into the arena */
+	int parseOwned(const char* buf, size_t size);
+	static int collect(const Instruction* instr, void* context);
+
+	Arena m_arena;
+	std::vector<Instruction> m_instrs;
+	std::vector<Block> m_blocks;
+	std::map<std::string, std::vector<size_t>> m_pkIndex;
+	const char* m_lastTableName;
+};
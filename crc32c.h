@@ -0,0 +1,19 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Extend the CRC32C (Castagnoli) checksum crc, 0 for an empty input, by the
+** n bytes at p. Uses the SSE4.2 or ARMv8 CRC instructions where the CPU has
+** them and a table otherwise.
+*/
+uint32_t sqlitediff_crc32c(uint32_t crc, const void *p, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,238 @@
+/*
+** Binary deltas between two versions of a BLOB or TEXT value.
+**
+** A delta is
+**
+**    varint    size of the source
+**    8 bytes   FNV-1a hash of the source, big-endian
+**    varint    size of the output
+**    ...       ops until the end of the delta, each one of
+**                varint (n<<1)|1, varint offset   copy n bytes of the source
+**                varint (n<<1), byte[n]           insert n literal bytes
+**
+** Matches are found the way rsync does: every aligned DELTA_BLOCK-byte
+** block of the source is indexed by its hash, and a rolling hash of the
+** output is looked up at every byte offset. Matches are then extended in
+** both directions byte by byte.
+*/
+#include <string.h>
+
+#include "delta.h"
+#include "sqliteint.h"
+
+#define DELTA_BLOCK 16
+#define DELTA_MUL   0x01000193u
+
+/*
+** Growable output buffer that gives up once nLimit bytes are exceeded.
+*/
+typedef struct DeltaBuf DeltaBuf;
+struct DeltaBuf {
+  unsigned char *z;       /* Delta written so far */
+  sqlite3_int64 n;        /* Bytes used in z[] */
+  sqlite3_int64 nAlloc;   /* Bytes allocated in z[] */
+  sqlite3_int64 nLimit;   /* Maximum size of the delta */
+  int bFull;              /* True once nLimit was exceeded or OOM */
+};
+
+static void deltaAppend(DeltaBuf *p, const unsigned char *z, sqlite3_int64 n){
+  if( p->bFull ) return;
+  if( p->n+n > p->nLimit ){
+    p->bFull = 1;
+    return;
+  }
+  if( p->n+n > p->nAlloc ){
+    sqlite3_int64 nNew = p->nAlloc*2 + n + 64;
+    unsigned char *zNew;
+    if( nNew > p->nLimit ) nNew = p->nLimit;
+    zNew = sqlite3_realloc64(p->z, nNew);
+    if( zNew==0 ){
+      p->bFull = 1;
+      return;
+    }
+    p->z = zNew;
+    p->nAlloc = nNew;
+  }
+  memcpy(p->z+p->n, z, n);
+  p->n += n;
+}
+
+static void deltaVarint(DeltaBuf *p, u64 v){
+  unsigned char a[9];
+  deltaAppend(p, a, sqlite3PutVarint(a, v));
+}
+
+static void deltaLiteral(DeltaBuf *p, const unsigned char *z, sqlite3_int64 n){
+  if( n==0 ) return;
+  deltaVarint(p, (u64)n<<1);
+  deltaAppend(p, z, n);
+}
+
+/*
+** Read a varint without reading past zEnd. Return the number of bytes read
+** or 0 if the varint is truncated.
+*/
+static int deltaGetVarint(const unsigned char *z, const unsigned char *zEnd, u64 *pV){
+  unsigned char a[9];
+  if( zEnd-z >= 9 ) return sqlite3GetVarint(z, pV);
+  memset(a, 0, sizeof(a));
+  memcpy(a, z, zEnd-z);
+  {
+    int n = sqlite3GetVarint(a, pV);
+    return n <= zEnd-z ? n : 0;
+  }
+}
+
+static u64 deltaHash(const unsigned char *z, sqlite3_int64 n){
+  u64 h = 0xcbf29ce484222325ull;
+  sqlite3_int64 i;
+  for(i=0; i<n; i++){
+    h = (h ^ z[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+static u32 blockHash(const unsigned char *z){
+  u32 h = 0;
+  int i;
+  for(i=0; i<DELTA_BLOCK; i++) h = h*DELTA_MUL + z[i];
+  return h;
+}
+
+unsigned char *sqlitediff_delta_create(
+  const unsigned char *zSrc, sqlite3_int64 nSrc,
+  const unsigned char *zOut, sqlite3_int64 nOut,
+  sqlite3_int64 nLimit,
+  sqlite3_int64 *pnDelta
+){
+  DeltaBuf buf;
+  sqlite3_int64 nBlock = nSrc/DELTA_BLOCK;
+  sqlite3_int64 nHash = 64;
+  sqlite3_int64 *aHash;
+  sqlite3_int64 i, iLit, b;
+  unsigned char aSrcHash[8];
+  u64 hSrc;
+  u32 h, pow = 1;
+  int j;
+
+  if( nBlock==0 || nOut<DELTA_BLOCK ) return 0;
+
+  while( nHash < nBlock*2 ) nHash *= 2;
+  aHash = sqlite3_malloc64(sizeof(sqlite3_int64)*nHash);
+  if( aHash==0 ) return 0;
+  memset(aHash, 0xff, sizeof(sqlite3_int64)*nHash);
+  for(b=0; b<nBlock; b++){
+    aHash[blockHash(zSrc+b*DELTA_BLOCK) & (nHash-1)] = b;
+  }
+  for(j=1; j<DELTA_BLOCK; j++) pow *= DELTA_MUL;
+
+  memset(&buf, 0, sizeof(buf));
+  buf.nLimit = nLimit;
+
+  hSrc = deltaHash(zSrc, nSrc);
+  for(j=0; j<8; j++) aSrcHash[j] = (unsigned char)(hSrc >> (56-j*8));
+  deltaVarint(&buf, (u64)nSrc);
+  deltaAppend(&buf, aSrcHash, 8);
+  deltaVarint(&buf, (u64)nOut);
+
+  i = iLit = 0;
+  h = blockHash(zOut);
+  while( i+DELTA_BLOCK<=nOut && !buf.bFull ){
+    b = aHash[h & (nHash-1)];
+    if( b>=0 && memcmp(zSrc+b*DELTA_BLOCK, zOut+i, DELTA_BLOCK)==0 ){
+      sqlite3_int64 iSrc = b*DELTA_BLOCK;
+      sqlite3_int64 iTgt = i;
+      sqlite3_int64 n = DELTA_BLOCK;
+      while( iTgt>iLit && iSrc>0 && zSrc[iSrc-1]==zOut[iTgt-1] ){
+        iSrc--; iTgt--; n++;
+      }
+      while( iSrc+n<nSrc && iTgt+n<nOut && zSrc[iSrc+n]==zOut[iTgt+n] ) n++;
+      deltaLiteral(&buf, zOut+iLit, iTgt-iLit);
+      deltaVarint(&buf, ((u64)n<<1) | 1);
+      deltaVarint(&buf, (u64)iSrc);
+      i = iLit = iTgt+n;
+      if( i+DELTA_BLOCK<=nOut ) h = blockHash(zOut+i);
+      continue;
+    }
+    if( i+DELTA_BLOCK<nOut ){
+      h = (h - zOut[i]*pow)*DELTA_MUL + zOut[i+DELTA_BLOCK];
+    }
+    i++;
+  }
+  deltaLiteral(&buf, zOut+iLit, nOut-iLit);
+  sqlite3_free(aHash);
+
+  if( buf.bFull ){
+    sqlite3_free(buf.z);
+    return 0;
+  }
+  *pnDelta = buf.n;
+  return buf.z;
+}
+
+/*
+** Parse the header of a delta. Return its size or 0 if it is corrupt.
+*/
+static int deltaHeader(
+  const unsigned char *zDelta, sqlite3_int64 nDelta,
+  u64 *pnSrc, u64 *pHash, u64 *pnOut
+){
+  const unsigned char *zEnd = zDelta+nDelta;
+  const unsigned char *z = zDelta;
+  int n, j;
+
+  n = deltaGetVarint(z, zEnd, pnSrc);
+  if( n==0 || zEnd-(z+n) < 8 ) return 0;
+  z += n;
+  *pHash = 0;
+  for(j=0; j<8; j++) *pHash = (*pHash << 8) | z[j];
+  z += 8;
+  n = deltaGetVarint(z, zEnd, pnOut);
+  if( n==0 ) return 0;
+  return (int)(z+n-zDelta);
+}
+
+sqlite3_int64 sqlitediff_delta_output_size(
+  const unsigned char *zDelta, sqlite3_int64 nDelta
+){
+  u64 nSrc, hSrc, nOut;
+  if( deltaHeader(zDelta, nDelta, &nSrc, &hSrc, &nOut)==0 ) return -1;
+  return (sqlite3_int64)nOut;
+}
+
+int sqlitediff_delta_apply(
+  const unsigned char *zSrc, sqlite3_int64 nSrc,
+  const unsigned char *zDelta, sqlite3_int64 nDelta,
+  unsigned char *zOut
+){
+  const unsigned char *zEnd = zDelta+nDelta;
+  const unsigned char *z;
+  u64 nExpect, hSrc, nOut, o = 0;
+  int n;
+
+  n = deltaHeader(zDelta, nDelta, &nExpect, &hSrc, &nOut);
+  if( n==0 ) return SQLITE_CORRUPT;
+  if( nExpect!=(u64)nSrc || hSrc!=deltaHash(zSrc, nSrc) ) return SQLITE_MISMATCH;
+
+  z = zDelta+n;
+  while( z<zEnd ){
+    u64 op, len, off;
+    n = deltaGetVarint(z, zEnd, &op);
+    if( n==0 ) return SQLITE_CORRUPT;
+    z += n;
+    len = op>>1;
+    if( len > nOut-o ) return SQLITE_CORRUPT;
+    if( op & 1 ){
+      n = deltaGetVarint(z, zEnd, &off);
+      if( n==0 || off > (u64)nSrc || len > (u64)nSrc-off ) return SQLITE_CORRUPT;
+      z += n;
+      memcpy(zOut+o, zSrc+off, len);
+    }else{
+      if( len > (u64)(zEnd-z) ) return SQLITE_CORRUPT;
+      memcpy(zOut+o, z, len);
+      z += len;
+    }
+    o += len;
+  }
+  return o==nOut ? SQLITE_OK : SQLITE_CORRUPT;
+}
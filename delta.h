@@ -0,0 +1,42 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sqlite3.h"
+
+/*
+** Create a binary delta that turns zSrc into zOut. Return NULL if no delta
+** of at most nLimit bytes could be found. Otherwise the delta is obtained
+** from sqlite3_malloc64() and its size written to *pnDelta.
+*/
+unsigned char *sqlitediff_delta_create(
+  const unsigned char *zSrc, sqlite3_int64 nSrc,
+  const unsigned char *zOut, sqlite3_int64 nOut,
+  sqlite3_int64 nLimit,
+  sqlite3_int64 *pnDelta
+);
+
+/*
+** Return the size of the value a delta produces, or -1 if the delta is
+** corrupt.
+*/
+sqlite3_int64 sqlitediff_delta_output_size(
+  const unsigned char *zDelta, sqlite3_int64 nDelta
+);
+
+/*
+** Apply a delta to zSrc, writing sqlitediff_delta_output_size() bytes to
+** zOut. Return SQLITE_MISMATCH if zSrc is not the value the delta was
+** created against and SQLITE_CORRUPT if the delta is malformed.
+*/
+int sqlitediff_delta_apply(
+  const unsigned char *zSrc, sqlite3_int64 nSrc,
+  const unsigned char *zDelta, sqlite3_int64 nDelta,
+  unsigned char *zOut
+);
+
+#ifdef __cplusplus
+}
+#endif
@@ -24,8 +24,13 @@
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
+#include "crc32c.h"
+#include "delta.h"
 #include "diff.h"
+#include "rowhash.h"
 
 /*
 ** All global variables are gathered into the "g" singleton.
@@ -34,6 +39,10 @@ struct GlobalVars {
   int bSchemaOnly;          /* Only show schema differences */
   unsigned fDebug;          /* Debug flags */
   sqlite3 *db;              /* The database connection */
+  struct DiffOptions opt;   /* Options set by sqlitediff_set_options() */
+  struct DiffStats stats;   /* Statistics of the last diff */
+  struct DiffCache *pCache; /* Cache of db for the current diff, or NULL */
+  struct DiffCache *pCacheList; /* All open caches */
 } g;
 
 /*
@@ -186,6 +195,68 @@ static sqlite3_stmt *db_prepare(const char *zFormat, ...){
   return pStmt;
 }
 
+void sqlitediff_set_options(const struct DiffOptions *pOpt){
+  if( pOpt ){
+    g.opt = *pOpt;
+    if( g.opt.bSessionFormat ){
+      /* Extensions the session module does not understand */
+      g.opt.nDeltaThreshold = 0;
+      g.opt.nDictMaxSize = 0;
+      g.opt.bChecksum = 0;
+    }
+  }else{
+    memset(&g.opt, 0, sizeof(g.opt));
+  }
+}
+
+/*
+** Return 1 if zStr matches any of the NULL-terminated GLOB patterns azGlob.
+*/
+static int matchesAny(const char **azGlob, const char *zStr){
+  for(; azGlob && *azGlob; azGlob++){
+    if( sqlite3_strglob(*azGlob, zStr)==0 ) return 1;
+  }
+  return 0;
+}
+
+/*
+** Return 1 if zName is a capture table or trigger, which is never diffed.
+*/
+static int isCaptureName(const char *zName){
+  return strncmp(zName, SQLITEDIFF_CAPTURE_PREFIX, sizeof(SQLITEDIFF_CAPTURE_PREFIX)-1)==0;
+}
+
+/*
+** Return 1 if table zTab passes the include and exclude filters of g.opt.
+*/
+static int tableIncluded(const char *zTab){
+  if( isCaptureName(zTab) ) return 0;
+  if( g.opt.azIncludeTables && !matchesAny(g.opt.azIncludeTables, zTab) ){
+    return 0;
+  }
+  return !matchesAny(g.opt.azExcludeTables, zTab);
+}
+
+/*
+** Return 1 if column zCol of table zTab matches one of the "table.column"
+** patterns in g.opt.azExcludeColumns.
+*/
+static int columnExcluded(const char *zTab, const char *zCol){
+  const char **az;
+  for(az=g.opt.azExcludeColumns; az && *az; az++){
+    const char *zDot = strchr(*az, '.');
+    char *zTabGlob;
+    int bMatch;
+    if( zDot==0 ) continue;
+    zTabGlob = sqlite3_mprintf("%.*s", (int)(zDot - *az), *az);
+    bMatch = sqlite3_strglob(zTabGlob, zTab)==0
+          && sqlite3_strglob(zDot+1, zCol)==0;
+    sqlite3_free(zTabGlob);
+    if( bMatch ) return 1;
+  }
+  return 0;
+}
+
 /*
 ** Check that table zTab exists and has the same schema in both the "main"
 ** and "aux" databases currently opened by the global db handle. If they
@@ -207,9 +278,68 @@ static void checkSchemasMatch(const char *zTab){
   sqlite3_finalize(pStmt);
 }
 /*
-** Write a 64-bit signed integer as a varint onto out
+** Dictionary of the short TEXT and BLOB values written in the current table
+** block. Entries are numbered in the order their values were first written,
+** which the reader mirrors, so only the entry numbers need to be written.
+*/
+typedef struct DictEntry DictEntry;
+struct DictEntry {
+  int type;                 /* SQLITE_TEXT, SQLITE_BLOB or -1 for no match */
+  int n;                    /* Size of the value */
+  sqlite3_int64 iOff;       /* Offset of the value in ValueDict.z */
+  unsigned int h;           /* Hash of the value */
+};
+typedef struct ValueDict ValueDict;
+struct ValueDict {
+  DictEntry *aEntry;        /* Entries */
+  int nEntry;               /* Number of entries used */
+  int nEntryAlloc;          /* Number of entries allocated */
+  int *aSlot;               /* Hash table of entry numbers plus one */
+  int nSlot;                /* Size of aSlot[], a power of two */
+  char *z;                  /* Bytes of all values */
+  sqlite3_int64 nUsed;      /* Bytes used in z[] */
+  sqlite3_int64 nAlloc;     /* Bytes allocated in z[] */
+};
+
+/*
+** State of a changeset being written with sqlitediff_writer_table() and
+** sqlitediff_writer_instruction().
+*/
+struct ChangesetWriter {
+  FILE *out;                /* Output stream */
+  int nDictMaxSize;         /* Largest value in the dictionary, 0 for none */
+  int nDictMaxEntry;        /* Maximum number of dictionary entries */
+  int bHeader;              /* True once the 'K' and 'D' records are written */
+  ValueDict dict;           /* Dictionary of the current table block */
+  int bChecksum;            /* True to write 'C' checksum records */
+  uint32_t crc;             /* CRC32C of the current checksum chunk */
+  sqlite3_int64 nChunk;     /* Bytes in the current checksum chunk */
+};
+
+/*
+** Write n bytes onto the output of p, adding them to the checksum chunk.
+*/
+static void putBytes(struct ChangesetWriter *p, const void *z, size_t n){
+  fwrite(z, 1, n, p->out);
+  if( p->bChecksum ){
+    p->crc = sqlitediff_crc32c(p->crc, z, n);
+    p->nChunk += n;
+  }
+}
+
+static void putByte(struct ChangesetWriter *p, int c){
+  unsigned char b = (unsigned char)c;
+  putc(b, p->out);
+  if( p->bChecksum ){
+    p->crc = sqlitediff_crc32c(p->crc, &b, 1);
+    p->nChunk++;
+  }
+}
+
+/*
+** Write a 64-bit signed integer as a varint onto the output of p
 */
-static void putsVarint(FILE *out, sqlite3_uint64 v){
+static void putsVarint(struct ChangesetWriter *pW, sqlite3_uint64 v){
   int i, n;
   unsigned char p[12];
   if( v & (((sqlite3_uint64)0xff000000)<<32) ){
@@ -219,7 +349,7 @@ static void putsVarint(FILE *out, sqlite3_uint64 v){
       p[i] = (unsigned char)((v & 0x7f) | 0x80);
       v >>= 7;
     }
-    fwrite(p, 8, 1, out);
+    putBytes(pW, p, 8);
   }else{
     n = 9;
     do{
@@ -227,45 +357,200 @@ static void putsVarint(FILE *out, sqlite3_uint64 v){
       v >>= 7;
     }while( v!=0 );
     p[9] &= 0x7f;
-    fwrite(p+n+1, 9-n, 1, out);
+    putBytes(pW, p+n+1, 9-n);
+  }
+}
+
+/*
+** End the current checksum chunk with a 'C' record holding its size and
+** CRC32C. The record itself is not part of any chunk.
+*/
+static void putChecksum(struct ChangesetWriter *p){
+  unsigned char a[13];
+  int i;
+  a[0] = 'C';
+  for(i=0; i<8; i++) a[1+i] = (unsigned char)((sqlite3_uint64)p->nChunk >> (i*8));
+  for(i=0; i<4; i++) a[9+i] = (unsigned char)(p->crc >> (i*8));
+  fwrite(a, 1, sizeof(a), p->out);
+  p->crc = 0;
+  p->nChunk = 0;
+}
+
+static unsigned int dictHash(int type, const char *z, int n){
+  unsigned int h = 2166136261u ^ (unsigned int)type;
+  int i;
+  for(i=0; i<n; i++) h = (h ^ (unsigned char)z[i]) * 16777619u;
+  return h;
+}
+
+static void dictReset(ValueDict *p){
+  p->nEntry = 0;
+  p->nUsed = 0;
+  if( p->aSlot ) memset(p->aSlot, 0, sizeof(int)*p->nSlot);
+}
+
+/*
+** Return the entry number of the value or -1 if it is not in the dictionary.
+*/
+static int dictFind(ValueDict *p, int type, const char *z, int n){
+  unsigned int h;
+  int i;
+  if( p->nSlot==0 ) return -1;
+  h = dictHash(type, z, n);
+  for(i=h & (p->nSlot-1); p->aSlot[i]; i=(i+1) & (p->nSlot-1)){
+    DictEntry *pEntry = &p->aEntry[p->aSlot[i]-1];
+    if( pEntry->h==h && pEntry->type==type && pEntry->n==n
+     && memcmp(p->z+pEntry->iOff, z, n)==0 ){
+      return p->aSlot[i]-1;
+    }
+  }
+  return -1;
+}
+
+/*
+** Add the next entry. If z is NULL the entry only takes up a number.
+*/
+static void dictAdd(ValueDict *p, int type, const char *z, int n){
+  DictEntry *pEntry;
+  int i;
+
+  if( p->nEntry>=p->nEntryAlloc ){
+    p->nEntryAlloc = p->nEntryAlloc*2 + 64;
+    p->aEntry = sqlite3_realloc64(p->aEntry, sizeof(DictEntry)*p->nEntryAlloc);
+    if( p->aEntry==0 ) runtimeError("out of memory");
+  }
+  if( (p->nEntry+1)*2 > p->nSlot ){
+    int j;
+    sqlite3_free(p->aSlot);
+    p->nSlot = p->nSlot ? p->nSlot*2 : 128;
+    p->aSlot = sqlite3_malloc64(sizeof(int)*p->nSlot);
+    if( p->aSlot==0 ) runtimeError("out of memory");
+    memset(p->aSlot, 0, sizeof(int)*p->nSlot);
+    for(j=0; j<p->nEntry; j++){
+      if( p->aEntry[j].type<0 ) continue;
+      for(i=p->aEntry[j].h & (p->nSlot-1); p->aSlot[i]; i=(i+1) & (p->nSlot-1)){}
+      p->aSlot[i] = j+1;
+    }
+  }
+  pEntry = &p->aEntry[p->nEntry++];
+  pEntry->type = z ? type : -1;
+  pEntry->n = n;
+  pEntry->iOff = p->nUsed;
+  if( z==0 ) return;
+
+  pEntry->h = dictHash(type, z, n);
+  if( p->nUsed+n > p->nAlloc ){
+    p->nAlloc = p->nAlloc*2 + n + 1024;
+    p->z = sqlite3_realloc64(p->z, p->nAlloc);
+    if( p->z==0 ) runtimeError("out of memory");
+  }
+  memcpy(p->z+p->nUsed, z, n);
+  p->nUsed += n;
+  for(i=pEntry->h & (p->nSlot-1); p->aSlot[i]; i=(i+1) & (p->nSlot-1)){}
+  p->aSlot[i] = p->nEntry;
+}
+
+int sqlitediff_blob_stream(
+  const struct BlobRef *pRef,
+  sqlite3_int64 nByte,
+  int (*xOutput)(void *pOut, const void *pData, int nData),
+  void *pOut
+){
+  sqlite3_blob *pBlob;
+  char *aBuf;
+  sqlite3_int64 iOff;
+  int n;
+  int rc;
+
+  rc = sqlite3_blob_open(pRef->db, pRef->zDb, pRef->zTab, pRef->zCol,
+                         pRef->iRowid, 0, &pBlob);
+  if( rc ) return rc;
+  aBuf = sqlite3_malloc(SQLITEDIFF_CHUNK);
+  if( aBuf==0 ) rc = SQLITE_NOMEM;
+  for(iOff=0; rc==SQLITE_OK && iOff<nByte; iOff+=n){
+    n = nByte-iOff < SQLITEDIFF_CHUNK ? (int)(nByte-iOff) : SQLITEDIFF_CHUNK;
+    rc = sqlite3_blob_read(pBlob, aBuf, n, (int)iOff);
+    if( rc==SQLITE_OK ) rc = xOutput(pOut, aBuf, n);
   }
+  sqlite3_free(aBuf);
+  sqlite3_blob_close(pBlob);
+  return rc;
+}
+
+static int writerOutput(void *pOut, const void *pData, int nData){
+  struct ChangesetWriter *p = (struct ChangesetWriter*)pOut;
+  putBytes(p, pData, nData);
+  return ferror(p->out) ? SQLITE_IOERR : SQLITE_OK;
 }
 
 /*
-** Write an SQLite value onto out.
+** Write an SQLite value onto p->out. With a dictionary, short TEXT and BLOB
+** values that were written before in this table block are replaced by their
+** entry number. Return non-zero if a streamed BLOB cannot be read, in
+** which case the output is incomplete.
 */
-static void putValue(FILE *out, struct sqlite_value *pVal){
+static int putValue(struct ChangesetWriter *p, struct sqlite_value *pVal){
   int iDType = pVal->type;
   sqlite3_int64 iX;
   double rX;
   sqlite3_uint64 uX;
   int j;
 
-  putc(iDType, out);
+  if( p->nDictMaxSize>0 && pVal->data1.iVal<=p->nDictMaxSize
+   && (iDType==SQLITE_TEXT || iDType==SQLITE_BLOB || iDType==SQLITEDIFF_BLOBREF) ){
+    int n = (int)pVal->data1.iVal;
+    int iEntry = -1;
+    if( iDType!=SQLITEDIFF_BLOBREF ){
+      iEntry = dictFind(&p->dict, iDType, pVal->data2, n);
+    }
+    if( iEntry>=0 ){
+      putByte(p, SQLITEDIFF_DICTREF);
+      putsVarint(p, (sqlite3_uint64)iEntry);
+      return 0;
+    }
+    if( p->dict.nEntry<p->nDictMaxEntry ){
+      dictAdd(&p->dict, iDType,
+              iDType==SQLITEDIFF_BLOBREF ? 0 : pVal->data2, n);
+    }
+  }
+
+  putByte(p, iDType==SQLITEDIFF_BLOBREF ? SQLITE_BLOB : iDType);
   switch( iDType ){
     case SQLITE_INTEGER:
       iX = pVal->data1.iVal;
       memcpy(&uX, &iX, 8);
-      for(j=56; j>=0; j-=8) putc((uX>>j)&0xff, out);
+      for(j=56; j>=0; j-=8) putByte(p, (uX>>j)&0xff);
       break;
     case SQLITE_FLOAT:
       rX = pVal->data1.dVal;
       memcpy(&uX, &rX, 8);
-      for(j=56; j>=0; j-=8) putc((uX>>j)&0xff, out);
+      for(j=56; j>=0; j-=8) putByte(p, (uX>>j)&0xff);
       break;
     case SQLITE_TEXT:
       iX = pVal->data1.iVal;
-      putsVarint(out, (sqlite3_uint64)iX);
-      fwrite(pVal->data2,1,(size_t)iX,out);
+      putsVarint(p, (sqlite3_uint64)iX);
+      putBytes(p, pVal->data2, (size_t)iX);
       break;
     case SQLITE_BLOB:
+    case SQLITEDIFF_DELTA|SQLITE_TEXT:
+    case SQLITEDIFF_DELTA|SQLITE_BLOB:
+      iX = pVal->data1.iVal;
+      putsVarint(p, (sqlite3_uint64)iX);
+      putBytes(p, pVal->data2, (size_t)iX);
+      break;
+    case SQLITEDIFF_BLOBREF: {
+      const struct BlobRef *pRef = (const struct BlobRef*)pVal->data2;
       iX = pVal->data1.iVal;
-      putsVarint(out, (sqlite3_uint64)iX);
-      fwrite(pVal->data2,1,(size_t)iX,out);
+      putsVarint(p, (sqlite3_uint64)iX);
+      if( sqlitediff_blob_stream(pRef, iX, writerOutput, p) ){
+        return runtimeError("cannot read BLOB: %s", sqlite3_errmsg(pRef->db));
+      }
       break;
+    }
     case SQLITE_NULL:
       break;
   }
+  return 0;
 }
 
 void sqlite3_value_to_sqlite_value(sqlite3_value* src, struct sqlite_value* dst) {
@@ -292,317 +577,2530 @@ void sqlite3_value_to_sqlite_value(sqlite3_value* src, struct sqlite_value* dst)
   }
 }
 
-int sqlitediff_write_table(const struct TableInfo* table, void* context)
+static int writeTable(struct ChangesetWriter *p, const struct TableInfo* table)
 {
-  FILE* out = (FILE*) context;
   int nCol = table->nCol;
   int* aiFlg = table->PKs;
   const char* zTab = table->tableName;
   int i;
 
-  putc('T', out);
-  putsVarint(out, (sqlite3_uint64)nCol);
-  for(i=0; i<nCol; i++) putc(aiFlg[i]!=0, out);
-    fwrite(zTab, 1, strlen(zTab), out);
-  putc(0, out);
+  if( table->bProjected && g.opt.bSessionFormat ){
+    return runtimeError("cannot exclude columns of %s in the session format", zTab);
+  }
+
+  putByte(p, table->bProjected ? 'P' : 'T');
+  putsVarint(p, (sqlite3_uint64)nCol);
+  for(i=0; i<nCol; i++) putByte(p, aiFlg[i]!=0);
+    putBytes(p, zTab, strlen(zTab));
+  putByte(p, 0);
+  if( table->bProjected ){
+    for(i=0; i<nCol; i++){
+      putBytes(p, table->columnNames[i], strlen(table->columnNames[i])+1);
+    }
+  }
 
   return 0;
 }
 
-int sqlitediff_write_instruction(const struct Instruction* instr, void* context)
+/*
+** For each changed TEXT or BLOB column of an UPDATE whose new value is at
+** least g.opt.nDeltaThreshold bytes, try a binary delta from the old value.
+** Return an array of nCol values, where a delta that is smaller than the
+** new value has type SQLITEDIFF_DELTA|type and all others type 0. Free the
+** data2 of each entry and the array with sqlite3_free().
+*/
+static struct sqlite_value *updateDeltas(const struct Instruction *instr){
+  int nCol = instr->table->nCol;
+  struct sqlite_value *aDelta;
+  int i;
+
+  aDelta = sqlite3_malloc64(sizeof(struct sqlite_value)*nCol);
+  if( aDelta==0 ) return 0;
+  for(i=0; i<nCol; i++){
+    const struct sqlite_value *pOld = &instr->values[i];
+    const struct sqlite_value *pNew = &instr->values[nCol+i];
+    sqlite3_int64 nDelta;
+
+    aDelta[i].type = 0;
+    aDelta[i].data2 = 0;
+    if( !instr->valFlag[i] || instr->table->PKs[i] ) continue;
+    if( pOld->type!=SQLITE_TEXT && pOld->type!=SQLITE_BLOB ) continue;
+    if( pNew->type!=SQLITE_TEXT && pNew->type!=SQLITE_BLOB ) continue;
+    if( pNew->data1.iVal<g.opt.nDeltaThreshold ) continue;
+
+    aDelta[i].data2 = (const char*)sqlitediff_delta_create(
+        (const unsigned char*)pOld->data2, pOld->data1.iVal,
+        (const unsigned char*)pNew->data2, pNew->data1.iVal,
+        pNew->data1.iVal-1, &nDelta);
+    if( aDelta[i].data2 ){
+      aDelta[i].type = SQLITEDIFF_DELTA | pNew->type;
+      aDelta[i].data1.iVal = nDelta;
+    }
+  }
+  return aDelta;
+}
+
+/* Number of bytes putsVarint() writes for v */
+static int varintLen(sqlite3_uint64 v){
+  int n = 1;
+  while( v>=0x80 && n<9 ){
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/*
+** Return how the changed columns of an UPDATE are best named: 0 to write a
+** 0x00 placeholder for every unchanged value, or SQLITEDIFF_UPDATE_BITMAP
+** or SQLITEDIFF_UPDATE_LIST, whichever of the three is smallest. The
+** session format only knows placeholders.
+*/
+static int updateEncoding(const struct Instruction *instr){
+  int nCol = instr->table->nCol;
+  int nChanged = 0;
+  int nZero = 0;                /* Placeholders written without a column set */
+  int nList = 0;                /* Bytes of the column numbers of a list */
+  int nBitmap = (nCol+7)/8;
+  int i;
+  if( g.opt.bSessionFormat ) return 0;
+  for(i=0; i<nCol; i++){
+    if( instr->valFlag[i] ){
+      nChanged++;
+      nList += varintLen(i);
+    }else{
+      nZero += instr->table->PKs[i] ? 1 : 2;
+    }
+  }
+  nList += varintLen(nChanged);
+  if( nZero<=nBitmap && nZero<=nList ) return 0;
+  return nBitmap<=nList ? SQLITEDIFF_UPDATE_BITMAP : SQLITEDIFF_UPDATE_LIST;
+}
+
+static int writeInstruction(struct ChangesetWriter *p, const struct Instruction* instr)
 {
+  int rc = 0;
   int i;
-  FILE* out = (FILE*) context;
   int iType = instr->iType;
   int nCol = instr->table->nCol;
+  int eUpdate = iType==SQLITE_UPDATE ? updateEncoding(instr) : 0;
 
-  putc(iType, out);
-  putc(0, out);
+  putByte(p, iType);
+  putByte(p, eUpdate);
 
   switch( iType ){
     case SQLITE_UPDATE: {
-     for(i=0; i<(nCol*2); i++){
-      if (instr->valFlag[i % nCol] || (i < nCol && instr->table->PKs[i])){
-        putValue(out, &instr->values[i]);
+     struct sqlite_value *aDelta = 0;
+     if( eUpdate==SQLITEDIFF_UPDATE_BITMAP ){
+       for(i=0; i<nCol; i+=8){
+         int k, b = 0;
+         for(k=0; k<8 && i+k<nCol; k++){
+           if( instr->valFlag[i+k] ) b |= 1<<k;
+         }
+         putByte(p, b);
+       }
+     }else if( eUpdate==SQLITEDIFF_UPDATE_LIST ){
+       int nChanged = 0;
+       for(i=0; i<nCol; i++) nChanged += instr->valFlag[i]!=0;
+       putsVarint(p, (sqlite3_uint64)nChanged);
+       for(i=0; i<nCol; i++){
+         if( instr->valFlag[i] ) putsVarint(p, (sqlite3_uint64)i);
+       }
+     }
+     if( g.opt.nDeltaThreshold>0 ) aDelta = updateDeltas(instr);
+     for(i=0; rc==0 && i<(nCol*2); i++){
+      if( eUpdate && !instr->valFlag[i % nCol] && !(i < nCol && instr->table->PKs[i]) ){
+        /* Left out, the column set says it is unchanged */
+        continue;
+      }
+      if( aDelta && aDelta[i % nCol].type ){
+        /* The delta carries a hash of the old value instead */
+        if( i < nCol ){
+          putByte(p, 0);
+        }else{
+          rc = putValue(p, &aDelta[i % nCol]);
+        }
+      }else if (instr->valFlag[i % nCol] || (i < nCol && instr->table->PKs[i])){
+        rc = putValue(p, &instr->values[i]);
       }else{
-        putc(0, out);
+        putByte(p, 0);
       }
     }
+    if( aDelta ){
+      for(i=0; i<nCol; i++) sqlite3_free((void*)aDelta[i].data2);
+      sqlite3_free(aDelta);
+    }
     break;
   }
     case SQLITE_INSERT:
     case SQLITE_DELETE: {
-      for(i=0; i<nCol; i++){
+      for(i=0; rc==0 && i<nCol; i++){
         if (instr->values[i].type){
-          putValue(out, &instr->values[i]);
+          rc = putValue(p, &instr->values[i]);
         }else{
-          putc(0, out);
+          putByte(p, 0);
         }
       }
       break;
     }
   }
 
-  return 0;
+  return rc;
 }
 
 
 /*
-** Generate a CHANGESET for all differences from main.zTab to aux.zTab.
+** Return 1 if table zTab has a rowid, i.e. is not a WITHOUT ROWID table.
 */
-static int changeset_one_table(const char *zTab, TableCallback tableCallback, InstrCallback instrCallback, void* context){
-  sqlite3_stmt *pStmt;          /* SQL statment */
-  char *zId = safeId(zTab);     /* Escaped name of the table */
-  char **azCol = 0;             /* List of escaped column names */
-  int nCol = 0;                 /* Number of columns */
-  int *aiFlg = 0;               /* 0 if column is not part of PK */
-  int *aiPk = 0;                /* Column numbers for each PK column */
-  int nPk = 0;                  /* Number of PRIMARY KEY columns */
-  Str sql;                      /* SQL for the diff query */
-  int i, k;                     /* Loop counters */
-  const char *zSep;             /* List separator */
-  int rc = SQLITE_OK;
-
-  /* Check that the schemas of the two tables match. Exit early otherwise. */
-  checkSchemasMatch(zTab);
-
-  pStmt = db_prepare("PRAGMA main.table_info=%Q", zTab);
-  while( SQLITE_ROW==sqlite3_step(pStmt) ){
-    nCol++;
-    azCol = sqlite3_realloc(azCol, sizeof(char*)*nCol);
-    if( azCol==0 ) runtimeError("out of memory");
-    aiFlg = sqlite3_realloc(aiFlg, sizeof(int)*nCol);
-    if( aiFlg==0 ) runtimeError("out of memory");
-    azCol[nCol-1] = safeId((const char*)sqlite3_column_text(pStmt,1));
-    aiFlg[nCol-1] = i = sqlite3_column_int(pStmt,5);
-    if( i>0 ){
-      if( i>nPk ){
-        nPk = i;
-        aiPk = sqlite3_realloc(aiPk, sizeof(int)*nPk);
-        if( aiPk==0 ) runtimeError("out of memory");
-      }
-      aiPk[i-1] = nCol-1;
-    }
-  }
+static int tableHasRowid(const char *zTab){
+  sqlite3_stmt *pStmt;
+  char *zSql = sqlite3_mprintf("SELECT rowid FROM main.\"%w\"", zTab);
+  int rc = sqlite3_prepare_v2(g.db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
   sqlite3_finalize(pStmt);
-  if( nPk==0 ) goto end_changeset_one_table; 
-  strInit(&sql);
-  if( nCol>nPk ){
-    strPrintf(&sql, "SELECT %d", SQLITE_UPDATE);
-    for(i=0; i<nCol; i++){
-      if( aiFlg[i] ){
-        strPrintf(&sql, ",\n       A.%s", azCol[i]);
-      }else{
-        strPrintf(&sql, ",\n       A.%s IS NOT B.%s, A.%s, B.%s",
-          azCol[i], azCol[i], azCol[i], azCol[i]);
-      }
-    }
-    strPrintf(&sql,"\n  FROM main.%s A, aux.%s B\n", zId, zId);
-    zSep = " WHERE";
-    for(i=0; i<nPk; i++){
-      strPrintf(&sql, "%s A.%s=B.%s", zSep, azCol[aiPk[i]], azCol[aiPk[i]]);
-      zSep = " AND";
-    }
-    zSep = "\n   AND (";
-    for(i=0; i<nCol; i++){
-      if( aiFlg[i] ) continue;
-      strPrintf(&sql, "%sA.%s IS NOT B.%s", zSep, azCol[i], azCol[i]);
-      zSep = " OR\n        ";
-    }
-    strPrintf(&sql,")\n UNION ALL\n");
-  }
-  strPrintf(&sql, "SELECT %d", SQLITE_DELETE);
-  for(i=0; i<nCol; i++){
-    if( aiFlg[i] ){
-      strPrintf(&sql, ",\n       A.%s", azCol[i]);
-    }else{
-      strPrintf(&sql, ",\n       1, A.%s, NULL", azCol[i]);
-    }
-  }
-  strPrintf(&sql, "\n  FROM main.%s A\n", zId);
-  strPrintf(&sql, " WHERE NOT EXISTS(SELECT 1 FROM aux.%s B\n", zId);
-  zSep =          "                   WHERE";
-  for(i=0; i<nPk; i++){
-    strPrintf(&sql, "%s A.%s=B.%s", zSep, azCol[aiPk[i]], azCol[aiPk[i]]);
-    zSep = " AND";
+  return rc==SQLITE_OK;
+}
+
+/*
+** Append the value of column zCol of zAlias ("A", "B" or NULL for a NULL
+** value) to a SELECT list. If bStream is true this takes two columns: the
+** value, and the size of BLOBs of at least g.opt.nStreamThreshold bytes.
+** The value of those is left NULL, so that SQLite never reads it.
+*/
+static void selectValue(Str *pSql, const char *zAlias, const char *zCol, int bStream){
+  if( zAlias==0 ){
+    strPrintf(pSql, bStream ? "NULL, NULL" : "NULL");
+  }else if( bStream ){
+    strPrintf(pSql,
+      "CASE WHEN typeof(%s.%s)='blob' AND length(%s.%s)>=%lld THEN NULL"
+      " ELSE %s.%s END,"
+      " CASE WHEN typeof(%s.%s)='blob' AND length(%s.%s)>=%lld"
+      " THEN length(%s.%s) END",
+      zAlias, zCol, zAlias, zCol, g.opt.nStreamThreshold, zAlias, zCol,
+      zAlias, zCol, zAlias, zCol, g.opt.nStreamThreshold, zAlias, zCol);
+  }else{
+    strPrintf(pSql, "%s.%s", zAlias, zCol);
   }
-  strPrintf(&sql, ")\n UNION ALL\n");
-  strPrintf(&sql, "SELECT %d", SQLITE_INSERT);
-  for(i=0; i<nCol; i++){
-    if( aiFlg[i] ){
-      strPrintf(&sql, ",\n       B.%s", azCol[i]);
-    }else{
-      strPrintf(&sql, ",\n       1, NULL, B.%s", azCol[i]);
-    }
+}
+
+/*
+** Read the value selected by selectValue() at result column iCol. A large
+** BLOB becomes a SQLITEDIFF_BLOBREF to pRef, which is filled in from the
+** rowid in result column iRowid of database zDb.
+*/
+static void columnToValue(
+  sqlite3_stmt *pStmt,
+  int iCol,
+  int bStream,
+  const char *zDb,
+  int iRowid,
+  struct BlobRef *pRef,
+  struct sqlite_value *pVal
+){
+  if( bStream && sqlite3_column_type(pStmt, iCol+1)!=SQLITE_NULL ){
+    pRef->zDb = zDb;
+    pRef->iRowid = sqlite3_column_int64(pStmt, iRowid);
+    pVal->type = SQLITEDIFF_BLOBREF;
+    pVal->data1.iVal = sqlite3_column_int64(pStmt, iCol+1);
+    pVal->data2 = (const char*)pRef;
+  }else{
+    sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,iCol), pVal);
   }
-  strPrintf(&sql, "\n  FROM aux.%s B\n", zId);
-  strPrintf(&sql, " WHERE NOT EXISTS(SELECT 1 FROM main.%s A\n", zId);
-  zSep =          "                   WHERE";
-  for(i=0; i<nPk; i++){
-    strPrintf(&sql, "%s A.%s=B.%s", zSep, azCol[aiPk[i]], azCol[aiPk[i]]);
-    zSep = " AND";
+}
+
+int sqlitediff_write_table(const struct TableInfo* table, void* context)
+{
+  struct ChangesetWriter w;
+  memset(&w, 0, sizeof(w));
+  w.out = (FILE*) context;
+  return writeTable(&w, table);
+}
+
+int sqlitediff_write_instruction(const struct Instruction* instr, void* context)
+{
+  struct ChangesetWriter w;
+  memset(&w, 0, sizeof(w));
+  w.out = (FILE*) context;
+  return writeInstruction(&w, instr);
+}
+
+struct ChangesetWriter *sqlitediff_writer_open(FILE *out){
+  struct ChangesetWriter *p = sqlite3_malloc(sizeof(struct ChangesetWriter));
+  if( p==0 ) return 0;
+  memset(p, 0, sizeof(*p));
+  p->out = out;
+  p->nDictMaxSize = g.opt.nDictMaxSize;
+  p->nDictMaxEntry = SQLITEDIFF_DICT_ENTRIES;
+  p->bChecksum = g.opt.bChecksum;
+  return p;
+}
+
+/*
+** Write the records that precede the first table block: 'K' if the
+** changeset is checksummed, 'D' if it uses a dictionary.
+*/
+static void writeHeader(struct ChangesetWriter *p){
+  if( p->bHeader ) return;
+  if( p->bChecksum ){
+    putByte(p, 'K');
+    putByte(p, SQLITEDIFF_CHECKSUM_CRC32C);
   }
-  strPrintf(&sql, ")\n");
-  strPrintf(&sql, " ORDER BY");
-  zSep = " ";
-  for(i=0; i<nPk; i++){
-    strPrintf(&sql, "%s %d", zSep, aiPk[i]+2);
-    zSep = ",";
+  if( p->nDictMaxSize>0 ){
+    putByte(p, 'D');
+    putsVarint(p, (sqlite3_uint64)p->nDictMaxSize);
+    putsVarint(p, (sqlite3_uint64)p->nDictMaxEntry);
   }
-  strPrintf(&sql, ";\n");
+  p->bHeader = 1;
+}
 
-  if( g.fDebug ){ 
-    printf("SQL for %s:\n%s\n", zId, sql.z);
-    //goto end_changeset_one_table;
+void sqlitediff_writer_close(struct ChangesetWriter *p){
+  if( p==0 ) return;
+  if( p->bChecksum ){
+    writeHeader(p);
+    putChecksum(p);
   }
+  sqlite3_free(p->dict.aEntry);
+  sqlite3_free(p->dict.aSlot);
+  sqlite3_free(p->dict.z);
+  sqlite3_free(p);
+}
 
-  struct TableInfo tableInfo;
-  tableInfo.PKs = aiFlg;
-  tableInfo.nCol = nCol;
-  tableInfo.tableName = zTab;
-  tableInfo.columnNames = azCol;
+int sqlitediff_writer_table(const struct TableInfo* table, void* pWriter)
+{
+  struct ChangesetWriter *p = (struct ChangesetWriter*)pWriter;
+  writeHeader(p);
+  dictReset(&p->dict);
+  return writeTable(p, table);
+}
 
-  if (tableCallback) {
-    rc = tableCallback(&tableInfo, context);
+int sqlitediff_writer_instruction(const struct Instruction* instr, void* pWriter)
+{
+  struct ChangesetWriter *p = (struct ChangesetWriter*)pWriter;
+  int rc = writeInstruction(p, instr);
+  if( p->bChecksum && p->nChunk>=SQLITEDIFF_CHECKSUM_CHUNK ){
+    putChecksum(p);
   }
+  return rc;
+}
 
-  pStmt = db_prepare("%s", sql.z);
-
-  struct Instruction instr;
+/*
+** Return 1 if SQLite would need a temporary b-tree to run zSql, for example
+** to sort the rows for an ORDER BY that no index delivers.
+*/
+static int planUsesSorter(const char *zSql){
+  sqlite3_stmt *pStmt = db_prepare("EXPLAIN QUERY PLAN %s", zSql);
+  int bSorter = 0;
+  while( pStmt && SQLITE_ROW==sqlite3_step(pStmt) ){
+    const char *zDetail = (const char*)sqlite3_column_text(pStmt, 3);
+    if( zDetail && strstr(zDetail, "TEMP B-TREE") ) bSorter = 1;
+  }
+  sqlite3_finalize(pStmt);
+  return bSorter;
+}
+
+/*
+** Connection and process settings applyMemoryBudget() changed, which
+** restoreMemoryBudget() puts back when the diff ends.
+*/
+typedef struct SavedBudget SavedBudget;
+struct SavedBudget {
+  int bSaved;
+  sqlite3_int64 nHeapLimit;
+  sqlite3_int64 nCacheMain, nCacheAux;
+  sqlite3_int64 nMmapMain, nMmapAux;
+  sqlite3_int64 eTempStore;
+};
+
+/* Return the single integer result of zPragma, 0 if it has none */
+static sqlite3_int64 pragmaValue(const char *zPragma){
+  sqlite3_stmt *pStmt;
+  sqlite3_int64 v = 0;
+  if( sqlite3_prepare_v2(g.db, zPragma, -1, &pStmt, 0)==SQLITE_OK
+   && SQLITE_ROW==sqlite3_step(pStmt) ){
+    v = sqlite3_column_int64(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return v;
+}
+
+/*
+** Limit the memory the diff may use to g.opt.nMemoryBudget: a soft heap
+** limit, and page caches of a quarter of the budget each for main and aux.
+** The cache size of main also bounds the memory of SQLite's sorter before it
+** spills to temporary files, which must go to disk. The previous settings
+** are saved in pSaved. The heap limit is process-wide while the diff runs.
+*/
+static void applyMemoryBudget(SavedBudget *pSaved){
+  memset(pSaved, 0, sizeof(*pSaved));
+  if( g.opt.nMemoryBudget>0 ){
+    sqlite3_int64 nCacheKiB = g.opt.nMemoryBudget/4/1024;
+    char *zSql = sqlite3_mprintf(
+      "PRAGMA main.cache_size=-%lld;"
+      "PRAGMA aux.cache_size=-%lld;"
+      "PRAGMA temp_store=FILE;"
+      "PRAGMA main.mmap_size=0;"
+      "PRAGMA aux.mmap_size=0;", nCacheKiB, nCacheKiB);
+    pSaved->bSaved = 1;
+    pSaved->nCacheMain = pragmaValue("PRAGMA main.cache_size");
+    pSaved->nCacheAux = pragmaValue("PRAGMA aux.cache_size");
+    pSaved->nMmapMain = pragmaValue("PRAGMA main.mmap_size");
+    pSaved->nMmapAux = pragmaValue("PRAGMA aux.mmap_size");
+    pSaved->eTempStore = pragmaValue("PRAGMA temp_store");
+    pSaved->nHeapLimit = sqlite3_soft_heap_limit64(g.opt.nMemoryBudget);
+    sqlite3_exec(g.db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+}
+
+static void restoreMemoryBudget(const SavedBudget *pSaved){
+  char *zSql;
+  if( !pSaved->bSaved ) return;
+  zSql = sqlite3_mprintf(
+    "PRAGMA main.cache_size=%lld;"
+    "PRAGMA aux.cache_size=%lld;"
+    "PRAGMA temp_store=%lld;"
+    "PRAGMA main.mmap_size=%lld;"
+    "PRAGMA aux.mmap_size=%lld;",
+    pSaved->nCacheMain, pSaved->nCacheAux, pSaved->eTempStore,
+    pSaved->nMmapMain, pSaved->nMmapAux);
+  sqlite3_exec(g.db, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+  sqlite3_soft_heap_limit64(pSaved->nHeapLimit);
+}
+
+void sqlitediff_stats(struct DiffStats *pStats){
+  *pStats = g.stats;
+}
+
+/*
+** Return the escaped name of the capture table of zTab in aux if the diff
+** is restricted to captured rows and zTab has one, NULL otherwise. Tables
+** without one are scanned in full.
+*/
+static char *captureTable(const char *zTab){
+  sqlite3_stmt *pStmt;
+  char *zName;
+  char *zId = 0;
+  if( !g.opt.bCaptured ) return 0;
+  zName = sqlite3_mprintf("%s%s", SQLITEDIFF_CAPTURE_PREFIX, zTab);
+  pStmt = db_prepare("SELECT 1 FROM aux.sqlite_master WHERE type='table' AND name=%Q", zName);
+  if( SQLITE_ROW==sqlite3_step(pStmt) ) zId = safeId(zName);
+  sqlite3_finalize(pStmt);
+  sqlite3_free(zName);
+  return zId;
+}
+
+/*
+** Restrict a branch of the diff query to the rows whose PRIMARY KEY, read
+** from zAlias, is in capture table zCapture, so the diff costs a lookup per
+** captured row instead of a scan.
+*/
+static void captureFilter(Str *pSql, const char *zAlias, const char *zCapture,
+                          char **azCol, int *aiPk, int nPk){
+  const char *zSep = "(";
+  int i;
+  if( zCapture==0 ) return;
+  strPrintf(pSql, "\n   AND ");
+  for(i=0; i<nPk; i++){
+    strPrintf(pSql, "%s%s.%s", zSep, zAlias, azCol[aiPk[i]]);
+    zSep = ", ";
+  }
+  strPrintf(pSql, ") IN (SELECT * FROM aux.%s)", zCapture);
+}
+
+int sqlitediff_capture_install(sqlite3 *db, const char *zDb, const char *zTab){
+  sqlite3_stmt *pStmt;
+  Str cols, news, olds;
+  char *zSql;
+  char *zCapture;
+  int rc = SQLITE_OK;
+  int i;
+
+  if( zTab==0 ){
+    char *zList = sqlite3_mprintf(
+        "SELECT name FROM \"%w\".sqlite_master WHERE type='table'"
+        " AND name NOT LIKE 'sqlite%%' AND sql NOT LIKE 'CREATE VIRTUAL%%'", zDb);
+    rc = sqlite3_prepare_v2(db, zList, -1, &pStmt, 0);
+    sqlite3_free(zList);
+    while( rc==SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
+      rc = sqlitediff_capture_install(db, zDb, (const char*)sqlite3_column_text(pStmt, 0));
+    }
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+
+  /* PRIMARY KEY columns in PK order */
+  zSql = sqlite3_mprintf("SELECT name FROM pragma_table_info(%Q, %Q) WHERE pk>0 ORDER BY pk", zTab, zDb);
+  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if( rc ) return rc;
+  strInit(&cols);
+  strInit(&news);
+  strInit(&olds);
+  for(i=0; SQLITE_ROW==sqlite3_step(pStmt); i++){
+    const char *zCol = (const char*)sqlite3_column_text(pStmt, 0);
+    strPrintf(&cols, "%s\"%w\"", i ? ", " : "", zCol);
+    strPrintf(&news, "%snew.\"%w\"", i ? ", " : "", zCol);
+    strPrintf(&olds, "%sold.\"%w\"", i ? ", " : "", zCol);
+  }
+  sqlite3_finalize(pStmt);
+
+  /* Tables without a PRIMARY KEY are not diffed */
+  if( i>0 ){
+    zCapture = sqlite3_mprintf("%s%s", SQLITEDIFF_CAPTURE_PREFIX, zTab);
+    zSql = sqlite3_mprintf(
+      "CREATE TABLE IF NOT EXISTS \"%w\".\"%w\" (%s, UNIQUE(%s));\n"
+      "CREATE TRIGGER IF NOT EXISTS \"%w\".\"%w_insert\" AFTER INSERT ON \"%w\"\n"
+      "BEGIN INSERT OR IGNORE INTO \"%w\" VALUES (%s); END;\n"
+      "CREATE TRIGGER IF NOT EXISTS \"%w\".\"%w_update\" AFTER UPDATE ON \"%w\"\n"
+      "BEGIN INSERT OR IGNORE INTO \"%w\" VALUES (%s), (%s); END;\n"
+      "CREATE TRIGGER IF NOT EXISTS \"%w\".\"%w_delete\" AFTER DELETE ON \"%w\"\n"
+      "BEGIN INSERT OR IGNORE INTO \"%w\" VALUES (%s); END;\n",
+      zDb, zCapture, cols.z, cols.z,
+      zDb, zCapture, zTab, zCapture, news.z,
+      zDb, zCapture, zTab, zCapture, olds.z, news.z,
+      zDb, zCapture, zTab, zCapture, olds.z);
+    rc = sqlite3_exec(db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+    sqlite3_free(zCapture);
+  }
+  sqlite3_free(cols.z);
+  sqlite3_free(news.z);
+  sqlite3_free(olds.z);
+  return rc;
+}
+
+int sqlitediff_capture_reset(sqlite3 *db, const char *zDb){
+  sqlite3_stmt *pStmt;
+  char *zSql = sqlite3_mprintf(
+      "SELECT name FROM \"%w\".sqlite_master WHERE type='table' AND substr(name, 1, %d)='%q'",
+      zDb, (int)sizeof(SQLITEDIFF_CAPTURE_PREFIX)-1, SQLITEDIFF_CAPTURE_PREFIX);
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  while( rc==SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
+    zSql = sqlite3_mprintf("DELETE FROM \"%w\".\"%w\"", zDb, sqlite3_column_text(pStmt, 0));
+    rc = sqlite3_exec(db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  sqlite3_finalize(pStmt);
+  return rc;
+}
+
+/*
+** State of slitediff_diff_prepared_batch(): an InstrCallback that copies
+** rows into contiguous arrays and hands them on nBatch at a time. The data
+** of TEXT and BLOB values is appended to z[], their data2 holding the
+** offset into it until the batch is delivered.
+*/
+typedef struct InstrBatch InstrBatch;
+struct InstrBatch {
+  TableCallback xTable;         /* Callbacks of the caller */
+  BatchCallback xBatch;
+  void *pCtx;
+  int nMax;                     /* Instructions per batch */
+  int n;                        /* Instructions in the current batch */
+  int nCol;                     /* Columns of the current table */
+  int nColAlloc;                /* Columns the arrays are allocated for */
+  struct Instruction *aInstr;   /* nMax instructions */
+  struct sqlite_value *aVal;    /* nMax*nColAlloc*2 values */
+  int *aFlag;                   /* nMax*nColAlloc changed flags */
+  struct BlobRef *aRef;         /* Copies of streamed BLOB references */
+  char *z;                      /* TEXT and BLOB bytes */
+  sqlite3_int64 nUsed;          /* Bytes used in z[] */
+  sqlite3_int64 nAlloc;         /* Bytes allocated in z[] */
+};
+
+static int batchFlush(InstrBatch *p){
+  int i, rc;
+  if( p->n==0 ) return SQLITE_OK;
+  for(i=0; i<p->n*p->nCol*2; i++){
+    struct sqlite_value *pVal = &p->aVal[i];
+    if( pVal->type==SQLITE_TEXT || pVal->type==SQLITE_BLOB ){
+      pVal->data2 = p->z + (sqlite3_int64)(intptr_t)pVal->data2;
+    }
+  }
+  rc = p->xBatch(p->aInstr, p->n, p->pCtx);
+  p->n = 0;
+  p->nUsed = 0;
+  return rc;
+}
+
+static int batchTable(const struct TableInfo *table, void *pCtx){
+  InstrBatch *p = (InstrBatch*)pCtx;
+  int rc = batchFlush(p);
+  if( rc ) return rc;
+  if( table->nCol>p->nColAlloc ){
+    int nCol = table->nCol;
+    sqlite3_free(p->aVal);
+    sqlite3_free(p->aFlag);
+    sqlite3_free(p->aRef);
+    p->aVal = sqlite3_malloc64(sizeof(struct sqlite_value)*p->nMax*nCol*2);
+    p->aFlag = sqlite3_malloc64(sizeof(int)*p->nMax*nCol);
+    p->aRef = sqlite3_malloc64(sizeof(struct BlobRef)*p->nMax*nCol*2);
+    p->nColAlloc = (p->aVal && p->aFlag && p->aRef) ? nCol : 0;
+    if( p->nColAlloc==0 ) return SQLITE_NOMEM;
+  }
+  p->nCol = table->nCol;
+  return p->xTable ? p->xTable(table, p->pCtx) : SQLITE_OK;
+}
+
+static int batchInstruction(const struct Instruction *instr, void *pCtx){
+  InstrBatch *p = (InstrBatch*)pCtx;
+  int nCol = p->nCol;
+  int nVal = instr->iType==SQLITE_UPDATE ? nCol*2 : nCol;
+  struct Instruction *pOut = &p->aInstr[p->n];
+  int i;
+
+  pOut->table = instr->table;
+  pOut->iType = instr->iType;
+  pOut->values = &p->aVal[p->n*nCol*2];
+  pOut->valFlag = &p->aFlag[p->n*nCol];
+  for(i=0; i<nVal; i++){
+    struct sqlite_value *pVal = &pOut->values[i];
+    *pVal = instr->values[i];
+    if( pVal->type==SQLITE_TEXT || pVal->type==SQLITE_BLOB ){
+      sqlite3_int64 n = pVal->data1.iVal;
+      if( p->nUsed+n>p->nAlloc ){
+        sqlite3_int64 nNew = (p->nAlloc + n)*2 + 1000;
+        char *zNew = sqlite3_realloc64(p->z, nNew);
+        if( zNew==0 ) return SQLITE_NOMEM;
+        p->z = zNew;
+        p->nAlloc = nNew;
+      }
+      if( n>0 ) memcpy(p->z + p->nUsed, pVal->data2, n);
+      pVal->data2 = (const char*)(intptr_t)p->nUsed;
+      p->nUsed += n;
+    }else if( pVal->type==SQLITEDIFF_BLOBREF ){
+      struct BlobRef *pRef = &p->aRef[p->n*nCol*2 + i];
+      *pRef = *(const struct BlobRef*)pVal->data2;
+      pVal->data2 = (const char*)pRef;
+    }
+  }
+  for(i=nVal; i<nCol*2; i++) pOut->values[i].type = 0;
+  for(i=0; i<nCol; i++){
+    pOut->valFlag[i] = instr->valFlag ? instr->valFlag[i] : 0;
+  }
+  if( ++p->n==p->nMax ) return batchFlush(p);
+  return SQLITE_OK;
+}
+
+/*
+** Compare two values the way an ORDER BY with the BINARY collation does:
+** NULL, then numbers, then TEXT, then BLOB.
+*/
+static int compareValues(sqlite3_value *pA, sqlite3_value *pB){
+  static const int aClass[] = { 0, 1, 1, 2, 3, 0 };
+  int tA = sqlite3_value_type(pA);
+  int tB = sqlite3_value_type(pB);
+  int nA, nB, c;
+  if( aClass[tA]!=aClass[tB] ) return aClass[tA] - aClass[tB];
+  switch( aClass[tA] ){
+    case 1: {
+      if( tA==SQLITE_INTEGER && tB==SQLITE_INTEGER ){
+        sqlite3_int64 iA = sqlite3_value_int64(pA);
+        sqlite3_int64 iB = sqlite3_value_int64(pB);
+        return (iA > iB) - (iA < iB);
+      }else{
+        double rA = sqlite3_value_double(pA);
+        double rB = sqlite3_value_double(pB);
+        return (rA > rB) - (rA < rB);
+      }
+    }
+    case 2:
+    case 3: {
+      const void *zA = tA==SQLITE_TEXT ? (const void*)sqlite3_value_text(pA)
+                                       : sqlite3_value_blob(pA);
+      const void *zB = tB==SQLITE_TEXT ? (const void*)sqlite3_value_text(pB)
+                                       : sqlite3_value_blob(pB);
+      nA = sqlite3_value_bytes(pA);
+      nB = sqlite3_value_bytes(pB);
+      c = memcmp(zA, zB, nA<nB ? nA : nB);
+      return c ? c : nA - nB;
+    }
+  }
+  return 0;
+}
+
+/* Compare the PRIMARY KEYs of the current rows of pA and pB */
+static int multiComparePk(sqlite3_stmt *pA, sqlite3_stmt *pB, const int *aiPk, int nPk){
+  int i, c;
+  for(i=0; i<nPk; i++){
+    c = compareValues(sqlite3_column_value(pA, aiPk[i]),
+                          sqlite3_column_value(pB, aiPk[i]));
+    if( c ) return c;
+  }
+  return 0;
+}
+
+/*
+** What the diff of one table needs that depends only on the schemas and the
+** options: its columns and its prepared diff query. Built for every diff,
+** or kept between diffs by a DiffCache.
+*/
+typedef struct TablePlan TablePlan;
+struct TablePlan {
+  char *zTab;                   /* Name of the table */
+  char *zId;                    /* Escaped name of the table */
+  char **azCol;                 /* List of escaped column names */
+  char **azName;                /* List of unescaped column names */
+  int nCol;                     /* Number of columns */
+  int *aiFlg;                   /* 0 if column is not part of PK */
+  int *aiPk;                    /* Column numbers for each PK column */
+  int nPk;                      /* Number of PRIMARY KEY columns */
+  int bProjected;               /* True if some columns are excluded */
+  int bStream;                  /* True if large BLOBs are streamed */
+  int w;                        /* Result columns per selected value, 0 for a keys join */
+  int f;                        /* Result columns of a changed flag, 0 or 1 */
+  int bCached;                  /* True if owned by g.pCache */
+  int eStrategy;                /* SQLITEDIFF_STRATEGY_JOIN or _MERGE */
+  sqlite3_stmt *pStmt;          /* The diff query, NULL without a PRIMARY KEY */
+  sqlite3_stmt *pStmtB;         /* For a merge: the rows of aux, pStmt of main */
+  sqlite3_stmt *pRowA;          /* For a hashed merge or a keys join: a row of main by key */
+  sqlite3_stmt *pRowB;          /* The same for aux */
+  int *aiScanPk;                /* Hashed merge: scan columns of the PK */
+  int iKey;                     /* Scan column of the key of pRowA */
+  int iKeyB;                    /* Scan column of the key of pRowB */
+};
+
+static void planFree(TablePlan *p){
+  if( p==0 ) return;
+  sqlite3_finalize(p->pStmt);
+  sqlite3_finalize(p->pStmtB);
+  sqlite3_finalize(p->pRowA);
+  sqlite3_finalize(p->pRowB);
+  while( p->nCol>0 ){
+    sqlite3_free(p->azCol[--p->nCol]);
+    sqlite3_free(p->azName[p->nCol]);
+  }
+  sqlite3_free(p->azCol);
+  sqlite3_free(p->azName);
+  sqlite3_free(p->aiFlg);
+  sqlite3_free(p->aiPk);
+  sqlite3_free(p->aiScanPk);
+  sqlite3_free(p->zId);
+  sqlite3_free(p->zTab);
+  sqlite3_free(p);
+}
+
+/*
+** Tables of fewer rows than this, in main and aux together, are joined:
+** one cached query is the cheapest start, and they are too small for the
+** strategy to matter. It is also the most rows counted for an estimate.
+*/
+#define PLAN_SMALL_TABLE 10000
+
+/* Assumed number of entries per b-tree page, to estimate a lookup */
+#define PLAN_FANOUT 100
+
+/* Cost of a merged row over a row the join visits in the VDBE */
+#define PLAN_MERGE_ROW 2
+
+/*
+** Merged tables with at least this many columns outside the PRIMARY KEY
+** are scanned as the key and a sqlitediff_rowhash() of the other columns,
+** and only rows whose hashes differ, or that are inserted or deleted, are
+** read in full.
+*/
+#define PLAN_HASH_COLUMNS 8
+
+/* ... unless the sides differ in size by more than 1 in this many of the
+** smaller one's rows: the rows that cannot match each cost a lookup */
+#define PLAN_HASH_UNMATCHED 4
+
+/* Fewest bytes a table b-tree row takes on a page, with its cell pointer */
+#define PLAN_MIN_ROW_SIZE 4
+
+/* Return the estimated number of pages visited by a lookup among nRow rows */
+static sqlite3_int64 planDepth(sqlite3_int64 nRow){
+  sqlite3_int64 nDepth = 1;
+  for(; nRow>PLAN_FANOUT; nRow/=PLAN_FANOUT) nDepth++;
+  return nDepth;
+}
+
+/*
+** Return an estimate of the rows of zDb.zTab and set *pzHow to how it was
+** made: from sqlite_stat1, from the rowid range of a rowid table, which
+** costs two lookups, or by counting at most PLAN_SMALL_TABLE rows.
+*/
+static sqlite3_int64 planRows(const char *zDb, const char *zTab, const char *zId,
+                              int bRowid, const char **pzHow){
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_int64 nRow = -1;
+  sqlite3_int64 nMax;
+  char *zSql;
+
+  /* No estimate can exceed the rows that fit in the file: a sparse rowid
+  ** range or a stale stat1 would otherwise overflow the costs */
+  zSql = sqlite3_mprintf("PRAGMA %s.page_count", zDb);
+  nMax = pragmaValue(zSql);
+  sqlite3_free(zSql);
+  zSql = sqlite3_mprintf("PRAGMA %s.page_size", zDb);
+  nMax = nMax*pragmaValue(zSql)/PLAN_MIN_ROW_SIZE;
+  sqlite3_free(zSql);
+
+  /* Each entry starts with the row count, of a partial index maybe less */
+  zSql = sqlite3_mprintf("SELECT max(CAST(stat AS INTEGER))"
+                         "  FROM %s.sqlite_stat1 WHERE tbl=%Q", zDb, zTab);
+  if( sqlite3_prepare_v2(g.db, zSql, -1, &pStmt, 0)==SQLITE_OK
+   && SQLITE_ROW==sqlite3_step(pStmt)
+   && sqlite3_column_type(pStmt, 0)!=SQLITE_NULL ){
+    nRow = sqlite3_column_int64(pStmt, 0);
+    *pzHow = "stat1";
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(zSql);
+  if( nRow>=0 ) return nRow<nMax ? nRow : nMax;
+
+  if( bRowid ){
+    zSql = sqlite3_mprintf("SELECT max(rowid)-min(rowid)+1 FROM %s.%s", zDb, zId);
+    *pzHow = "rowid range";
+  }else{
+    zSql = sqlite3_mprintf("SELECT count(*) FROM (SELECT 1 FROM %s.%s LIMIT %d)",
+                           zDb, zId, PLAN_SMALL_TABLE);
+    *pzHow = "sample";
+  }
+  pStmt = 0;
+  if( sqlite3_prepare_v2(g.db, zSql, -1, &pStmt, 0)==SQLITE_OK
+   && SQLITE_ROW==sqlite3_step(pStmt) ){
+    nRow = sqlite3_column_int64(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(zSql);
+  if( nRow>nMax ) nRow = nMax;
+  return nRow>0 ? nRow : 0;
+}
+
+/*
+** Return 1 if column zCol of main.zTab compares with the BINARY collation.
+*/
+static int planBinary(const char *zTab, const char *zCol){
+  const char *zColl = 0;
+  sqlite3_table_column_metadata(g.db, "main", zTab, zCol, 0, &zColl, 0, 0, 0);
+  return zColl==0 || sqlite3_stricmp(zColl, "BINARY")==0;
+}
+
+/*
+** Return 1 if db stores text as UTF-8, which a merge compares with
+** memcmp() like the BINARY collation. Attached databases share the
+** encoding of main.
+*/
+static int planUtf8(sqlite3 *db){
+  sqlite3_stmt *pStmt;
+  int bUtf8 = 0;
+  if( sqlite3_prepare_v2(db, "PRAGMA main.encoding", -1, &pStmt, 0)==SQLITE_OK
+   && SQLITE_ROW==sqlite3_step(pStmt) ){
+    bUtf8 = sqlite3_stricmp((const char*)sqlite3_column_text(pStmt, 0), "UTF-8")==0;
+  }
+  sqlite3_finalize(pStmt);
+  return bUtf8;
+}
+
+/*
+** Choose the strategy for zTab, writing the choice and the estimates it
+** rests on to g.opt.pPlanLog.
+**
+** The join visits every row of main twice and every row of aux once, each
+** time with a lookup on the other side. The merge visits every row once,
+** in PRIMARY KEY order, which costs a lookup per row too for a rowid table
+** whose PRIMARY KEY is not the rowid. A merged row is more expensive than
+** a joined one, as its values are compared in C.
+**
+** *pbHash is set if a merge should compare rows by sqlitediff_rowhash(),
+** see PLAN_HASH_COLUMNS.
+*/
+static int planStrategy(const char *zTab, const char *zId, char **azName,
+                        int nCol, int *aiPk, int nPk, int bMergeable, int *pbHash){
+  const char *zHowA = "", *zHowB = "";
+  const char *zWhy;
+  sqlite3_int64 nA, nB, nJoin, nMerge, nLess, nDiff;
+  int bWide = nCol-nPk>=PLAN_HASH_COLUMNS;
+  int bRowid, bIpk, i;
+  int eStrategy;
+
+  *pbHash = 0;
+  for(i=0; bMergeable && i<nCol; i++){
+    bMergeable = planBinary(zTab, azName[i]);
+  }
+  if( bMergeable ) bMergeable = planUtf8(g.db);
+  if( g.opt.eStrategy==SQLITEDIFF_STRATEGY_JOIN || !bMergeable ){
+    eStrategy = SQLITEDIFF_STRATEGY_JOIN;
+    zWhy = bMergeable ? "requested" : "only possible";
+    if( g.opt.pPlanLog ){
+      fprintf(g.opt.pPlanLog, "%s: join (%s)\n", zTab, zWhy);
+    }
+    return eStrategy;
+  }
+  if( g.opt.eStrategy==SQLITEDIFF_STRATEGY_MERGE && !bWide ){
+    if( g.opt.pPlanLog ){
+      fprintf(g.opt.pPlanLog, "%s: merge (requested)\n", zTab);
+    }
+    return SQLITEDIFF_STRATEGY_MERGE;
+  }
+
+  bRowid = tableHasRowid(zTab);
+  bIpk = 0;
+  if( bRowid && nPk==1 ){
+    /* An INTEGER PRIMARY KEY is the rowid */
+    const char *zType = 0;
+    sqlite3_table_column_metadata(g.db, "main", zTab, azName[aiPk[0]], &zType, 0, 0, 0, 0);
+    bIpk = zType && sqlite3_stricmp(zType, "INTEGER")==0;
+  }
+  nA = planRows("main", zTab, zId, bRowid, &zHowA);
+  nB = planRows("aux", zTab, zId, bRowid, &zHowB);
+  nJoin = (2*nA + nB) + 2*nA*planDepth(nB) + nB*planDepth(nA);
+  nMerge = PLAN_MERGE_ROW*(nA + nB);
+  if( bRowid && !bIpk ){
+    nMerge += nA*planDepth(nA) + nB*planDepth(nB);
+  }
+
+  if( g.opt.eStrategy==SQLITEDIFF_STRATEGY_MERGE ){
+    eStrategy = SQLITEDIFF_STRATEGY_MERGE;
+    zWhy = "requested";
+  }else if( nA + nB < PLAN_SMALL_TABLE ){
+    eStrategy = SQLITEDIFF_STRATEGY_JOIN;
+    zWhy = "small";
+  }else if( nMerge < nJoin ){
+    eStrategy = SQLITEDIFF_STRATEGY_MERGE;
+    zWhy = "cheaper";
+  }else{
+    eStrategy = SQLITEDIFF_STRATEGY_JOIN;
+    zWhy = "cheaper";
+  }
+  if( eStrategy==SQLITEDIFF_STRATEGY_MERGE && bWide ){
+    nLess = nA<nB ? nA : nB;
+    nDiff = nA<nB ? nB-nA : nA-nB;
+    *pbHash = nDiff*PLAN_HASH_UNMATCHED<=nLess;
+  }
+  if( g.opt.pPlanLog ){
+    fprintf(g.opt.pPlanLog,
+            "%s: %s (%s%s), rows %lld (%s) + %lld (%s), cost join %lld merge %lld\n",
+            zTab, eStrategy==SQLITEDIFF_STRATEGY_MERGE ? "merge" : "join", zWhy,
+            *pbHash ? ", hashed" : "", nA, zHowA, nB, zHowB, nJoin, nMerge);
+  }
+  return eStrategy;
+}
+
+/*
+** Return true if sqlitediff_rowhash() can be used on g.db, registering it
+** if the connection does not have it yet.
+*/
+static int planRowhash(void){
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(g.db, "SELECT sqlitediff_rowhash()", -1, &pStmt, 0);
+  sqlite3_finalize(pStmt);
+  if( rc!=SQLITE_OK ){
+    rc = sqlitediff_rowhash_register(g.db);
+  }
+  return rc==SQLITE_OK;
+}
+
+/*
+** Prepare a lookup of a whole row of zDb.zId, by rowid or by the nKey
+** PRIMARY KEY columns aiKey, bound in that order.
+*/
+static sqlite3_stmt *planRowLookup(const char *zDb, const char *zId,
+                                   char **azCol, int nCol,
+                                   const int *aiKey, int nKey, int bRowid){
+  sqlite3_stmt *pStmt;
+  const char *zSep = "SELECT ";
+  Str sql;
+  int i;
+  strInit(&sql);
+  for(i=0; i<nCol; i++){
+    strPrintf(&sql, "%s%s", zSep, azCol[i]);
+    zSep = ", ";
+  }
+  strPrintf(&sql, "\n  FROM %s.%s\n WHERE", zDb, zId);
+  if( bRowid ){
+    strPrintf(&sql, " rowid=?1");
+  }else{
+    /* Without a rowid, the PRIMARY KEY is NOT NULL and unique */
+    for(i=0; i<nKey; i++){
+      strPrintf(&sql, "%s %s=?%d", i ? " AND" : "", azCol[aiKey[i]], i+1);
+    }
+  }
+  pStmt = db_prepare("%s", sql.z);
+  sqlite3_free(sql.z);
+  return pStmt;
+}
+
+/*
+** Read the columns of zTab and prepare its diff query.
+*/
+static int planBuild(const char *zTab, TablePlan **ppPlan){
+  TablePlan *p;                 /* The new plan */
+  sqlite3_stmt *pStmt;          /* SQL statment */
+  char *zId;                    /* Escaped name of the table */
+  char **azCol = 0;             /* List of escaped column names */
+  char **azName = 0;            /* List of unescaped column names */
+  int nCol = 0;                 /* Number of columns */
+  int *aiFlg = 0;               /* 0 if column is not part of PK */
+  int *aiPk = 0;                /* Column numbers for each PK column */
+  int nPk = 0;                  /* Number of PRIMARY KEY columns */
+  Str sql;                      /* SQL for the diff query */
+  int i, k;                     /* Loop counters */
+  const char *zSep;             /* List separator */
+  int bProjected = 0;           /* True if some columns are excluded */
+  int bStream = 0;              /* True if large BLOBs are streamed */
+  int bHash = 0;                /* True if a merge compares row hashes */
+  int bRowid = 0;               /* True if rows are looked up by rowid */
+  int w = 1;                    /* Result columns per selected value */
+  int iPos;                     /* Result column of a value */
+  int f = 1;                    /* Result columns of a changed flag, 0 or 1 */
+  int nResult;                  /* Result columns of the diff query */
+  int nNoOrder;                 /* Size of the SQL without ORDER BY */
+  char *zCapture = 0;           /* Escaped capture table, if rows are captured */
+  int rc = SQLITE_OK;
+
+  *ppPlan = 0;
+  p = sqlite3_malloc(sizeof(*p));
+  if( p==0 ) return SQLITE_NOMEM;
+  memset(p, 0, sizeof(*p));
+  p->zTab = sqlite3_mprintf("%s", zTab);
+  p->zId = zId = safeId(zTab);
+
+  /* Check that the schemas of the two tables match. Exit early otherwise. */
+  checkSchemasMatch(zTab);
+
+  pStmt = db_prepare("PRAGMA main.table_info=%Q", zTab);
+  while( SQLITE_ROW==sqlite3_step(pStmt) ){
+    if( sqlite3_column_int(pStmt,5)==0
+     && columnExcluded(zTab, (const char*)sqlite3_column_text(pStmt,1)) ){
+      bProjected = 1;
+      continue;
+    }
+    nCol++;
+    azCol = sqlite3_realloc(azCol, sizeof(char*)*nCol);
+    if( azCol==0 ) runtimeError("out of memory");
+    azName = sqlite3_realloc(azName, sizeof(char*)*nCol);
+    if( azName==0 ) runtimeError("out of memory");
+    aiFlg = sqlite3_realloc(aiFlg, sizeof(int)*nCol);
+    if( aiFlg==0 ) runtimeError("out of memory");
+    azCol[nCol-1] = safeId((const char*)sqlite3_column_text(pStmt,1));
+    azName[nCol-1] = sqlite3_mprintf("%s", sqlite3_column_text(pStmt,1));
+    aiFlg[nCol-1] = i = sqlite3_column_int(pStmt,5);
+    if( i>0 ){
+      if( i>nPk ){
+        nPk = i;
+        aiPk = sqlite3_realloc(aiPk, sizeof(int)*nPk);
+        if( aiPk==0 ) runtimeError("out of memory");
+      }
+      aiPk[i-1] = nCol-1;
+    }
+  }
+  sqlite3_finalize(pStmt);
+  if( nPk==0 ) goto end_plan_build;
+  zCapture = captureTable(zTab);
+  bStream = g.opt.nStreamThreshold>0 && tableHasRowid(zTab);
+  w = bStream ? 2 : 1;
+  p->eStrategy = planStrategy(zTab, zId, azName, nCol, aiPk, nPk, !bStream && !zCapture, &bHash);
+  if( p->eStrategy==SQLITEDIFF_STRATEGY_MERGE ){
+    /* The same query on either side: every column, in PRIMARY KEY order.
+    ** Or for a wide table the PRIMARY KEY, a hash of the other columns and
+    ** the rowid, plus a lookup of the whole row by rowid or PRIMARY KEY. */
+    const char *zDb;
+    bHash = bHash && planRowhash();
+    bRowid = bHash && tableHasRowid(zTab);
+    strInit(&sql);
+    for(k=0; k<2; k++){
+      zDb = k ? "aux" : "main";
+      sql.nUsed = 0;
+      zSep = "SELECT ";
+      for(i=0; i<nCol; i++){
+        if( bHash ){
+          if( i<nPk ) strPrintf(&sql, "%s%s", zSep, azCol[aiPk[i]]);
+        }else{
+          strPrintf(&sql, "%s%s", zSep, azCol[i]);
+        }
+        zSep = ", ";
+      }
+      if( bHash ){
+        zSep = ", sqlitediff_rowhash(";
+        for(i=0; i<nCol; i++){
+          if( aiFlg[i] ) continue;
+          strPrintf(&sql, "%s%s", zSep, azCol[i]);
+          zSep = ", ";
+        }
+        strPrintf(&sql, ")%s", bRowid ? ", rowid" : "");
+      }
+      strPrintf(&sql, "\n  FROM %s.%s\n ORDER BY", zDb, zId);
+      zSep = " ";
+      for(i=0; i<nPk; i++){
+        strPrintf(&sql, "%s%s", zSep, azCol[aiPk[i]]);
+        zSep = ", ";
+      }
+      if( g.fDebug ){
+        printf("SQL for %s:\n%s\n", zId, sql.z);
+      }
+      if( k ){
+        p->pStmtB = db_prepare("%s", sql.z);
+      }else{
+        p->pStmt = db_prepare("%s", sql.z);
+      }
+      if( !bHash ) continue;
+      if( k ){
+        p->pRowB = planRowLookup(zDb, zId, azCol, nCol, aiPk, nPk, bRowid);
+      }else{
+        p->pRowA = planRowLookup(zDb, zId, azCol, nCol, aiPk, nPk, bRowid);
+      }
+    }
+    sqlite3_free(sql.z);
+    if( p->pStmt==0 || p->pStmtB==0 ) rc = SQLITE_ERROR;
+    if( bHash ){
+      if( p->pRowA==0 || p->pRowB==0 ) rc = SQLITE_ERROR;
+      p->aiScanPk = sqlite3_malloc(sizeof(int)*nPk);
+      if( p->aiScanPk==0 ) runtimeError("out of memory");
+      for(i=0; i<nPk; i++) p->aiScanPk[i] = i;
+      p->iKey = p->iKeyB = bRowid ? nPk+1 : 0;
+    }
+    goto end_plan_build;
+  }
+  nResult = 1 + nPk + (nCol-nPk)*(f+2*w) + (bStream ? 2 : 0);
+  if( nResult>sqlite3_limit(g.db, SQLITE_LIMIT_COLUMN, -1) ){
+    /* A wide table: compare the values here instead of selecting a changed
+    ** flag per column, and do not stream, to fit the result set limit */
+    bStream = 0;
+    w = 1;
+    f = 0;
+    nResult = 1 + nPk + (nCol-nPk)*2;
+    if( nResult>sqlite3_limit(g.db, SQLITE_LIMIT_COLUMN, -1) ){
+      /* Too wide even for that: select only the PRIMARY KEY, and the
+      ** rowids of a rowid table, and look up the rows to compare them */
+      w = 0;
+      bRowid = tableHasRowid(zTab);
+    }
+  }
+  strInit(&sql);
+  if( nCol>nPk ){
+    strPrintf(&sql, "SELECT %d", SQLITE_UPDATE);
+    for(i=0; i<nCol; i++){
+      if( aiFlg[i] ){
+        strPrintf(&sql, ",\n       A.%s", azCol[i]);
+      }else if( w ){
+        strPrintf(&sql, ",\n       ");
+        if( f ) strPrintf(&sql, "A.%s IS NOT B.%s, ", azCol[i], azCol[i]);
+        selectValue(&sql, "A", azCol[i], bStream);
+        strPrintf(&sql, ", ");
+        selectValue(&sql, "B", azCol[i], bStream);
+      }
+    }
+    if( bStream || bRowid ) strPrintf(&sql, ",\n       A.rowid, B.rowid");
+    strPrintf(&sql,"\n  FROM main.%s A, aux.%s B\n", zId, zId);
+    zSep = " WHERE";
+    for(i=0; i<nPk; i++){
+      strPrintf(&sql, "%s A.%s=B.%s", zSep, azCol[aiPk[i]], azCol[aiPk[i]]);
+      zSep = " AND";
+    }
+    if( f ){
+      zSep = "\n   AND (";
+      for(i=0; i<nCol; i++){
+        if( aiFlg[i] ) continue;
+        strPrintf(&sql, "%sA.%s IS NOT B.%s", zSep, azCol[i], azCol[i]);
+        zSep = " OR\n        ";
+      }
+      strPrintf(&sql,")");
+    }else{
+      /* As a row value, to stay within the expression depth limit */
+      for(k=0; k<2; k++){
+        zSep = k ? " IS NOT (" : "\n   AND (";
+        for(i=0; i<nCol; i++){
+          if( aiFlg[i] ) continue;
+          strPrintf(&sql, "%s%s.%s", zSep, k ? "B" : "A", azCol[i]);
+          zSep = ", ";
+        }
+        strPrintf(&sql,")");
+      }
+    }
+    captureFilter(&sql, "A", zCapture, azCol, aiPk, nPk);
+    strPrintf(&sql,"\n UNION ALL\n");
+  }
+  strPrintf(&sql, "SELECT %d", SQLITE_DELETE);
+  for(i=0; i<nCol; i++){
+    if( aiFlg[i] ){
+      strPrintf(&sql, ",\n       A.%s", azCol[i]);
+    }else if( w ){
+      strPrintf(&sql, f ? ",\n       1, " : ",\n       ");
+      selectValue(&sql, "A", azCol[i], bStream);
+      strPrintf(&sql, ", ");
+      selectValue(&sql, 0, azCol[i], bStream);
+    }
+  }
+  if( bStream || bRowid ) strPrintf(&sql, ",\n       A.rowid, NULL");
+  strPrintf(&sql, "\n  FROM main.%s A\n", zId);
+  strPrintf(&sql, " WHERE NOT EXISTS(SELECT 1 FROM aux.%s B\n", zId);
+  zSep =          "                   WHERE";
+  for(i=0; i<nPk; i++){
+    strPrintf(&sql, "%s A.%s=B.%s", zSep, azCol[aiPk[i]], azCol[aiPk[i]]);
+    zSep = " AND";
+  }
+  strPrintf(&sql, ")");
+  captureFilter(&sql, "A", zCapture, azCol, aiPk, nPk);
+  strPrintf(&sql, "\n UNION ALL\n");
+  strPrintf(&sql, "SELECT %d", SQLITE_INSERT);
+  for(i=0; i<nCol; i++){
+    if( aiFlg[i] ){
+      strPrintf(&sql, ",\n       B.%s", azCol[i]);
+    }else if( w ){
+      strPrintf(&sql, f ? ",\n       1, " : ",\n       ");
+      selectValue(&sql, 0, azCol[i], bStream);
+      strPrintf(&sql, ", ");
+      selectValue(&sql, "B", azCol[i], bStream);
+    }
+  }
+  if( bStream || bRowid ) strPrintf(&sql, ",\n       NULL, B.rowid");
+  strPrintf(&sql, "\n  FROM aux.%s B\n", zId);
+  strPrintf(&sql, " WHERE NOT EXISTS(SELECT 1 FROM main.%s A\n", zId);
+  zSep =          "                   WHERE";
+  for(i=0; i<nPk; i++){
+    strPrintf(&sql, "%s A.%s=B.%s", zSep, azCol[aiPk[i]], azCol[aiPk[i]]);
+    zSep = " AND";
+  }
+  strPrintf(&sql, ")");
+  captureFilter(&sql, "B", zCapture, azCol, aiPk, nPk);
+  strPrintf(&sql, "\n");
+  nNoOrder = sql.nUsed;
+  strPrintf(&sql, " ORDER BY");
+  zSep = " ";
+  for(i=0; i<nPk; i++){
+    /* 1-based result column of the PK: the type, then 1 column per
+    ** preceding PK column and f+2*w per preceding non-PK column */
+    for(iPos=2, k=0; k<aiPk[i]; k++) iPos += aiFlg[k] ? 1 : f+2*w;
+    strPrintf(&sql, "%s %d", zSep, iPos);
+    zSep = ",";
+  }
+  strPrintf(&sql, ";\n");
+
+  /* Under a memory budget, rather give up the PK order of the output than
+  ** let SQLite sort the whole table. */
+  if( g.opt.nMemoryBudget>0 && planUsesSorter(sql.z) ){
+    sql.nUsed = nNoOrder;
+    sql.z[nNoOrder] = 0;
+    strPrintf(&sql, ";\n");
+  }
+
+  if( g.fDebug ){ 
+    printf("SQL for %s:\n%s\n", zId, sql.z);
+  }
+
+  p->pStmt = db_prepare("%s", sql.z);
+  sqlite3_free(sql.z);
+  if( w==0 ){
+    /* The PRIMARY KEY columns of the keys join, in table order */
+    int *aiKey = sqlite3_malloc(sizeof(int)*nPk);
+    if( aiKey==0 ) runtimeError("out of memory");
+    for(k=0, i=0; i<nCol; i++){
+      if( aiFlg[i] ) aiKey[k++] = i;
+    }
+    p->pRowA = planRowLookup("main", zId, azCol, nCol, aiKey, nPk, bRowid);
+    p->pRowB = planRowLookup("aux", zId, azCol, nCol, aiKey, nPk, bRowid);
+    sqlite3_free(aiKey);
+    if( p->pStmt==0 || p->pRowA==0 || p->pRowB==0 ) rc = SQLITE_ERROR;
+    p->iKey = bRowid ? nPk+1 : 1;
+    p->iKeyB = bRowid ? nPk+2 : 1;
+  }
+
+  end_plan_build:
+  sqlite3_free(zCapture);
+  p->azCol = azCol;
+  p->azName = azName;
+  p->nCol = nCol;
+  p->aiFlg = aiFlg;
+  p->aiPk = aiPk;
+  p->nPk = nPk;
+  p->bProjected = bProjected;
+  p->bStream = bStream;
+  p->w = w;
+  p->f = f;
+  if( rc!=SQLITE_OK ){
+    planFree(p);
+    return rc;
+  }
+  *ppPlan = p;
+  return SQLITE_OK;
+}
+
+/*
+** State kept between the diffs and checks of one connection, see
+** sqlitediff_cache_open().
+*/
+struct DiffCache {
+  sqlite3 *db;                  /* Connection the cache belongs to */
+  char *zKey;                   /* cacheKey() the state below is valid for */
+  sqlite3_stmt *apVersion[4];   /* Schema cookies and data versions */
+  sqlite3_int64 aiVersion[4];   /* Their values at the start of this diff */
+  TablePlan **apPlan;           /* Plans of the tables diffed so far */
+  int nPlan;                    /* Number of entries in apPlan */
+  sqlite3_stmt *pList;          /* Query for the tables of main and aux */
+  int bCheck;                   /* True if the fields below are set */
+  char *zCheckTab;              /* zTab of the last check, NULL for all */
+  sqlite3_int64 aiCheckData[3]; /* Data versions and changes of that check */
+  int bCheckDiffer;             /* Its result */
+  struct DiffCache *pNext;      /* Next in g.pCacheList */
+};
+
+/*
+** Return the plan of zTab from g.pCache, building and caching it if needed.
+*/
+static int planGet(const char *zTab, TablePlan **ppPlan){
+  struct DiffCache *pCache = g.pCache;
+  TablePlan **apNew;
+  int i, rc;
+  if( pCache ){
+    for(i=0; i<pCache->nPlan; i++){
+      if( strcmp(pCache->apPlan[i]->zTab, zTab)==0 ){
+        *ppPlan = pCache->apPlan[i];
+        return SQLITE_OK;
+      }
+    }
+  }
+  rc = planBuild(zTab, ppPlan);
+  if( rc==SQLITE_OK && pCache ){
+    apNew = sqlite3_realloc(pCache->apPlan, sizeof(TablePlan*)*(pCache->nPlan+1));
+    if( apNew ){
+      pCache->apPlan = apNew;
+      pCache->apPlan[pCache->nPlan++] = *ppPlan;
+      (*ppPlan)->bCached = 1;
+    }
+  }
+  return rc;
+}
+
+static void planRelease(TablePlan *p){
+  if( p && p->bCached ){
+    sqlite3_reset(p->pStmt);
+  }else{
+    planFree(p);
+  }
+}
+
+/*
+** Return the options, and the files of main and aux, as one string: any
+** cached plan was made for exactly these. Free with sqlite3_free().
+*/
+static char *cacheKey(void){
+  const char **aaz[3];
+  Str key;
+  int i;
+  aaz[0] = g.opt.azIncludeTables;
+  aaz[1] = g.opt.azExcludeTables;
+  aaz[2] = g.opt.azExcludeColumns;
+  strInit(&key);
+  strPrintf(&key, "%s\n%s\n%lld %lld %d %lld %d %d %d %d %d\n",
+            sqlite3_db_filename(g.db, "main"), sqlite3_db_filename(g.db, "aux"),
+            g.opt.nDeltaThreshold, g.opt.nStreamThreshold, g.opt.nDictMaxSize,
+            g.opt.nMemoryBudget, g.opt.bChecksum, g.opt.bCaptured,
+            g.opt.bLive, g.opt.bSessionFormat, g.opt.eStrategy);
+  for(i=0; i<3; i++){
+    const char **az;
+    strPrintf(&key, aaz[i] ? "[" : "-");
+    for(az=aaz[i]; az && *az; az++) strPrintf(&key, "%s\n", *az);
+    strPrintf(&key, "]");
+  }
+  return key.z;
+}
+
+static void cacheClear(struct DiffCache *p){
+  while( p->nPlan>0 ) planFree(p->apPlan[--p->nPlan]);
+  sqlite3_free(p->apPlan);
+  p->apPlan = 0;
+  sqlite3_finalize(p->pList);
+  p->pList = 0;
+  sqlite3_free(p->zCheckTab);
+  p->zCheckTab = 0;
+  p->bCheck = 0;
+}
+
+/*
+** Make g.pCache the cache of g.db, if it has one, and drop what it holds
+** if a schema cookie, the options or the attached files have changed since
+** it was filled.
+*/
+static int cacheBegin(void){
+  struct DiffCache *p;
+  sqlite3_int64 aiVersion[4];
+  char *zKey;
+  int i;
+
+  for(p=g.pCacheList; p && p->db!=g.db; p=p->pNext){}
+  g.pCache = p;
+  if( p==0 ) return SQLITE_OK;
+
+  for(i=0; i<4; i++){
+    if( SQLITE_ROW!=sqlite3_step(p->apVersion[i]) ){
+      sqlite3_reset(p->apVersion[i]);
+      return sqlite3_errcode(g.db);
+    }
+    aiVersion[i] = sqlite3_column_int64(p->apVersion[i], 0);
+    sqlite3_reset(p->apVersion[i]);
+  }
+  zKey = cacheKey();
+  if( zKey==0 ) return SQLITE_NOMEM;
+  if( p->zKey==0 || strcmp(zKey, p->zKey)!=0
+   || aiVersion[0]!=p->aiVersion[0] || aiVersion[1]!=p->aiVersion[1] ){
+    cacheClear(p);
+    sqlite3_free(p->zKey);
+    p->zKey = zKey;
+  }else{
+    sqlite3_free(zKey);
+  }
+  memcpy(p->aiVersion, aiVersion, sizeof(aiVersion));
+  return SQLITE_OK;
+}
+
+struct DiffCache *sqlitediff_cache_open(sqlite3 *db){
+  static const char *azSql[] = {
+    "PRAGMA main.schema_version", "PRAGMA aux.schema_version",
+    "PRAGMA main.data_version", "PRAGMA aux.data_version",
+  };
+  struct DiffCache *p;
+  int i;
+
+  p = sqlite3_malloc(sizeof(*p));
+  if( p==0 ) return 0;
+  memset(p, 0, sizeof(*p));
+  p->db = db;
+  for(i=0; i<4; i++){
+    if( sqlite3_prepare_v2(db, azSql[i], -1, &p->apVersion[i], 0)!=SQLITE_OK ){
+      sqlitediff_cache_close(p);
+      return 0;
+    }
+  }
+  p->pNext = g.pCacheList;
+  g.pCacheList = p;
+  return p;
+}
+
+void sqlitediff_cache_close(struct DiffCache *p){
+  struct DiffCache **pp;
+  int i;
+  if( p==0 ) return;
+  for(pp=&g.pCacheList; *pp; pp=&(*pp)->pNext){
+    if( *pp==p ){
+      *pp = p->pNext;
+      break;
+    }
+  }
+  if( g.pCache==p ) g.pCache = 0;
+  cacheClear(p);
+  for(i=0; i<4; i++) sqlite3_finalize(p->apVersion[i]);
+  sqlite3_free(p->zKey);
+  sqlite3_free(p);
+}
+
+/* Load the current row of pStmt into the first nCol values of instr */
+static void rowToValues(sqlite3_stmt *pStmt, int nCol, struct Instruction *instr){
+  int i;
+  for(i=0; i<nCol; i++){
+    sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt, i), &instr->values[i]);
+  }
+}
+
+/*
+** Return the statement that has all columns of the current row of pScan:
+** pScan itself, or pRow, which looks the row up by the key pScan selects
+** from result column iKey on. Return NULL and set *pRc if the lookup fails.
+*/
+static sqlite3_stmt *mergeFetch(sqlite3_stmt *pScan, sqlite3_stmt *pRow, int iKey, int *pRc){
+  int i, n;
+  if( pRow==0 ) return pScan;
+  sqlite3_reset(pRow);
+  n = sqlite3_bind_parameter_count(pRow);
+  for(i=0; i<n; i++){
+    sqlite3_bind_value(pRow, i+1, sqlite3_column_value(pScan, iKey+i));
+  }
+  if( SQLITE_ROW!=sqlite3_step(pRow) ){
+    /* The scan just read this row in the same transaction */
+    *pRc = sqlite3_reset(pRow);
+    if( *pRc==SQLITE_OK ) *pRc = SQLITE_CORRUPT;
+    return 0;
+  }
+  return pRow;
+}
+
+/*
+** Load the old row pRowA and the new row pRowB of an UPDATE into instr,
+** flagging the changed columns. Return true if any changed.
+*/
+static int rowsToUpdate(TablePlan *p, sqlite3_stmt *pRowA, sqlite3_stmt *pRowB, struct Instruction *instr){
+  int nCol = p->nCol;
+  int bChanged = 0;
+  int i;
+  for(i=0; i<nCol; i++){
+    sqlite3_value *pOld = sqlite3_column_value(pRowA, i);
+    sqlite3_value *pNew = sqlite3_column_value(pRowB, i);
+    sqlite3_value_to_sqlite_value(pOld, &instr->values[i]);
+    if( p->aiFlg[i] ){
+      instr->values[nCol+i].type = 0;
+      instr->valFlag[i] = 0;
+    }else{
+      sqlite3_value_to_sqlite_value(pNew, &instr->values[nCol+i]);
+      instr->valFlag[i] = compareValues(pOld, pNew)!=0;
+      bChanged |= instr->valFlag[i];
+    }
+  }
+  return bChanged;
+}
+
+/*
+** Merge the rows of main (p->pStmt) and aux (p->pStmtB), both in PRIMARY
+** KEY order, and pass the differences to xInstr in that order, as the join
+** query would. In a hashed merge, rows with the same key and hash are the
+** same, and the others are looked up to compare and pass their columns.
+*/
+static int mergeRows(TablePlan *p, struct Instruction *instr, InstrCallback xInstr, void *pCtx){
+  sqlite3_stmt *pA = p->pStmt;
+  sqlite3_stmt *pB = p->pStmtB;
+  sqlite3_stmt *pRowA, *pRowB;
+  const int *aiKey = p->pRowA ? p->aiScanPk : p->aiPk;
+  int nCol = p->nCol;
+  int bA = SQLITE_ROW==sqlite3_step(pA);
+  int bB = SQLITE_ROW==sqlite3_step(pB);
+  int rc = SQLITE_OK;
+  int rc2;
+  int i, c;
+
+  while( rc==SQLITE_OK && (bA || bB) ){
+    if( !bB ){
+      c = -1;
+    }else if( !bA ){
+      c = 1;
+    }else{
+      c = multiComparePk(pA, pB, aiKey, p->nPk);
+      /* NULL PRIMARY KEY values never match, as in the join */
+      for(i=0; c==0 && i<p->nPk; i++){
+        if( sqlite3_column_type(pA, aiKey[i])==SQLITE_NULL ) c = -1;
+      }
+    }
+    if( c<0 ){
+      pRowA = mergeFetch(pA, p->pRowA, p->iKey, &rc);
+      if( pRowA==0 ) break;
+      instr->iType = SQLITE_DELETE;
+      rowToValues(pRowA, nCol, instr);
+      g.stats.nDelete++;
+      rc = xInstr(instr, pCtx);
+      bA = SQLITE_ROW==sqlite3_step(pA);
+    }else if( c>0 ){
+      pRowB = mergeFetch(pB, p->pRowB, p->iKeyB, &rc);
+      if( pRowB==0 ) break;
+      instr->iType = SQLITE_INSERT;
+      rowToValues(pRowB, nCol, instr);
+      g.stats.nInsert++;
+      rc = xInstr(instr, pCtx);
+      bB = SQLITE_ROW==sqlite3_step(pB);
+    }else if( p->pRowA
+           && sqlite3_column_int64(pA, p->nPk)==sqlite3_column_int64(pB, p->nPk) ){
+      bA = SQLITE_ROW==sqlite3_step(pA);
+      bB = SQLITE_ROW==sqlite3_step(pB);
+    }else{
+      pRowA = mergeFetch(pA, p->pRowA, p->iKey, &rc);
+      pRowB = pRowA ? mergeFetch(pB, p->pRowB, p->iKeyB, &rc) : 0;
+      if( pRowB==0 ) break;
+      if( rowsToUpdate(p, pRowA, pRowB, instr) ){
+        instr->iType = SQLITE_UPDATE;
+        g.stats.nUpdate++;
+        rc = xInstr(instr, pCtx);
+      }
+      bA = SQLITE_ROW==sqlite3_step(pA);
+      bB = SQLITE_ROW==sqlite3_step(pB);
+    }
+  }
+
+  /* A scan that ended on an error must not read as the end of the table */
+  rc2 = sqlite3_reset(pB);
+  if( rc==SQLITE_OK ) rc = rc2;
+  if( p->pRowA ){
+    sqlite3_reset(p->pRowA);
+    sqlite3_reset(p->pRowB);
+  }
+  return rc;
+}
+
+/*
+** Pass the differences that the keys join p->pStmt of a wide table finds
+** to xInstr, looking up the old and new rows to read their columns.
+*/
+static int lookupRows(TablePlan *p, struct Instruction *instr, InstrCallback xInstr, void *pCtx){
+  sqlite3_stmt *pStmt = p->pStmt;
+  sqlite3_stmt *pRowA = 0;
+  sqlite3_stmt *pRowB = 0;
+  int rc = SQLITE_OK;
+  int rc2;
+
+  while( rc==SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
+    instr->iType = sqlite3_column_int(pStmt, 0);
+    if( instr->iType!=SQLITE_INSERT ){
+      pRowA = mergeFetch(pStmt, p->pRowA, p->iKey, &rc);
+      if( pRowA==0 ) break;
+    }
+    if( instr->iType!=SQLITE_DELETE ){
+      pRowB = mergeFetch(pStmt, p->pRowB, p->iKeyB, &rc);
+      if( pRowB==0 ) break;
+    }
+    switch( instr->iType ){
+      case SQLITE_UPDATE:
+        if( !rowsToUpdate(p, pRowA, pRowB, instr) ) continue;
+        g.stats.nUpdate++;
+        break;
+      case SQLITE_INSERT:
+        rowToValues(pRowB, p->nCol, instr);
+        g.stats.nInsert++;
+        break;
+      case SQLITE_DELETE:
+        rowToValues(pRowA, p->nCol, instr);
+        g.stats.nDelete++;
+        break;
+    }
+    rc = xInstr(instr, pCtx);
+  }
+
+  rc2 = sqlite3_reset(pStmt);
+  if( rc==SQLITE_OK ) rc = rc2;
+  sqlite3_reset(p->pRowA);
+  sqlite3_reset(p->pRowB);
+  return rc;
+}
+
+/*
+** Generate a CHANGESET for all differences from main.zTab to aux.zTab.
+*/
+static int changeset_one_table(const char *zTab, TableCallback tableCallback, InstrCallback instrCallback, void* context){
+  TablePlan *p = 0;             /* Columns and diff query of zTab */
+  sqlite3_stmt *pStmt;          /* SQL statment */
+  int nCol;                     /* Number of columns */
+  int *aiFlg;                   /* 0 if column is not part of PK */
+  int i, k;                     /* Loop counters */
+  int bStream;                  /* True if large BLOBs are streamed */
+  int w;                        /* Result columns per selected value */
+  int f;                        /* Result columns of a changed flag, 0 or 1 */
+  int iRowidA, iRowidB;         /* Result columns of A.rowid and B.rowid */
+  struct BlobRef *aRef = 0;     /* Large BLOBs of the current row */
+  int rc, rc2;
+
+  rc = planGet(zTab, &p);
+  if( rc!=SQLITE_OK || p->pStmt==0 ) goto end_changeset_one_table;
+  nCol = p->nCol;
+  aiFlg = p->aiFlg;
+  bStream = p->bStream;
+  w = p->w;
+  f = p->f;
+
+  struct TableInfo tableInfo;
+  tableInfo.PKs = aiFlg;
+  tableInfo.nCol = nCol;
+  tableInfo.tableName = zTab;
+  tableInfo.columnNames = (const char**)p->azCol;
+  tableInfo.bProjected = p->bProjected;
+
+  if (tableCallback) {
+    rc = tableCallback(&tableInfo, context);
+  }
+
+  pStmt = p->pStmt;
+  iRowidA = sqlite3_column_count(pStmt)-2;
+  iRowidB = sqlite3_column_count(pStmt)-1;
+
+  struct Instruction instr;
+  instr.table = &tableInfo;
+  instr.values = malloc(sizeof(struct sqlite_value) * nCol * 2);
+  instr.valFlag = malloc(sizeof(int) * nCol);
+  if( bStream ){
+    aRef = malloc(sizeof(struct BlobRef) * nCol * 2);
+    for(i=0; i<nCol*2; i++){
+      aRef[i].db = g.db;
+      aRef[i].zTab = p->zTab;
+      aRef[i].zCol = p->azName[i % nCol];
+    }
+  }
+
+  if( p->pStmtB ){
+    rc = mergeRows(p, &instr, instrCallback, context);
+  }else if( p->pRowA ){
+    rc = lookupRows(p, &instr, instrCallback, context);
+  }
+  while( rc == SQLITE_OK && p->pStmtB==0 && p->pRowA==0 && SQLITE_ROW==sqlite3_step(pStmt) ){
+    int iType = sqlite3_column_int(pStmt,0);
+    instr.iType = iType;
+
+    switch( sqlite3_column_int(pStmt,0) ){
+      case SQLITE_UPDATE: {
+        for(k=1, i=0; i<nCol; i++){
+          if( aiFlg[i] ){
+            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k), &instr.values[i]);
+            instr.valFlag[i] = 0;
+            instr.values[nCol+i].type = 0;
+            k++;
+          }else{
+            // write old value
+            columnToValue(pStmt, k+f, bStream, "main", iRowidA,
+                          &aRef[i], &instr.values[i]);
+            // write new value
+            columnToValue(pStmt, k+f+w, bStream, "aux", iRowidB,
+                          &aRef[nCol+i], &instr.values[nCol+i]);
+            // write changed flag
+            instr.valFlag[i] = f ? sqlite3_column_int(pStmt,k)
+                : compareValues(sqlite3_column_value(pStmt,k),
+                                sqlite3_column_value(pStmt,k+1))!=0;
+            k += f+2*w;
+          }
+        }
+        break;
+      }
+      case SQLITE_INSERT: {
+        for(k=1, i=0; i<nCol; i++){
+          if( aiFlg[i] ){
+            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k), &instr.values[i]);
+            k++;
+          }else{
+            columnToValue(pStmt, k+f+w, bStream, "aux", iRowidB,
+                          &aRef[i], &instr.values[i]);
+            k += f+2*w;
+          }
+        }
+        break;
+      }
+      case SQLITE_DELETE: {
+        for(k=1, i=0; i<nCol; i++){
+          if( aiFlg[i] ){
+            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k), &instr.values[i]);
+            k++;
+          }else{
+            columnToValue(pStmt, k+f, bStream, "main", iRowidA,
+                          &aRef[i], &instr.values[i]);
+            k += f+2*w;
+          }
+        }
+        break;
+      }
+    }
+    switch( iType ){
+      case SQLITE_INSERT: g.stats.nInsert++; break;
+      case SQLITE_UPDATE: g.stats.nUpdate++; break;
+      case SQLITE_DELETE: g.stats.nDelete++; break;
+    }
+    rc = instrCallback(&instr, context);
+  }
+  g.stats.nTable++;
+  rc2 = sqlite3_reset(pStmt);
+  if( rc==SQLITE_OK ) rc = rc2;
+  if( rc==SQLITE_OK && instrCallback==batchInstruction ){
+    /* A batch points at tableInfo, so it is delivered before that goes */
+    rc = batchFlush((InstrBatch*)context);
+  }
+
+  free(instr.values);
+  free(instr.valFlag);
+  free(aRef);
+
+  end_changeset_one_table:
+  planRelease(p);
+
+  return rc;
+}
+
+/*
+** Return the size of the WAL file of schema zDb, 0 if it has none.
+*/
+static sqlite3_int64 walSize(const char *zDb){
+  const char *zFile = sqlite3_db_filename(g.db, zDb);
+  struct stat st;
+  char *zWal;
+  sqlite3_int64 n = 0;
+  if( zFile==0 || zFile[0]==0 ) return 0;
+  zWal = sqlite3_mprintf("%s-wal", zFile);
+  if( zWal && stat(zWal, &st)==0 ) n = st.st_size;
+  sqlite3_free(zWal);
+  return n;
+}
+
+/*
+** Start the read transaction of a live diff on both databases. In WAL mode
+** it pins one consistent version of each while writers carry on; it only
+** keeps checkpoints from recycling the WAL. Return 1 if the transaction was
+** started here and must be ended by liveEnd().
+*/
+static int liveBegin(int *pRc){
+  g.stats.nWalGrowth = -(walSize("main") + walSize("aux"));
+  if( !sqlite3_get_autocommit(g.db) ) return 0;
+  *pRc = sqlite3_exec(g.db,
+      "BEGIN;"
+      "SELECT 1 FROM main.sqlite_master LIMIT 1;"
+      "SELECT 1 FROM aux.sqlite_master LIMIT 1;", 0, 0, 0);
+  return *pRc==SQLITE_OK;
+}
+
+static void liveEnd(int bBegun){
+  g.stats.nWalGrowth += walSize("main") + walSize("aux");
+  if( bBegun ) sqlite3_exec(g.db, "COMMIT", 0, 0, 0);
+}
+
+int sqlitediff_live_share(sqlite3 *db, sqlite3 *pWorker){
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  static const char *azDb[] = {"main", "aux"};
+  int rc = sqlite3_exec(pWorker, "BEGIN", 0, 0, 0);
+  int i;
+  for(i=0; rc==SQLITE_OK && i<2; i++){
+    sqlite3_snapshot *pSnapshot;
+    rc = sqlite3_snapshot_get(db, azDb[i], &pSnapshot);
+    if( rc==SQLITE_OK ){
+      rc = sqlite3_snapshot_open(pWorker, azDb[i], pSnapshot);
+      sqlite3_snapshot_free(pSnapshot);
+    }
+  }
+  if( rc!=SQLITE_OK ) sqlite3_exec(pWorker, "ROLLBACK", 0, 0, 0);
+  return rc;
+#else
+  (void)db;
+  (void)pWorker;
+  return runtimeError("SQLite was built without SQLITE_ENABLE_SNAPSHOT");
+#endif
+}
+
+int slitediff_diff_prepared_callback(sqlite3* db, const char* zTab, TableCallback table_callback, InstrCallback instr_callback, void* context)
+{
+  int rc = SQLITE_OK;
+  int bLive = 0;
+  SavedBudget saved;
+  sqlite3_stmt *pStmt;
+
+  g.db = db;
+  memset(&g.stats, 0, sizeof(g.stats));
+  sqlite3_memory_highwater(1);
+  rc = cacheBegin();
+  if( rc ) return rc;
+  applyMemoryBudget(&saved);
+  if( g.opt.bLive ){
+    bLive = liveBegin(&rc);
+    if( rc ){
+      restoreMemoryBudget(&saved);
+      return rc;
+    }
+  }
+
+  if( zTab ){
+    rc = changeset_one_table(zTab, table_callback, instr_callback, context);
+  }else{
+    /* Handle tables one by one */
+    pStmt = g.pCache ? g.pCache->pList : 0;
+    if( pStmt==0 ){
+      pStmt = db_prepare(
+        "SELECT name FROM main.sqlite_master\n"
+        " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
+        " UNION\n"
+        "SELECT name FROM aux.sqlite_master\n"
+        " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
+        " ORDER BY name"
+        );
+      if( g.pCache ) g.pCache->pList = pStmt;
+    }
+
+    while( rc == SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
+      const char *zName = (const char*)sqlite3_column_text(pStmt,0);
+      if( !tableIncluded(zName) ) continue;
+      rc = changeset_one_table(zName, table_callback, instr_callback, context);
+    }
+    if( g.pCache ){
+      sqlite3_reset(pStmt);
+    }else{
+      sqlite3_finalize(pStmt);
+    }
+  }
+
+  if( g.opt.bLive ) liveEnd(bLive);
+  restoreMemoryBudget(&saved);
+  g.stats.nSqliteHighwater = sqlite3_memory_highwater(0);
+  {
+    struct rusage usage;
+    if( getrusage(RUSAGE_SELF, &usage)==0 ){
+      g.stats.nPeakRss = (sqlite3_int64)usage.ru_maxrss*1024;
+    }
+  }
+
+  return rc;
+}
+
+int slitediff_diff_prepared_batch(
+  sqlite3 *db,
+  const char* zTab,
+  TableCallback table_callback,
+  BatchCallback batch_callback,
+  int nBatch,
+  void* context
+){
+  InstrBatch b;
+  int rc;
+
+  if( nBatch<1 ) return SQLITE_MISUSE;
+  memset(&b, 0, sizeof(b));
+  b.xTable = table_callback;
+  b.xBatch = batch_callback;
+  b.pCtx = context;
+  b.nMax = nBatch;
+  b.aInstr = sqlite3_malloc64(sizeof(struct Instruction)*nBatch);
+  if( b.aInstr==0 ) return SQLITE_NOMEM;
+  rc = slitediff_diff_prepared_callback(db, zTab, batchTable, batchInstruction, &b);
+  sqlite3_free(b.aInstr);
+  sqlite3_free(b.aVal);
+  sqlite3_free(b.aFlag);
+  sqlite3_free(b.aRef);
+  sqlite3_free(b.z);
+  return rc;
+}
+
+int sqlitediff_diff_prepared(
+  sqlite3 *db,
+  const char* zTab, /* name of table to diff, or NULL for all tables */
+  FILE* out     /* Output stream */
+) {
+  int rc;
+  struct ChangesetWriter *pWriter;
+
+  g.db = db;
+  pWriter = sqlitediff_writer_open(out);
+  if( pWriter==0 ) return SQLITE_NOMEM;
+  rc = slitediff_diff_prepared_callback(db, zTab, sqlitediff_writer_table, sqlitediff_writer_instruction, pWriter);
+  sqlitediff_writer_close(pWriter);
+  return rc;
+}
+
+/*
+** Default shard function: FNV-1a 64 over the PRIMARY KEY values, modulo
+** nShard. Each value is hashed as its type byte followed by the integer or
+** the IEEE double as 8 little-endian bytes, or the TEXT/BLOB bytes.
+*/
+int sqlitediff_shard_pk_hash(const struct Instruction *instr, int nShard, void *pCtx){
+  sqlite3_uint64 h = 0xcbf29ce484222325ULL;
+  int i, k;
+  (void)pCtx;
+  for(i=0; i<instr->table->nCol; i++){
+    const struct sqlite_value *pVal = &instr->values[i];
+    const unsigned char *z = 0;
+    unsigned char a[8];
+    int n = 0;
+    if( !instr->table->PKs[i] ) continue;
+    h = (h ^ (unsigned char)pVal->type) * 0x100000001b3ULL;
+    if( pVal->type==SQLITE_INTEGER || pVal->type==SQLITE_FLOAT ){
+      sqlite3_uint64 v;
+      memcpy(&v, &pVal->data1, 8);
+      for(k=0; k<8; k++) a[k] = (unsigned char)(v >> (k*8));
+      z = a;
+      n = 8;
+    }else if( pVal->type==SQLITE_TEXT || pVal->type==SQLITE_BLOB ){
+      z = (const unsigned char*)pVal->data2;
+      n = (int)pVal->data1.iVal;
+    }
+    for(k=0; k<n; k++) h = (h ^ z[k]) * 0x100000001b3ULL;
+  }
+  return (int)(h % (sqlite3_uint64)nShard);
+}
+
+typedef struct ShardState ShardState;
+struct ShardState {
+  struct ChangesetWriter **apWriter; /* One writer per shard */
+  int *aiTable;                 /* Last table written to each shard */
+  int nShard;
+  ShardCallback xShard;
+  void *pShardCtx;
+  const struct TableInfo *pTable; /* Table currently being diffed */
+  int iTable;                   /* Number of pTable, starting at 1 */
+};
+
+static int shardTable(const struct TableInfo *table, void *pCtx){
+  ShardState *p = (ShardState*)pCtx;
+  p->pTable = table;
+  p->iTable++;
+  return SQLITE_OK;
+}
+
+/*
+** Route instr to its shard, writing the table header first if this is the
+** shard's first row of the table. Shards without rows of a table do not
+** get its header at all.
+*/
+static int shardInstruction(const struct Instruction *instr, void *pCtx){
+  ShardState *p = (ShardState*)pCtx;
+  int iShard = p->xShard(instr, p->nShard, p->pShardCtx);
+  int rc;
+  if( iShard<0 || iShard>=p->nShard ){
+    return runtimeError("shard function returned %d for %d shards", iShard, p->nShard);
+  }
+  if( p->aiTable[iShard]!=p->iTable ){
+    rc = sqlitediff_writer_table(p->pTable, p->apWriter[iShard]);
+    if( rc!=SQLITE_OK ) return rc;
+    p->aiTable[iShard] = p->iTable;
+  }
+  return sqlitediff_writer_instruction(instr, p->apWriter[iShard]);
+}
+
+int sqlitediff_diff_sharded(
+  sqlite3 *db,
+  const char* zTab,
+  FILE** aOut,
+  int nShard,
+  ShardCallback xShard,
+  void* pShardCtx
+){
+  ShardState s;
+  int rc = SQLITE_OK;
+  int i;
+
+  if( nShard<1 ) return SQLITE_MISUSE;
+  g.db = db;
+  memset(&s, 0, sizeof(s));
+  s.nShard = nShard;
+  s.xShard = xShard ? xShard : sqlitediff_shard_pk_hash;
+  s.pShardCtx = pShardCtx;
+  s.apWriter = sqlite3_malloc(nShard * sizeof(struct ChangesetWriter*));
+  s.aiTable = sqlite3_malloc(nShard * sizeof(int));
+  if( s.apWriter==0 || s.aiTable==0 ) rc = SQLITE_NOMEM;
+  for(i=0; i<nShard && rc==SQLITE_OK; i++){
+    s.aiTable[i] = 0;
+    s.apWriter[i] = sqlitediff_writer_open(aOut[i]);
+    if( s.apWriter[i]==0 ){
+      nShard = i;
+      rc = SQLITE_NOMEM;
+    }
+  }
+  if( rc==SQLITE_OK ){
+    rc = slitediff_diff_prepared_callback(db, zTab, shardTable, shardInstruction, &s);
+  }
+  for(i=0; s.apWriter && i<nShard; i++){
+    sqlitediff_writer_close(s.apWriter[i]);
+  }
+  sqlite3_free(s.apWriter);
+  sqlite3_free(s.aiTable);
+  return rc;
+}
+
+typedef struct MultiTarget MultiTarget;
+struct MultiTarget {
+  sqlite3 *db;                  /* Target connection */
+  struct ChangesetWriter *pWriter;
+  sqlite3_stmt *pStmt;          /* Rows of the current table, or NULL */
+  int bRow;                     /* True if pStmt points at a row */
+  int bTable;                   /* True once the table header is written */
+};
+
+/*
+** Write instr to target t, preceded by the table header for its first row
+** of the table.
+*/
+static int multiWrite(MultiTarget *t, const struct Instruction *instr){
+  int rc;
+  if( !t->bTable ){
+    rc = sqlitediff_writer_table(instr->table, t->pWriter);
+    if( rc!=SQLITE_OK ) return rc;
+    t->bTable = 1;
+  }
+  switch( instr->iType ){
+    case SQLITE_INSERT: g.stats.nInsert++; break;
+    case SQLITE_UPDATE: g.stats.nUpdate++; break;
+    case SQLITE_DELETE: g.stats.nDelete++; break;
+  }
+  return sqlitediff_writer_instruction(instr, t->pWriter);
+}
+
+/*
+** Return 1 if table zTab of target db has the same schema as in the base,
+** printing an error and returning 0 otherwise.
+*/
+static int multiSchemaMatches(sqlite3 *db, const char *zTab, const char *zBaseSql){
+  sqlite3_stmt *pStmt = 0;
+  int bMatch = 0;
+  sqlite3_prepare_v2(db,
+      "SELECT sql FROM main.sqlite_master WHERE type='table' AND name=?1",
+      -1, &pStmt, 0);
+  sqlite3_bind_text(pStmt, 1, zTab, -1, SQLITE_STATIC);
+  if( SQLITE_ROW==sqlite3_step(pStmt) ){
+    bMatch = strcmp((const char*)sqlite3_column_text(pStmt, 0), zBaseSql)==0;
+    if( !bMatch ) runtimeError("schema changes for table %s", zTab);
+  }else{
+    runtimeError("table %s missing from target %s", zTab, sqlite3_db_filename(db, "main"));
+  }
+  sqlite3_finalize(pStmt);
+  return bMatch;
+}
+
+/*
+** Merge-compare main.zTab of the base against every target, writing the
+** differences to each target's writer.
+*/
+static int multi_one_table(const char *zTab, const char *zBaseSql, MultiTarget *aT, int nTarget){
+  sqlite3_stmt *pStmt;
+  sqlite3_stmt *pBase;
+  char *zId = safeId(zTab);
+  char **azCol = 0;
+  int *aiFlg = 0;
+  int *aiPk = 0;
+  int nCol = 0, nPk = 0;
+  int bProjected = 0;
+  int i, j, c;
+  Str sql;
+  const char *zSep;
+  struct TableInfo tableInfo;
+  struct Instruction instr;
+  int rc = SQLITE_OK;
+
+  pStmt = db_prepare("PRAGMA main.table_info=%Q", zTab);
+  while( SQLITE_ROW==sqlite3_step(pStmt) ){
+    const char *zCol = (const char*)sqlite3_column_text(pStmt,1);
+    int iPk = sqlite3_column_int(pStmt,5);
+    if( iPk==0 && columnExcluded(zTab, zCol) ){
+      bProjected = 1;
+      continue;
+    }
+    if( iPk>0 ){
+      const char *zColl = 0;
+      sqlite3_table_column_metadata(g.db, "main", zTab, zCol, 0, &zColl, 0, 0, 0);
+      if( zColl && sqlite3_stricmp(zColl, "BINARY")!=0 ){
+        runtimeError("table %s: PRIMARY KEY collation %s is not supported", zTab, zColl);
+        nPk = 0;
+        break;
+      }
+    }
+    nCol++;
+    azCol = sqlite3_realloc(azCol, sizeof(char*)*nCol);
+    aiFlg = sqlite3_realloc(aiFlg, sizeof(int)*nCol);
+    if( azCol==0 || aiFlg==0 ) runtimeError("out of memory");
+    azCol[nCol-1] = safeId(zCol);
+    aiFlg[nCol-1] = iPk;
+    if( iPk>nPk ){
+      nPk = iPk;
+      aiPk = sqlite3_realloc(aiPk, sizeof(int)*nPk);
+      if( aiPk==0 ) runtimeError("out of memory");
+    }
+    if( iPk>0 ) aiPk[iPk-1] = nCol-1;
+  }
+  sqlite3_finalize(pStmt);
+  if( nPk==0 ) goto end_multi_one_table;
+
+  strInit(&sql);
+  strPrintf(&sql, "SELECT");
+  zSep = " ";
+  for(i=0; i<nCol; i++){
+    strPrintf(&sql, "%s%s", zSep, azCol[i]);
+    zSep = ", ";
+  }
+  strPrintf(&sql, " FROM main.%s ORDER BY", zId);
+  zSep = " ";
+  for(i=0; i<nPk; i++){
+    strPrintf(&sql, "%s%s", zSep, azCol[aiPk[i]]);
+    zSep = ", ";
+  }
+
+  for(j=0; j<nTarget; j++){
+    aT[j].pStmt = 0;
+    aT[j].bRow = 0;
+    aT[j].bTable = 0;
+    if( !multiSchemaMatches(aT[j].db, zTab, zBaseSql) ) continue;
+    if( sqlite3_prepare_v2(aT[j].db, sql.z, -1, &aT[j].pStmt, 0)!=SQLITE_OK ){
+      runtimeError("SQL statement error: %s\n\"%s\"", sqlite3_errmsg(aT[j].db), sql.z);
+      continue;
+    }
+    aT[j].bRow = SQLITE_ROW==sqlite3_step(aT[j].pStmt);
+  }
+  pBase = db_prepare("%s", sql.z);
+
+  tableInfo.PKs = aiFlg;
+  tableInfo.nCol = nCol;
+  tableInfo.tableName = zTab;
+  tableInfo.columnNames = (const char**)azCol;
+  tableInfo.bProjected = bProjected;
   instr.table = &tableInfo;
   instr.values = malloc(sizeof(struct sqlite_value) * nCol * 2);
   instr.valFlag = malloc(sizeof(int) * nCol);
 
-  while( rc == SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
-    int iType = sqlite3_column_int(pStmt,0);
-    instr.iType = iType;
-
-    switch( sqlite3_column_int(pStmt,0) ){
-      case SQLITE_UPDATE: {
-        for(k=1, i=0; i<nCol; i++){
-          if( aiFlg[i] ){
-            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k), &instr.values[i]);
-            instr.valFlag[i] = 0;
-            instr.values[nCol+i].type = 0;
-            k++;
-          }else{
-            // write old value
-            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k+1), &instr.values[i]);
-            // write new value
-            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k+2), &instr.values[nCol+i]);
-            // write changed flag
-            instr.valFlag[i] = sqlite3_column_int(pStmt,k);
-            k += 3;
-          }
-        }
-        break;
+  while( rc==SQLITE_OK && pBase && SQLITE_ROW==sqlite3_step(pBase) ){
+    for(j=0; rc==SQLITE_OK && j<nTarget; j++){
+      MultiTarget *t = &aT[j];
+      if( t->pStmt==0 ) continue;
+      /* Rows only in the target */
+      while( rc==SQLITE_OK && t->bRow
+          && (c = multiComparePk(pBase, t->pStmt, aiPk, nPk))>0 ){
+        instr.iType = SQLITE_INSERT;
+        rowToValues(t->pStmt, nCol, &instr);
+        rc = multiWrite(t, &instr);
+        t->bRow = SQLITE_ROW==sqlite3_step(t->pStmt);
       }
-      case SQLITE_INSERT: {
-        for(k=1, i=0; i<nCol; i++){
+      if( rc!=SQLITE_OK ) break;
+      if( t->bRow && c==0 ){
+        int bChanged = 0;
+        for(i=0; i<nCol; i++){
+          sqlite3_value *pOld = sqlite3_column_value(pBase, i);
+          sqlite3_value *pNew = sqlite3_column_value(t->pStmt, i);
+          sqlite3_value_to_sqlite_value(pOld, &instr.values[i]);
           if( aiFlg[i] ){
-            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k), &instr.values[i]);
-            k++;
+            instr.values[nCol+i].type = 0;
+            instr.valFlag[i] = 0;
           }else{
-            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k+2), &instr.values[i]);
-            k += 3;
+            sqlite3_value_to_sqlite_value(pNew, &instr.values[nCol+i]);
+            instr.valFlag[i] = compareValues(pOld, pNew)!=0;
+            bChanged |= instr.valFlag[i];
           }
         }
-        break;
-      }
-      case SQLITE_DELETE: {
-        for(k=1, i=0; i<nCol; i++){
-          if( aiFlg[i] ){
-            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k), &instr.values[i]);
-            k++;
-          }else{
-            sqlite3_value_to_sqlite_value(sqlite3_column_value(pStmt,k+1), &instr.values[i]);
-            k += 3;
-          }
+        if( bChanged ){
+          instr.iType = SQLITE_UPDATE;
+          rc = multiWrite(t, &instr);
         }
-        break;
+        t->bRow = SQLITE_ROW==sqlite3_step(t->pStmt);
+      }else{
+        instr.iType = SQLITE_DELETE;
+        rowToValues(pBase, nCol, &instr);
+        rc = multiWrite(t, &instr);
       }
     }
-    rc = instrCallback(&instr, context);
   }
-  sqlite3_finalize(pStmt);
+
+  /* Rows after the last row of the base */
+  for(j=0; j<nTarget; j++){
+    MultiTarget *t = &aT[j];
+    while( rc==SQLITE_OK && t->pStmt && t->bRow ){
+      instr.iType = SQLITE_INSERT;
+      rowToValues(t->pStmt, nCol, &instr);
+      rc = multiWrite(t, &instr);
+      t->bRow = SQLITE_ROW==sqlite3_step(t->pStmt);
+    }
+    sqlite3_finalize(t->pStmt);
+    t->pStmt = 0;
+  }
+  sqlite3_finalize(pBase);
+  g.stats.nTable++;
 
   free(instr.values);
   free(instr.valFlag);
+  sqlite3_free(sql.z);
 
-  end_changeset_one_table:
+  end_multi_one_table:
   while( nCol>0 ) sqlite3_free(azCol[--nCol]);
   sqlite3_free(azCol);
+  sqlite3_free(aiFlg);
   sqlite3_free(aiPk);
   sqlite3_free(zId);
+  return rc;
+}
+
+int sqlitediff_diff_multi(
+  sqlite3 *db,
+  const char* zTab,
+  sqlite3** aTarget,
+  FILE** aOut,
+  int nTarget
+){
+  MultiTarget *aT;
+  sqlite3_stmt *pStmt;
+  int rc = SQLITE_OK;
+  int i;
+
+  if( nTarget<1 ) return SQLITE_MISUSE;
+  g.db = db;
+  memset(&g.stats, 0, sizeof(g.stats));
+  aT = sqlite3_malloc(nTarget * sizeof(MultiTarget));
+  if( aT==0 ) return SQLITE_NOMEM;
+  memset(aT, 0, nTarget * sizeof(MultiTarget));
+  for(i=0; i<nTarget && rc==SQLITE_OK; i++){
+    aT[i].db = aTarget[i];
+    aT[i].pWriter = sqlitediff_writer_open(aOut[i]);
+    if( aT[i].pWriter==0 ) rc = SQLITE_NOMEM;
+    if( rc==SQLITE_OK && (!planUtf8(db) || !planUtf8(aTarget[i])) ){
+      rc = runtimeError("multi-diff of a database not in UTF-8 is not supported");
+    }
+  }
+
+  pStmt = db_prepare(
+    "SELECT name, sql FROM main.sqlite_master\n"
+    " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
+    "   AND (%Q IS NULL OR name=%Q)\n"
+    " ORDER BY name", zTab, zTab
+  );
+  while( rc==SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
+    const char *zName = (const char*)sqlite3_column_text(pStmt,0);
+    if( zTab==0 && !tableIncluded(zName) ) continue;
+    rc = multi_one_table(zName, (const char*)sqlite3_column_text(pStmt,1), aT, nTarget);
+  }
+  sqlite3_finalize(pStmt);
 
+  for(i=0; i<nTarget; i++){
+    if( aT[i].pWriter ) sqlitediff_writer_close(aT[i].pWriter);
+  }
+  sqlite3_free(aT);
   return rc;
 }
 
-int slitediff_diff_prepared_callback(sqlite3* db, const char* zTab, TableCallback table_callback, InstrCallback instr_callback, void* context)
-{
+/*
+** Return 1 if every page of main and aux is identical, using the
+** sqlite_dbpage virtual table where SQLite was built with it. The file
+** header (first 100 bytes of page 1) is skipped, as it holds the change
+** counter. Return 0 if the pages differ or cannot be compared.
+*/
+static int check_pages_identical(void){
+  sqlite3_stmt *pStmt;
+  int bSame = 0;
+  int rc = sqlite3_prepare_v2(g.db,
+      "SELECT (SELECT count(*) FROM sqlite_dbpage('main'))"
+      "      =(SELECT count(*) FROM sqlite_dbpage('aux'))"
+      "   AND NOT EXISTS(SELECT 1 FROM sqlite_dbpage('main') A,"
+      "                                sqlite_dbpage('aux') B"
+      "                   WHERE A.pgno=B.pgno"
+      "                     AND CASE WHEN A.pgno=1"
+      "                         THEN substr(A.data,101) IS NOT substr(B.data,101)"
+      "                         ELSE A.data IS NOT B.data END)",
+      -1, &pStmt, 0);
+  if( rc!=SQLITE_OK ) return 0;
+  if( SQLITE_ROW==sqlite3_step(pStmt) ){
+    bSame = sqlite3_column_int(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return bSame;
+}
+
+/*
+** Set *pbDiffer to 1 if the diff of main.zTab and aux.zTab would not be
+** empty: the row counts differ, a PRIMARY KEY holds a NULL, which never
+** matches, or a row of main has no identical twin in aux. With equal row
+** counts and unique PRIMARY KEYs that is enough to prove equality. Tables
+** without a PRIMARY KEY are not diffed, so they never differ either.
+*/
+static int check_one_table(const char *zTab, int *pbDiffer){
+  sqlite3_stmt *pStmt;
+  char *zId = safeId(zTab);
+  Str sql;
+  Str colsA, colsB;             /* Compared columns, qualified with A. and B. */
+  Str nulls;                    /* True if a PRIMARY KEY column is NULL */
+  int nPk = 0;
   int rc = SQLITE_OK;
+
+  *pbDiffer = 0;
+  strInit(&sql);
+  strInit(&colsA);
+  strInit(&colsB);
+  strInit(&nulls);
+  pStmt = db_prepare("PRAGMA main.table_info=%Q", zTab);
+  while( pStmt && SQLITE_ROW==sqlite3_step(pStmt) ){
+    const char *zName = (const char*)sqlite3_column_text(pStmt,1);
+    char *zCol;
+    if( sqlite3_column_int(pStmt,5)==0 && columnExcluded(zTab, zName) ){
+      continue;
+    }
+    zCol = safeId(zName);
+    if( sqlite3_column_int(pStmt,5)>0 ){
+      nPk++;
+      if( !sqlite3_column_int(pStmt,3) ){
+        strPrintf(&nulls, "%s%s IS NULL", nulls.nUsed ? " OR " : "", zCol);
+      }
+    }
+    strPrintf(&colsA, "%sA.%s", colsA.nUsed ? ", " : "", zCol);
+    strPrintf(&colsB, "%sB.%s", colsB.nUsed ? ", " : "", zCol);
+    sqlite3_free(zCol);
+  }
+  if( pStmt==0 || sqlite3_finalize(pStmt)!=SQLITE_OK ){
+    rc = SQLITE_ERROR;
+    goto end_check_one_table;
+  }
+  if( nPk==0 ) goto end_check_one_table;
+
+  strPrintf(&sql, "SELECT (SELECT count(*) FROM main.%s)"
+                  "      =(SELECT count(*) FROM aux.%s)", zId, zId);
+  if( nulls.nUsed ){
+    strPrintf(&sql, "\n   AND NOT EXISTS(SELECT 1 FROM main.%s WHERE %s)"
+                    "\n   AND NOT EXISTS(SELECT 1 FROM aux.%s WHERE %s)",
+                    zId, nulls.z, zId, nulls.z);
+  }
+  /* A row value comparison, which SQLite splits into one term per column
+  ** for the lookup, but which does not nest one expression per column and
+  ** so stays within the expression depth limit for wide tables */
+  strPrintf(&sql, "\n   AND NOT EXISTS(SELECT 1 FROM main.%s A\n", zId);
+  strPrintf(&sql, "                   WHERE NOT EXISTS(SELECT 1 FROM aux.%s B\n", zId);
+  strPrintf(&sql, "                                     WHERE (%s) IS (%s)))",
+            colsA.z, colsB.z);
+
+  if( g.fDebug & DEBUG_DIFF_SQL ){
+    printf("SQL for %s:\n%s\n", zId, sql.z);
+  }
+
+  pStmt = db_prepare("%s", sql.z);
+  if( pStmt==0 ){
+    rc = SQLITE_ERROR;
+  }else if( SQLITE_ROW==sqlite3_step(pStmt) ){
+    *pbDiffer = sqlite3_column_int(pStmt, 0)==0;
+  }
+  if( pStmt && sqlite3_finalize(pStmt)!=SQLITE_OK ) rc = SQLITE_ERROR;
+
+  end_check_one_table:
+  sqlite3_free(sql.z);
+  sqlite3_free(colsA.z);
+  sqlite3_free(colsB.z);
+  sqlite3_free(nulls.z);
+  sqlite3_free(zId);
+  return rc;
+}
+
+int sqlitediff_check_prepared(sqlite3 *db, const char* zTab, int* pbDiffer){
   sqlite3_stmt *pStmt;
+  struct DiffCache *p;
+  sqlite3_int64 aiData[3];
+  int bDiffer = 0;
+  int rc;
 
   g.db = db;
+  rc = cacheBegin();
+  if( rc ) return rc;
+  p = g.pCache;
+  if( p ){
+    aiData[0] = p->aiVersion[2];
+    aiData[1] = p->aiVersion[3];
+    aiData[2] = sqlite3_total_changes64(db);
+    if( p->bCheck && memcmp(aiData, p->aiCheckData, sizeof(aiData))==0
+     && (zTab ? p->zCheckTab && strcmp(zTab, p->zCheckTab)==0 : p->zCheckTab==0) ){
+      /* Neither database was written since the last check */
+      *pbDiffer = p->bCheckDiffer;
+      return SQLITE_OK;
+    }
+  }
 
   if( zTab ){
-    changeset_one_table(zTab, table_callback, instr_callback, context);
+    pStmt = db_prepare(
+      "SELECT (SELECT sql FROM main.sqlite_master WHERE name=%Q)"
+      "    IS (SELECT sql FROM aux.sqlite_master WHERE name=%Q)", zTab, zTab);
+    if( pStmt==0 ) return SQLITE_ERROR;
+    if( SQLITE_ROW!=sqlite3_step(pStmt) || sqlite3_column_int(pStmt, 0)==0 ){
+      bDiffer = 1;
+    }
+    sqlite3_finalize(pStmt);
   }else{
-    /* Handle tables one by one */
+    if( check_pages_identical() ){
+      bDiffer = 0;
+      goto end_check;
+    }
+    /* The schema objects that differ, of tables the filters let through,
+    ** leaving out the capture triggers on them */
     pStmt = db_prepare(
-      "SELECT name FROM main.sqlite_master\n"
-      " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
-      " UNION\n"
-      "SELECT name FROM aux.sqlite_master\n"
-      " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
-      " ORDER BY name"
-      );
+      "SELECT tbl_name, name FROM (\n"
+      "  SELECT type, name, tbl_name, sql FROM main.sqlite_master\n"
+      "  EXCEPT SELECT type, name, tbl_name, sql FROM aux.sqlite_master)\n"
+      " UNION ALL\n"
+      "SELECT tbl_name, name FROM (\n"
+      "  SELECT type, name, tbl_name, sql FROM aux.sqlite_master\n"
+      "  EXCEPT SELECT type, name, tbl_name, sql FROM main.sqlite_master)");
+    if( pStmt==0 ) return SQLITE_ERROR;
+    while( !bDiffer && SQLITE_ROW==sqlite3_step(pStmt) ){
+      bDiffer = tableIncluded((const char*)sqlite3_column_text(pStmt, 0))
+             && !isCaptureName((const char*)sqlite3_column_text(pStmt, 1));
+    }
+    if( sqlite3_finalize(pStmt)!=SQLITE_OK ) return SQLITE_ERROR;
+  }
 
-    while( rc == SQLITE_OK && SQLITE_ROW==sqlite3_step(pStmt) ){
-      rc = changeset_one_table((const char*)sqlite3_column_text(pStmt,0), table_callback, instr_callback, context);
+  if( !bDiffer ){
+    if( zTab ){
+      rc = check_one_table(zTab, &bDiffer);
+    }else{
+      pStmt = db_prepare(
+        "SELECT name FROM main.sqlite_master\n"
+        " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
+        " ORDER BY name"
+        );
+      while( rc==SQLITE_OK && !bDiffer && SQLITE_ROW==sqlite3_step(pStmt) ){
+        const char *zName = (const char*)sqlite3_column_text(pStmt,0);
+        if( tableIncluded(zName) ) rc = check_one_table(zName, &bDiffer);
+      }
+      sqlite3_finalize(pStmt);
     }
-    sqlite3_finalize(pStmt);
+    if( rc ) return rc;
   }
 
-  return rc;
+  end_check:
+  if( p ){
+    sqlite3_free(p->zCheckTab);
+    p->zCheckTab = zTab ? sqlite3_mprintf("%s", zTab) : 0;
+    memcpy(p->aiCheckData, aiData, sizeof(aiData));
+    p->bCheckDiffer = bDiffer;
+    p->bCheck = 1;
+  }
+  *pbDiffer = bDiffer;
+  return SQLITE_OK;
 }
 
-int sqlitediff_diff_prepared(
-  sqlite3 *db,
-  const char* zTab, /* name of table to diff, or NULL for all tables */
-  FILE* out     /* Output stream */
-) {
-  return slitediff_diff_prepared_callback(db, zTab, sqlitediff_write_table, sqlitediff_write_instruction, out);
+/*
+** Return zPath as a URI with immutable=1, or a copy of zPath unchanged if
+** bImmutable is false. Free the result with sqlite3_free().
+*/
+static char *dbUri(const char *zPath, int bImmutable){
+  Str uri;
+  const char *z;
+  if( !bImmutable ) return sqlite3_mprintf("%s", zPath);
+  strInit(&uri);
+  strPrintf(&uri, "file:");
+  for(z=zPath; *z; z++){
+    if( *z=='%' || *z=='?' || *z=='#' ){
+      strPrintf(&uri, "%%%02X", (unsigned char)*z);
+    }else{
+      strPrintf(&uri, "%c", *z);
+    }
+  }
+  strPrintf(&uri, "?immutable=1");
+  return uri.z;
 }
 
-int sqlitediff_diff(const char* zDb1, const char* zDb2, const char* zTab, FILE* out){
+int sqlitediff_open(const char* zDb1, const char* zDb2, sqlite3** pDb){
+  return sqlitediff_open_v2(zDb1, zDb2, 0, pDb);
+}
+
+int sqlitediff_open_v2(const char* zDb1, const char* zDb2, int flags, sqlite3** pDb){
   int rc;
   char *zErrMsg = 0;
   char *zSql;
+  char *zUri;
+  sqlite3 *db;
 
-  sqlite3_config(SQLITE_CONFIG_SINGLETHREAD);
-
-  g.fDebug = 0;
-
-  rc = sqlite3_open(zDb1, &g.db);
+  *pDb = 0;
+  /* Plain paths are opened as before; URIs are only for immutable=1, which
+  ** the ATTACH of zDb2 needs the flag on this connection for too */
+  zUri = dbUri(zDb1, flags & SQLITEDIFF_OPEN_IMMUTABLE1);
+  rc = sqlite3_open_v2(zUri, &db,
+      ((flags & (SQLITEDIFF_OPEN_IMMUTABLE1|SQLITEDIFF_OPEN_IMMUTABLE2)) ? SQLITE_OPEN_URI : 0) |
+      ((flags & SQLITEDIFF_OPEN_IMMUTABLE1) ?
+        SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE), 0);
+  sqlite3_free(zUri);
   if( rc ){
+    sqlite3_close(db);
     return runtimeError("cannot open database file \"%s\"", zDb1);
   }
-  rc = sqlite3_exec(g.db, "SELECT * FROM sqlite_master", 0, 0, &zErrMsg);
+  rc = sqlite3_exec(db, "SELECT * FROM sqlite_master", 0, 0, &zErrMsg);
   if( rc || zErrMsg ){
+    sqlite3_free(zErrMsg);
+    sqlite3_close(db);
     return runtimeError("\"%s\" does not appear to be a valid SQLite database", zDb1);
   }
 
-  zSql = sqlite3_mprintf("ATTACH %Q as aux;", zDb2);
-  rc = sqlite3_exec(g.db, zSql, 0, 0, &zErrMsg);
+  zUri = dbUri(zDb2, flags & SQLITEDIFF_OPEN_IMMUTABLE2);
+  zSql = sqlite3_mprintf("ATTACH %Q as aux;", zUri);
+  sqlite3_free(zUri);
+  rc = sqlite3_exec(db, zSql, 0, 0, &zErrMsg);
+  sqlite3_free(zSql);
   if( rc || zErrMsg ){
+    sqlite3_free(zErrMsg);
+    sqlite3_close(db);
     return runtimeError("cannot attach database \"%s\"", zDb2);
   }
-  rc = sqlite3_exec(g.db, "SELECT * FROM aux.sqlite_master", 0, 0, &zErrMsg);
+  rc = sqlite3_exec(db, "SELECT * FROM aux.sqlite_master", 0, 0, &zErrMsg);
   if( rc || zErrMsg ){
+    sqlite3_free(zErrMsg);
+    sqlite3_close(db);
     return runtimeError("\"%s\" does not appear to be a valid SQLite database", zDb2);
   }
 
+  *pDb = db;
+  return SQLITE_OK;
+}
+
+int sqlitediff_diff(const char* zDb1, const char* zDb2, const char* zTab, FILE* out){
+  int rc;
+
+  sqlite3_config(SQLITE_CONFIG_SINGLETHREAD);
+
+  g.fDebug = 0;
+
+  rc = sqlitediff_open(zDb1, zDb2, &g.db);
+  if( rc ) return rc;
+
   rc = sqlitediff_diff_prepared(g.db, zTab, out);
 
   /* TBD: Handle trigger differences */
@@ -611,6 +3109,19 @@ int sqlitediff_diff(const char* zDb1, const char* zDb2, const char* zTab, FILE*
   return rc;
 }
 
+int sqlitediff_check(const char* zDb1, const char* zDb2, const char* zTab, int* pbDiffer){
+  int rc;
+  sqlite3 *db;
+
+  rc = sqlitediff_open(zDb1, zDb2, &db);
+  if( rc ) return rc;
+
+  rc = sqlitediff_check_prepared(db, zTab, pbDiffer);
+
+  sqlite3_close(db);
+  return rc;
+}
+
 int sqlitediff_diff_file(
   const char* zDb1,
   const char* zDb2,
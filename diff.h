@@ -8,6 +8,65 @@ extern "C" {
 #include <stdio.h>
 #include "sqlite3.h"
 
+/*
+** ORed into the type of an UPDATE's new TEXT or BLOB value that is stored as
+** a binary delta against the old value. See delta.h.
+*/
+#define SQLITEDIFF_DELTA 0x40
+
+/*
+** Type of a BLOB of data1.iVal bytes that has not been read into memory.
+** data2 points to a struct BlobRef. Only passed to InstrCallbacks if
+** DiffOptions.nStreamThreshold is set.
+*/
+#define SQLITEDIFF_BLOBREF 0x80
+
+/*
+** Type of a value that repeats a TEXT or BLOB value written earlier in the
+** same table block. data1.iVal is its dictionary entry number.
+*/
+#define SQLITEDIFF_DICTREF 0x20
+
+/*
+** Second byte of an UPDATE that leaves out its unchanged columns, naming
+** the changed ones in a bitmap or in a list of column numbers instead.
+*/
+#define SQLITEDIFF_UPDATE_BITMAP 0x01
+#define SQLITEDIFF_UPDATE_LIST 0x02
+
+/* Maximum number of dictionary entries per table block */
+#define SQLITEDIFF_DICT_ENTRIES 65536
+
+/* Size of the chunks large BLOBs are streamed in */
+#define SQLITEDIFF_CHUNK 65536
+
+/*
+** Checksummed changesets start with a 'K' record naming the algorithm and
+** end every chunk of about SQLITEDIFF_CHECKSUM_CHUNK bytes, cut at an
+** instruction boundary, with a 'C' record.
+*/
+#define SQLITEDIFF_CHECKSUM_CRC32C 1
+#define SQLITEDIFF_CHECKSUM_CHUNK (1 << 20)
+
+struct BlobRef {
+  sqlite3* db;
+  const char* zDb;
+  const char* zTab;
+  const char* zCol;
+  sqlite3_int64 iRowid;
+};
+
+/*
+** Read the nByte bytes of a BLOB in SQLITEDIFF_CHUNK-sized pieces and pass
+** them to xOutput, stopping if it returns non-zero.
+*/
+int sqlitediff_blob_stream(
+  const struct BlobRef* pRef,
+  sqlite3_int64 nByte,
+  int (*xOutput)(void* pOut, const void* pData, int nData),
+  void* pOut
+);
+
 struct sqlite_value
 {
   int16_t type;
@@ -18,11 +77,15 @@ struct sqlite_value
   const char* data2; //< Used for BLOB and TEXT
 };
 
+/* Point dst at the value of src, valid as long as src is unchanged */
+void sqlite3_value_to_sqlite_value(sqlite3_value* src, struct sqlite_value* dst);
+
 struct TableInfo {
   const char* tableName;
-  uint8_t nCol;
+  int nCol;
   int* PKs;
-  const char** columnNames;
+  const char** columnNames; //< Quoted column names, or NULL if not known
+  int bProjected; //< 1 if the instructions only cover columnNames, not every column
 };
 
 struct Instruction {
@@ -32,12 +95,91 @@ struct Instruction {
   int* valFlag; //< For UPDATE instrs, array of flags indicating whether the value has changed
 };
 
+/*
+** Values of DiffOptions.eStrategy. With AUTO, the default, each table is
+** joined if it is small and otherwise compared the way that is estimated
+** to visit the fewest rows. Row counts are taken from sqlite_stat1 if
+** ANALYZE has run, estimated from the rowid range, or counted up to a
+** limit, each bounded by the rows that fit in the file. MERGE is only
+** possible for tables of a UTF-8 database whose PRIMARY KEY and compared
+** columns use the BINARY collation and that are not streamed or captured;
+** the join is used for all others. Both write the same changeset.
+**
+** A merge of a wide table whose sides have about the same number of rows
+** scans only the PRIMARY KEY and a sqlitediff_rowhash() of the other
+** columns (see rowhash.h), and reads a row in full only if its hash
+** differs or it has no match. Two rows with colliding 64-bit hashes would
+** be taken as equal.
+*/
+#define SQLITEDIFF_STRATEGY_AUTO  0
+#define SQLITEDIFF_STRATEGY_JOIN  1 /* One query joining main and aux on the PRIMARY KEY */
+#define SQLITEDIFF_STRATEGY_MERGE 2 /* Two scans in PRIMARY KEY order, merged row by row */
+
+struct DiffOptions {
+  const char** azIncludeTables;  //< NULL-terminated GLOBs of tables to diff, NULL for all
+  const char** azExcludeTables;  //< NULL-terminated GLOBs of tables to skip
+  const char** azExcludeColumns; //< NULL-terminated "table.column" GLOBs of columns to skip
+  sqlite3_int64 nDeltaThreshold; //< Write changed TEXT/BLOB values of at least this many bytes as deltas, 0 to disable
+  sqlite3_int64 nStreamThreshold; //< Stream BLOBs of at least this many bytes instead of reading them into memory, 0 to disable
+  int nDictMaxSize; //< Write repeated TEXT/BLOB values of at most this many bytes as dictionary references, 0 to disable
+  sqlite3_int64 nMemoryBudget; //< Bytes of memory the diff should stay within (sets the process-wide soft heap limit and the page caches for the call), 0 for SQLite's defaults
+  int bChecksum; //< Write CRC32C checksums that readers verify before applying anything
+  int bCaptured; //< Only compare rows whose PRIMARY KEYs aux has captured, see sqlitediff_capture_install()
+  int bLive; //< Diff inside one read transaction, a consistent view of live WAL databases that does not block their writers
+  int bSessionFormat; //< Write the session extension's changeset format, which sqlite3changeset_apply() reads. Overrides deltas, dictionary and checksums; excluded columns are an error
+  int eStrategy; //< How tables are compared, one of SQLITEDIFF_STRATEGY_*
+  FILE* pPlanLog; //< Write the strategy chosen for each table and its cost estimate here, NULL for none
+};
+
+struct DiffStats {
+  int nTable;                     //< Tables diffed
+  sqlite3_int64 nInsert;          //< Instructions produced, by type
+  sqlite3_int64 nUpdate;
+  sqlite3_int64 nDelete;
+  sqlite3_int64 nSqliteHighwater; //< Peak memory allocated by SQLite
+  sqlite3_int64 nPeakRss;         //< Peak resident set size of the process over its lifetime so far, not only this diff
+  sqlite3_int64 nWalGrowth;       //< Bytes the WAL files grew by during a live diff
+};
+
+/* Statistics of the last diff */
+void sqlitediff_stats(struct DiffStats* pStats);
+
+/*
+** Set the options used by all following diffs. The arrays are not copied
+** and must stay valid. Pass NULL to restore the defaults.
+**
+** Excluded columns are neither selected nor compared, so SQLite never reads
+** them. PRIMARY KEY columns cannot be excluded.
+*/
+void sqlitediff_set_options(const struct DiffOptions* pOpt);
+
 typedef int (*InstrCallback)(const struct Instruction* instr, void* context);
 typedef int (*TableCallback)(const struct TableInfo* table, void* context);
 
+/*
+** Receives nInstr (at least 1) consecutive instructions of one table. Their
+** values are stored contiguously, aInstr[i].values pointing into one array
+** of nInstr*nCol*2 values, and stay valid until the callback returns.
+*/
+typedef int (*BatchCallback)(const struct Instruction* aInstr, int nInstr, void* context);
+
+/* Write the plain changeset format, context is the FILE* to write to */
 int sqlitediff_write_table(const struct TableInfo* table, void* context);
 int sqlitediff_write_instruction(const struct Instruction* instr, void* context);
 
+/*
+** Changeset writer that keeps state between calls, such as the value
+** dictionary of the current table block. Encoding options are taken from
+** sqlitediff_set_options() when the writer is opened. sqlitediff_writer_table
+** and sqlitediff_writer_instruction take the writer as their context.
+** Closing the writer writes the final checksum record, if any.
+*/
+struct ChangesetWriter;
+struct ChangesetWriter* sqlitediff_writer_open(FILE* out);
+void sqlitediff_writer_close(struct ChangesetWriter* pWriter);
+int sqlitediff_writer_table(const struct TableInfo* table, void* pWriter);
+int sqlitediff_writer_instruction(const struct Instruction* instr, void* pWriter);
+
 int slitediff_diff_prepared_callback(
   sqlite3 *db,
   const char* zTab,
@@ -46,6 +188,20 @@ int slitediff_diff_prepared_callback(
   void* context
 );
 
+/*
+** Like slitediff_diff_prepared_callback, but deliver the instructions in
+** batches of up to nBatch rows. TEXT and BLOB values are copied into one
+** buffer that is reused for every batch.
+*/
+int slitediff_diff_prepared_batch(
+  sqlite3 *db,
+  const char* zTab,
+  TableCallback table_callback,
+  BatchCallback batch_callback,
+  int nBatch,
+  void* context
+);
+
 /* Database B must be attached as 'aux' */
 int sqlitediff_diff_prepared(
   sqlite3 *db,
@@ -53,6 +209,129 @@ int sqlitediff_diff_prepared(
   FILE* out         /* Output stream */
 );
 
+/*
+** Return the shard, in [0, nShard), that instr belongs to. Only the PRIMARY
+** KEY values of instr may be relied upon.
+*/
+typedef int (*ShardCallback)(const struct Instruction* instr, int nShard, void* context);
+
+/* Hash of the PRIMARY KEY values modulo nShard, the default ShardCallback */
+int sqlitediff_shard_pk_hash(const struct Instruction* instr, int nShard, void* context);
+
+/*
+** Like sqlitediff_diff_prepared, but write each instruction to one of nShard
+** outputs, chosen by xShard (sqlitediff_shard_pk_hash if NULL). Every output
+** is a complete changeset carrying only the tables and rows of its shard.
+*/
+int sqlitediff_diff_sharded(
+  sqlite3 *db,
+  const char* zTab,
+  FILE** aOut,        /* nShard output streams */
+  int nShard,
+  ShardCallback xShard,
+  void* context       /* passed to xShard */
+);
+
+/*
+** Diff the "main" database of db against the "main" database of each of the
+** nTarget connections in aTarget, writing the changeset from db to
+** aTarget[i] to aOut[i]. Every table of db is read once, in PRIMARY KEY
+** order, and merge-compared against one cursor per target, so the cost of
+** reading the base is shared by all targets. A target that lacks a table
+** or has a different schema for it gets no rows of that table.
+**
+** PRIMARY KEY values are compared with the BINARY collation; tables whose
+** PRIMARY KEY uses another collation are skipped, and databases not in
+** UTF-8 are an error. Table and column filters
+** apply, the streaming, capture and live options do not.
+*/
+int sqlitediff_diff_multi(
+  sqlite3 *db,
+  const char* zTab,   /* name of table to diff, or NULL for all tables */
+  sqlite3** aTarget,  /* nTarget target connections */
+  FILE** aOut,        /* nTarget output streams */
+  int nTarget
+);
+
+/*
+** Set *pbDiffer to 1 if main and aux differ and 0 otherwise, returning as
+** soon as the first difference is found. Cheap tests (identical pages,
+** schema text, row counts) run before any rows are compared.
+*/
+int sqlitediff_check_prepared(
+  sqlite3 *db,
+  const char* zTab, /* name of table to check, or NULL for all tables */
+  int* pbDiffer
+);
+
+int sqlitediff_check(
+  const char* zDb1,
+  const char* zDb2,
+  const char* zTab,
+  int* pbDiffer
+);
+
+/*
+** Open zDb1 and attach zDb2 as 'aux', ready for sqlitediff_diff_prepared().
+** On success *pDb must be closed by the caller.
+*/
+int sqlitediff_open(
+  const char* zDb1,
+  const char* zDb2,
+  sqlite3** pDb
+);
+
+/*
+** Install triggers on table zTab of schema zDb, or on all its tables if zTab
+** is NULL, that record the PRIMARY KEY of every inserted, updated or deleted
+** row in a table SQLITEDIFF_CAPTURE_PREFIX<table> of the same schema. A
+** diff with DiffOptions.bCaptured whose aux is that database then looks up
+** only the captured rows of each table, so its cost follows the amount of
+** change rather than the table sizes.
+**
+** sqlitediff_capture_reset() forgets all captured rows. To not lose changes
+** made in between, run it in one write transaction with the diff.
+*/
+#define SQLITEDIFF_CAPTURE_PREFIX "sqlitediff_capture_"
+int sqlitediff_capture_install(sqlite3* db, const char* zDb, const char* zTab);
+int sqlitediff_capture_reset(sqlite3* db, const char* zDb);
+
+/* Flags for sqlitediff_open_v2() */
+#define SQLITEDIFF_OPEN_IMMUTABLE1 0x01 /* zDb1 cannot change while open: skip all locking */
+#define SQLITEDIFF_OPEN_IMMUTABLE2 0x02 /* the same for zDb2 */
+
+/*
+** Like sqlitediff_open(), opening frozen files, such as snapshot copies, as
+** immutable=1 URIs.
+*/
+int sqlitediff_open_v2(
+  const char* zDb1,
+  const char* zDb2,
+  int flags,
+  sqlite3** pDb
+);
+
+/*
+** Keep what the diffs and checks of db work out between calls, for a
+** connection that is diffed again and again. Column metadata and prepared
+** diff queries are reused until the schema cookie of main or aux, the
+** options or the attached files change. The result of
+** sqlitediff_check_prepared() is reused while PRAGMA data_version and
+** sqlite3_total_changes() show that neither database was written since.
+** Returns NULL on error. Close the cache before db.
+*/
+struct DiffCache;
+struct DiffCache* sqlitediff_cache_open(sqlite3* db);
+void sqlitediff_cache_close(struct DiffCache* pCache);
+
+/*
+** Pin pWorker, a connection with the same databases open as main and aux,
+** to the versions of them that a live diff on db is reading, so that work
+** can be split between connections without giving up a consistent view.
+** Needs SQLite built with SQLITE_ENABLE_SNAPSHOT.
+*/
+int sqlitediff_live_share(sqlite3* db, sqlite3* pWorker);
+
 int sqlitediff_diff(
   const char* zDb1,
   const char* zDb2,
@@ -0,0 +1,170 @@
+#include "fanout.h"
+
+#include "batch.h"
+#include "diff.h"
+#include "patch.h"
+#include "queue.h"
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/* Instructions per batch and number of batches queued per target */
+const size_t kBatchSize = 256;
+const size_t kQueueDepth = 16;
+
+typedef std::shared_ptr<const InstructionBatch> SharedBatch;
+
+struct FanoutTarget
+{
+	FanoutTarget() : queue(kQueueDepth), db(nullptr), rc(SQLITE_OK) {}
+
+	BoundedQueue<SharedBatch> queue;
+	sqlite3* db;
+	std::atomic<int> rc;
+};
+
+struct FanoutState
+{
+	FanoutState() : readRc(SQLITE_OK), tableName(nullptr) {}
+
+	std::vector<std::unique_ptr<FanoutTarget>> targets;
+	std::atomic<int> readRc; //< Set before the queues are closed
+
+	/* Table names point into the changeset, so they identify a table block */
+	const char* tableName;
+	std::shared_ptr<const OwnedTable> table;
+	std::shared_ptr<InstructionBatch> current;
+};
+
+/* Returns SQLITE_ABORT once no target is left to apply to. */
+int flushBatch(FanoutState* state)
+{
+	if (! state->current) {
+		return SQLITE_OK;
+	}
+
+	state->current->seal();
+	SharedBatch batch = state->current;
+	state->current.reset();
+
+	bool alive = false;
+	for (auto& target : state->targets) {
+		if (target->rc.load() == SQLITE_OK && target->queue.push(batch)) {
+			alive = true;
+		}
+	}
+	return alive ? SQLITE_OK : SQLITE_ABORT;
+}
+
+int fanoutInstrCallback(const Instruction* instr, void* context)
+{
+	FanoutState* state = (FanoutState*)context;
+	int rc = SQLITE_OK;
+
+	if (instr->table->tableName != state->tableName) {
+		rc = flushBatch(state);
+		state->tableName = instr->table->tableName;
+		state->table = std::make_shared<OwnedTable>(instr->table);
+	}
+
+	if (! state->current) {
+		state->current = std::make_shared<InstructionBatch>();
+		state->current->reset(state->table);
+	}
+
+	if (rc == SQLITE_OK) {
+		rc = state->current->add(instr);
+	}
+
+	if (rc == SQLITE_OK && state->current->size() >= kBatchSize) {
+		rc = flushBatch(state);
+	}
+	return rc;
+}
+
+void applyLoop(FanoutTarget* target, const std::atomic<int>* readRc)
+{
+	int rc = applyBegin(target->db);
+	SharedBatch batch;
+
+	while (target->queue.pop(batch)) {
+		/* After an error keep draining, so the decoder never blocks on this
+		 * target's queue. */
+		for (size_t i=0; rc == SQLITE_OK && i < batch->size(); i++) {
+			Instruction instr;
+			batch->get(i, &instr);
+			rc = applyInstruction(&instr, target->db);
+		}
+		if (rc != SQLITE_OK) {
+			target->rc.store(rc);
+		}
+		batch.reset();
+	}
+
+	/* A changeset that could not be read completely is not applied at all */
+	if (rc == SQLITE_OK) {
+		rc = readRc->load();
+	}
+	int rc2 = applyEnd(target->db, rc);
+	target->rc.store(rc ? rc : rc2);
+}
+
+} // namespace
+
+int sqlitediff_apply_fanout(const char* zFile, const char** azTarget, int nTarget, int* aRc)
+{
+	int rc = SQLITE_OK;
+	FanoutState state;
+
+	for (int i=0; i < nTarget; i++) {
+		state.targets.emplace_back(new FanoutTarget);
+		FanoutTarget* target = state.targets.back().get();
+		int rc2 = sqlite3_open_v2(azTarget[i], &target->db, SQLITE_OPEN_READWRITE, nullptr);
+		if (rc2 != SQLITE_OK) {
+			std::cerr << "Could not open sqlite DB " << azTarget[i] << ": " << sqlite3_errstr(rc2) << std::endl;
+			target->rc.store(rc2);
+			target->queue.close();
+		}
+	}
+
+	std::vector<std::thread> appliers;
+	for (auto& target : state.targets) {
+		if (target->rc.load() == SQLITE_OK) {
+			appliers.emplace_back(applyLoop, target.get(), &state.readRc);
+		}
+	}
+
+	rc = readChangeset(zFile, fanoutInstrCallback, &state);
+	if (rc == SQLITE_OK) {
+		rc = flushBatch(&state);
+	}
+	state.current.reset();
+	state.readRc.store(rc);
+
+	for (auto& target : state.targets) {
+		target->queue.close();
+	}
+	for (auto& applier : appliers) {
+		applier.join();
+	}
+
+	int firstRc = SQLITE_OK;
+	for (int i=0; i < nTarget; i++) {
+		FanoutTarget* target = state.targets[i].get();
+		int targetRc = target->rc.load();
+		if (aRc) {
+			aRc[i] = targetRc;
+		}
+		if (firstRc == SQLITE_OK) {
+			firstRc = targetRc;
+		}
+		sqlite3_close(target->db);
+	}
+
+	return firstRc != SQLITE_OK ? firstRc : rc;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Apply the changeset in zFile to each of the nTarget databases in azTarget.
+**
+** The changeset is decoded once on the calling thread. Batches of decoded
+** instructions are shared between one apply thread per target, each with its
+** own connection and its own bounded queue, so a slow target only holds back
+** the decoder once its queue is full.
+**
+** Every target is written inside its own savepoint. A target that fails is
+** rolled back on its own while the others carry on. If aRc is not NULL it
+** receives the result of each target. Returns SQLITE_OK if every target was
+** patched and the first error otherwise.
+*/
+int sqlitediff_apply_fanout(
+  const char* zFile,
+  const char** azTarget,
+  int nTarget,
+  int* aRc
+);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -1,11 +1,18 @@
 #include "diff.h"
+#include "serve.h"
 #include "sqlite3.h"
 
+#include <climits>
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
 
 using namespace std;
 
+/* Database pairs whose connections sqlite-diff --serve keeps open */
+const int kServeMaxDb = 32;
+
 void trace_callback(void* udp, const char* sql) {
 	std::cerr << "{SQL} " << sql << std::endl;
 }
@@ -15,17 +22,246 @@ void trace_callback(void* udp, const char* sql) {
 	if (rc != 0) {															\
 		std::cerr << "Error: " << #X << " returned " << rc << std::endl;	\
 		std::cerr << sqlite3_errstr(rc) << std::endl;						\
-		return rc;															\
+		return 2;															\
 	}																		\
 } while(0)
 
-const char* usage = "Usage: sqlite-diff [db1] [db2]";
+const char* usage = "Usage: sqlite-diff [options] [db1] [db2]\n"
+	"       sqlite-diff [options] --targets PREFIX [base] [target...]\n"
+	"       sqlite-diff --serve SOCKET\n"
+	"       sqlite-diff --connect SOCKET [options] [db1] [db2]\n"
+	"       sqlite-diff --connect SOCKET --shutdown\n"
+	"  --check                Only test whether db1 and db2 differ. Exits with 0 if\n"
+	"                         they are identical, 1 if they differ and 2 on error.\n"
+	"  --table GLOB           Only diff tables matching GLOB (repeatable)\n"
+	"  --exclude-table GLOB   Skip tables matching GLOB (repeatable)\n"
+	"  --exclude-column T.C   Skip columns matching GLOB C in tables matching\n"
+	"                         GLOB T (repeatable)\n"
+	"  --delta-threshold N    Write changed TEXT/BLOB values of at least N bytes\n"
+	"                         as binary deltas where that is smaller\n"
+	"  --stream-threshold N   Stream BLOBs of at least N bytes from the database in\n"
+	"                         chunks instead of reading them into memory\n"
+	"  --dict-max-size N      Write repeated TEXT/BLOB values of at most N bytes\n"
+	"                         as references to their first occurrence\n"
+	"  --memory-budget N      Keep SQLite's heap, page caches and sorter within\n"
+	"                         about N bytes, spilling to temporary files\n"
+	"  --temp-dir DIR         Directory for temporary files\n"
+	"  --stats                Print statistics, including peak memory, to stderr\n"
+	"  --strategy S           Compare tables with S: join, merge or auto, which\n"
+	"                         chooses per table from its estimated size\n"
+	"  --plan                 Print the strategy chosen for each table and its\n"
+	"                         cost estimate to stderr\n"
+	"  --captured             Only diff the rows of db2 whose changes its capture\n"
+	"                         triggers recorded, then forget them\n"
+	"  --install-capture DB   Install capture triggers on every table of DB\n"
+	"  --live                 Read both databases in one read transaction: a\n"
+	"                         consistent view of live WAL databases that never\n"
+	"                         blocks their writers\n"
+	"  --immutable1           db1 is a frozen copy, open it without any locking\n"
+	"  --immutable2           The same for db2\n"
+	"  --session              Write the changeset format of SQLite's session\n"
+	"                         extension, without deltas, dictionary or checksums\n"
+	"  --checksum             Add CRC32C checksums, verified before applying\n"
+	"  --shards N PREFIX      Split the changeset by PRIMARY KEY hash into N files\n"
+	"                         PREFIX0 ... PREFIX<N-1> instead of writing to stdout\n"
+	"  --targets PREFIX       Diff base against every target, reading base once,\n"
+	"                         and write the changeset to target i to PREFIX<i>\n"
+	"  --serve SOCKET         Serve diffs on the UNIX socket SOCKET, keeping the\n"
+	"                         connections, caches and prepared queries of recently\n"
+	"                         diffed databases warm between requests\n"
+	"  --connect SOCKET       Run the diff or check in the server on SOCKET";
 
 int main(int argc, char const *argv[])
 {
-	if (argc != 3) {
+	if (argc == 3 && string(argv[1]) == "--serve") {
+		return sqlitediff_serve(argv[2], kServeMaxDb) == SQLITE_OK ? 0 : 2;
+	}
+
+	if (argc > 3 && string(argv[1]) == "--connect") {
+		const char* socketPath = argv[2];
+		vector<string> args(argv + 3, argv + argc);
+		/* The server resolves paths in its own working directory */
+		if (args.size() >= 2 && args.back().compare(0, 2, "--") != 0) {
+			for (size_t i = args.size() - 2; i < args.size(); i++) {
+				char path[PATH_MAX];
+				if (realpath(args[i].c_str(), path)) {
+					args[i] = path;
+				}
+			}
+		}
+		vector<const char*> request;
+		for (const auto& arg : args) {
+			request.push_back(arg.c_str());
+		}
+
+		int status;
+		int rc = sqlitediff_request(socketPath, (int) request.size(), request.data(), stdout, &status);
+		if (rc != SQLITE_OK) {
+			cerr << "Could not reach a server on " << socketPath << endl;
+			return 2;
+		}
+		return status;
+	}
+
+	bool check = false;
+	bool stats = false;
+	int openFlags = 0;
+	int shards = 0;
+	string shardPrefix;
+	const char* targetPrefix = nullptr;
+	DiffOptions options = {};
+	vector<const char*> includeTables;
+	vector<const char*> excludeTables;
+	vector<const char*> excludeColumns;
+	sqlite3_int64 deltaThreshold = 0;
+	sqlite3_int64 streamThreshold = 0;
+	int dictMaxSize = 0;
+
+	while (argc > 1 && string(argv[1]).compare(0, 2, "--") == 0) {
+		string opt = argv[1];
+		if (opt == "--check") {
+			check = true;
+		} else if (argc > 2 && opt == "--table") {
+			includeTables.push_back(argv[2]);
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--exclude-table") {
+			excludeTables.push_back(argv[2]);
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--exclude-column") {
+			excludeColumns.push_back(argv[2]);
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--delta-threshold") {
+			deltaThreshold = atoll(argv[2]);
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--stream-threshold") {
+			streamThreshold = atoll(argv[2]);
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--dict-max-size") {
+			dictMaxSize = atoi(argv[2]);
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--memory-budget") {
+			options.nMemoryBudget = atoll(argv[2]);
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--temp-dir") {
+			// Process-wide, so set here before any database is opened
+			sqlite3_temp_directory = sqlite3_mprintf("%s", argv[2]);
+			argc--; argv++;
+		} else if (opt == "--captured") {
+			options.bCaptured = 1;
+		} else if (argc > 2 && opt == "--install-capture") {
+			sqlite3* db;
+			int rc = sqlite3_open_v2(argv[2], &db, SQLITE_OPEN_READWRITE, nullptr);
+			if (rc == SQLITE_OK) {
+				rc = sqlitediff_capture_install(db, "main", nullptr);
+			}
+			if (rc != SQLITE_OK) {
+				cerr << "Could not install capture triggers: " << sqlite3_errmsg(db) << endl;
+			}
+			sqlite3_close(db);
+			return rc == SQLITE_OK ? 0 : 2;
+		} else if (opt == "--live") {
+			options.bLive = 1;
+		} else if (opt == "--immutable1") {
+			openFlags |= SQLITEDIFF_OPEN_IMMUTABLE1;
+		} else if (opt == "--immutable2") {
+			openFlags |= SQLITEDIFF_OPEN_IMMUTABLE2;
+		} else if (opt == "--session") {
+			options.bSessionFormat = 1;
+		} else if (opt == "--checksum") {
+			options.bChecksum = 1;
+		} else if (opt == "--stats") {
+			stats = true;
+		} else if (argc > 2 && opt == "--strategy") {
+			string strategy = argv[2];
+			if (strategy == "join") {
+				options.eStrategy = SQLITEDIFF_STRATEGY_JOIN;
+			} else if (strategy == "merge") {
+				options.eStrategy = SQLITEDIFF_STRATEGY_MERGE;
+			} else if (strategy != "auto") {
+				cerr << "Unknown strategy " << strategy << endl << usage << endl;
+				return 2;
+			}
+			argc--; argv++;
+		} else if (opt == "--plan") {
+			options.pPlanLog = stderr;
+		} else if (argc > 2 && opt == "--targets") {
+			targetPrefix = argv[2];
+			argc--; argv++;
+		} else if (argc > 3 && opt == "--shards") {
+			shards = atoi(argv[2]);
+			shardPrefix = argv[3];
+			argc -= 2; argv += 2;
+		} else {
+			cerr << "Unknown option " << opt << endl << usage << endl;
+			return 2;
+		}
+		argc--; argv++;
+	}
+
+	if (targetPrefix && argc < 3) {
+		cerr << "Wrong number of arguments" << endl << usage << endl;
+		return 2;
+	}
+	if (! targetPrefix && argc != 3) {
         cerr << "Wrong number of arguments" << endl << usage << endl;
-		return 1;
+		return 2;
+	}
+
+	if (! includeTables.empty()) {
+		includeTables.push_back(nullptr);
+		options.azIncludeTables = includeTables.data();
+	}
+	excludeTables.push_back(nullptr);
+	options.azExcludeTables = excludeTables.data();
+	excludeColumns.push_back(nullptr);
+	options.azExcludeColumns = excludeColumns.data();
+	options.nDeltaThreshold = deltaThreshold;
+	options.nStreamThreshold = streamThreshold;
+	options.nDictMaxSize = dictMaxSize;
+	sqlitediff_set_options(&options);
+
+	if (targetPrefix) {
+		int rc = SQLITE_OK;
+		sqlite3* base = nullptr;
+		vector<sqlite3*> targets;
+		vector<FILE*> outs;
+		if (sqlite3_open_v2(argv[1], &base, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+			cerr << "Could not open sqlite DB " << argv[1] << endl;
+			rc = SQLITE_CANTOPEN;
+		}
+		for (int i=2; rc == SQLITE_OK && i < argc; i++) {
+			sqlite3* target;
+			string name = targetPrefix + to_string(i - 2);
+			if (sqlite3_open_v2(argv[i], &target, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+				cerr << "Could not open sqlite DB " << argv[i] << endl;
+				sqlite3_close(target);
+				rc = SQLITE_CANTOPEN;
+				break;
+			}
+			targets.push_back(target);
+			FILE* out = fopen(name.c_str(), "wb");
+			if (! out) {
+				cerr << "Could not open " << name << endl;
+				rc = SQLITE_CANTOPEN;
+				break;
+			}
+			outs.push_back(out);
+		}
+		if (rc == SQLITE_OK) {
+			rc = sqlitediff_diff_multi(base, nullptr, targets.data(), outs.data(), (int) targets.size());
+		}
+		for (FILE* out : outs) {
+			fclose(out);
+		}
+		for (sqlite3* target : targets) {
+			sqlite3_close(target);
+		}
+		sqlite3_close(base);
+		if (rc != SQLITE_OK) {
+			cerr << "Could not create changesets." << endl;
+			return 2;
+		}
+		return 0;
 	}
 
 	const char* db1File = argv[1];
@@ -33,22 +269,68 @@ int main(int argc, char const *argv[])
 
 	int rc;
 	sqlite3* db;
-	rc = sqlite3_open_v2(db1File, &db, SQLITE_OPEN_READWRITE, nullptr);
+	if (openFlags) {
+		rc = sqlitediff_open_v2(db1File, db2File, openFlags, &db);
+		if (rc != SQLITE_OK) {
+			return 2;
+		}
+	} else {
+		rc = sqlite3_open_v2(db1File, &db, SQLITE_OPEN_READWRITE, nullptr);
 
-	//sqlite3_trace(db, trace_callback, NULL);
+		//sqlite3_trace(db, trace_callback, NULL);
 
-	if (rc != SQLITE_OK) {
-		cerr << "Could not open sqlite DB " << db1File << endl;
-		return 2;
+		if (rc != SQLITE_OK) {
+			cerr << "Could not open sqlite DB " << db1File << endl;
+			return 2;
+		}
+
+		SQLOK(sqlite3_exec(db, (string() + "ATTACH '" + db2File + "' AS 'aux';").data(), 0, 0, 0));
 	}
 
-	SQLOK(sqlite3_exec(db, (string() + "ATTACH '" + db2File + "' AS 'aux';").data(), 0, 0, 0));
+	if (check) {
+		int differ = 0;
+		rc = sqlitediff_check_prepared(db, nullptr, &differ);
+		sqlite3_close(db);
+		if (rc != SQLITE_OK) {
+			cerr << "Could not compare databases." << endl;
+			return 2;
+		}
+		return differ ? 1 : 0;
+	}
 
-	sqlitediff_diff_prepared(
-		db,
-		nullptr,
-		stdout
-	);
+	if (shards > 0) {
+		vector<FILE*> outs;
+		for (int i=0; i < shards; i++) {
+			string name = shardPrefix + to_string(i);
+			FILE* out = fopen(name.c_str(), "wb");
+			if (! out) {
+				cerr << "Could not open " << name << endl;
+				break;
+			}
+			outs.push_back(out);
+		}
+		rc = (int) outs.size() == shards
+			? sqlitediff_diff_sharded(db, nullptr, outs.data(), shards, nullptr, nullptr)
+			: SQLITE_CANTOPEN;
+		for (FILE* out : outs) {
+			fclose(out);
+		}
+	} else if (options.bCaptured) {
+		/* Nothing may be captured between the diff and the reset */
+		SQLOK(sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0));
+		rc = sqlitediff_diff_prepared(db, nullptr, stdout);
+		if (rc == SQLITE_OK) {
+			fflush(stdout);
+			rc = sqlitediff_capture_reset(db, "aux");
+		}
+		sqlite3_exec(db, rc == SQLITE_OK ? "COMMIT" : "ROLLBACK", 0, 0, 0);
+	} else {
+		rc = sqlitediff_diff_prepared(
+			db,
+			nullptr,
+			stdout
+		);
+	}
 
 	if (rc != SQLITE_OK) {
 		cerr << "Could not create changeset." << endl;
@@ -56,6 +338,20 @@ int main(int argc, char const *argv[])
 		return 2;	
 	}
 
+	if (stats) {
+		DiffStats st;
+		sqlitediff_stats(&st);
+		cerr << "tables:           " << st.nTable << endl
+		     << "inserts:          " << st.nInsert << endl
+		     << "updates:          " << st.nUpdate << endl
+		     << "deletes:          " << st.nDelete << endl
+		     << "sqlite highwater: " << st.nSqliteHighwater << endl
+		     << "peak rss:         " << st.nPeakRss << endl;
+		if (options.bLive) {
+			cerr << "wal growth:       " << st.nWalGrowth << endl;
+		}
+	}
+
 	sqlite3_close(db);
 
 	return 0;
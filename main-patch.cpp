@@ -1,16 +1,86 @@
+#include "fanout.h"
 #include "patch.h"
 #include "sqlite3.h"
 
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
 
 using namespace std;
 
 void trace_callback( void* udp, const char* sql ) { printf("{SQL} [%s]\n", sql); }
 
-const char* usage = "Usage: sqlite-patch [db] [patchfile]";
+const char* usage = "Usage: sqlite-patch [options] [db] [patchfile]\n"
+	"       sqlite-patch --targets [db]... [patchfile]\n"
+	"  --targets              Decode patchfile once and apply it to every db in\n"
+	"                         parallel. Each db is rolled back on its own if\n"
+	"                         patching it fails.\n"
+	"  --commit-every N       Commit after every N instructions instead of once,\n"
+	"                         recording the progress in db. For all-or-nothing\n"
+	"                         semantics, patch a copy of db and swap it in.\n"
+	"  --commit-bytes N       Commit after every N bytes of patchfile\n"
+	"  --resume               Continue an interrupted chunked apply\n"
+	"  --pipeline             Decode patchfile on a second thread while applying\n"
+	"  --reindex-churn F      Drop the non-unique indexes of a table while applying\n"
+	"                         a block that changes at least F times as many rows\n"
+	"                         as the table has, and rebuild them after it.\n"
+	"                         Implies --pipeline.\n"
+	"  --session              Apply a changeset written by sqlite-diff --session\n"
+	"                         with SQLite's sqlite3changeset_apply_v2()";
 
 int main(int argc, char const *argv[])
 {
+	if (argc > 3 && string(argv[1]) == "--targets") {
+		const char* patchFile = argv[argc - 1];
+		vector<const char*> targets(argv + 2, argv + argc - 1);
+		vector<int> results(targets.size());
+
+		int rc = sqlitediff_apply_fanout(patchFile, targets.data(), targets.size(), results.data());
+		for (size_t i=0; i < targets.size(); i++) {
+			if (results[i] != SQLITE_OK) {
+				cerr << "Could not apply changeset " << patchFile << " to " << targets[i] << endl;
+			}
+		}
+		return rc == SQLITE_OK ? 0 : 2;
+	}
+
+	bool chunked = false;
+	bool resume = false;
+	bool session = false;
+	bool pipeline = false;
+	size_t commitInstr = 0;
+	size_t commitBytes = 0;
+	double minChurn = 0;
+
+	while (argc > 1 && string(argv[1]).compare(0, 2, "--") == 0) {
+		string opt = argv[1];
+		if (argc > 2 && opt == "--commit-every") {
+			commitInstr = strtoull(argv[2], nullptr, 10);
+			chunked = true;
+			argc--; argv++;
+		} else if (argc > 2 && opt == "--commit-bytes") {
+			commitBytes = strtoull(argv[2], nullptr, 10);
+			chunked = true;
+			argc--; argv++;
+		} else if (opt == "--session") {
+			session = true;
+		} else if (opt == "--pipeline") {
+			pipeline = true;
+		} else if (argc > 2 && opt == "--reindex-churn") {
+			minChurn = atof(argv[2]);
+			pipeline = true;
+			argc--; argv++;
+		} else if (opt == "--resume") {
+			resume = true;
+			chunked = true;
+		} else {
+			cerr << "Unknown option " << opt << endl << usage << endl;
+			return 1;
+		}
+		argc--; argv++;
+	}
+
 	if (argc != 3) {
         cerr << "Wrong number of arguments" << endl << usage << endl;
 		return 1;
@@ -29,7 +99,20 @@ int main(int argc, char const *argv[])
 		return 2;
 	}
 
-	rc = applyChangeset(db, patchFile);
+	if (session) {
+#ifdef SQLITE_ENABLE_SESSION
+		rc = applySessionChangeset(db, patchFile);
+#else
+		cerr << "This build of SQLite has no session extension." << endl;
+		rc = SQLITE_ERROR;
+#endif
+	} else if (chunked) {
+		rc = applyChangesetChunked(db, patchFile, commitInstr, commitBytes, resume);
+	} else if (pipeline) {
+		rc = applyChangesetPipelined(db, patchFile, minChurn);
+	} else {
+		rc = applyChangeset(db, patchFile);
+	}
 
 	if (rc != SQLITE_OK) {
 		cerr << "Could not apply changeset " << patchFile << endl;
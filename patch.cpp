@@ -1,37 +1,71 @@
+#include "crc32c.h"
+#include "delta.h"
 #include "diff.h"
 
 #include "sqliteint.h"
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
-#include <numeric>
+#include <stdexcept>
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <vector>
 
+#include <atomic>
 #include <chrono>
+#include <thread>
 
-#include "patch.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define CHANGESET_CORRUPT 1
-#define CHANGESET_INSTRUCTION_CORRUPT 3
-#define CHANGESET_CALLBACK_ERROR 4
+#include "patch.h"
+#include "reader.h"
 
 /**
 
 FORMAT of binary changeset (pseudo-grammar):
 
 ->:
+	<ChecksumSettings>[0..1]
+	<DictSettings>[0..1]
 	<TableInstructions>[1+]
 
+ChecksumSettings:			# The changeset is cut into checksummed chunks
+	'K'
+	byte	=> SQLITEDIFF_CHECKSUM_CRC32C
+
+Checksum:					# Follows any instruction, and ends the changeset
+	'C'
+	u64 (little-endian)	=> size of the chunk: all bytes since the last Checksum
+	u32 (little-endian)	=> CRC32C of the chunk
+
+DictSettings:				# Table blocks use a value dictionary
+	'D'
+	varint	=> maxSize		# TEXT/BLOB values of at most maxSize bytes ...
+	varint	=> maxEntries	# ... get the next entry number, up to maxEntries
+
 TableInstructions:
+	<TableHeader> | <ProjectedTableHeader>
+	<Instruction>[1+]
+
+TableHeader:
 	'T'
 	varint	=> nCols
 	byte[nCols] (PK flag)
 	<string>	name of table
-	<Instruction>[1+]
+
+ProjectedTableHeader:		# Only the listed columns are covered
+	'P'
+	varint	=> nCols
+	byte[nCols] (PK flag)
+	<string>	name of table
+	<string>[nCols]	quoted column names, NUL-terminated
 
 string:
 	varInt	length
@@ -51,75 +85,48 @@ InstrDelete:
 	<Value>[nCols]
 
 InstrUpdate:
-	SQLITE_DELETE
+	<InstrUpdateAll> | <InstrUpdateBitmap> | <InstrUpdateList>
+
+InstrUpdateAll:
+	SQLITE_UPDATE
 	0x0
-	<ZeroOrValue>[nCols]		# Old Values (zero if not changed)
-	<ZeroOrValue>[nCols]		# New Values (zero if not changed)
+	<ZeroOrValue>[nCols]		# Old Values (zero if not changed or delta)
+	<ZeroOrDeltaOrValue>[nCols]	# New Values (zero if not changed)
+
+InstrUpdateBitmap:			# Only the PK and changed columns are written
+	SQLITE_UPDATE
+	SQLITEDIFF_UPDATE_BITMAP
+	byte[(nCols+7)/8]	# bit i%8 of byte i/8 is set if column i changed
+	<ZeroOrValue>[nPK+nChanged]		# Old values of the PK and changed columns
+	<ZeroOrDeltaOrValue>[nChanged]	# New values of the changed columns
+
+InstrUpdateList:			# Like InstrUpdateBitmap, naming the changed columns
+	SQLITE_UPDATE
+	SQLITEDIFF_UPDATE_LIST
+	varint	=> nChanged
+	varint[nChanged]	# numbers of the changed columns, ascending
+	<ZeroOrValue>[nPK+nChanged]
+	<ZeroOrDeltaOrValue>[nChanged]
 
 ZeroOrValue:
-	0x0 | <Value>
+	0x0 | <Value> | <DictRef>
+
+ZeroOrDeltaOrValue:
+	0x0 | <Value> | <Delta> | <DictRef>
 
 Value:
 	byte iDType data type, (if NULL that's it)
 	…data
 
-*/
+DictRef:					# Repeats a value written before in this table block
+	SQLITEDIFF_DICTREF
+	varint	=> entry number
 
-size_t readValue(const char* buf, sqlite_value* val)
-{
-	u8 type = buf[0];
-	val->type = type;
-	buf++;
-	void* data = (void*)(buf);
+Delta:						# New value as a delta against the target's current one
+	byte SQLITEDIFF_DELTA|SQLITE_TEXT or SQLITEDIFF_DELTA|SQLITE_BLOB
+	<string>	delta, see delta.c
 
-	size_t read = 1;
-
-	switch(type)
-	{
-	case SQLITE_INTEGER: {
-		val->data1.iVal = sessionGetI64((u8*)data);
-		read += 8;
-		break;
-	}
-	case SQLITE_FLOAT: {
-		int64_t iVal = sessionGetI64((u8*)data);
-		val->data1.dVal = *(double*)(&iVal);
-		read += 8;
-		break;
-	}
-
-	case SQLITE_TEXT: {
-		u32 textLen;
-		u8 varIntLen = getVarint32((u8*)data, textLen);
-
-		val->data1.iVal = textLen;
-		val->data2 = (char*)data + varIntLen;
-
-		read += textLen + varIntLen;
-		break;
-	}
-	case SQLITE_BLOB: {
-		u32 blobLen;
-		u8 varIntLen = getVarint32((u8*)data, blobLen);
-
-		val->data1.iVal = blobLen;
-		val->data2 = (char*)data + varIntLen;
-
-		read += blobLen + varIntLen;
-		break;
-	}
-	case SQLITE_NULL:
-		break;
-	case 0:
-		val->type = 0;
-		break;
-	default:
-		val->type = -1;
-		return 0;
-	}
-
-	return read;
-}
+*/
 
 int bindValue(sqlite3_stmt* stmt, int col, const sqlite_value* val) {
 	switch(val->type) {
@@ -138,7 +145,7 @@ int bindValue(sqlite3_stmt* stmt, int col, const sqlite_value* val) {
 	}
 }
 
-int bindValues(sqlite3_stmt* stmt, sqlite_value* values, uint8_t nCol) {
+int bindValues(sqlite3_stmt* stmt, sqlite_value* values, int nCol) {
 	for (int i=0; i < nCol; i++) {
 		int rc = bindValue(stmt, i+1, &values[i]);
 		if (rc != SQLITE_OK) {
@@ -148,6 +155,111 @@ int bindValues(sqlite3_stmt* stmt, sqlite_value* values, uint8_t nCol) {
 	return SQLITE_OK;
 }
 
+/**
+ * BLOBs of at least kStreamThreshold bytes are bound as zeroblobs and then
+ * written in place with sqlite3_blob_write(), SQLITEDIFF_CHUNK bytes at a
+ * time, so SQLite never builds a record holding them in memory.
+ */
+const sqlite3_int64 kStreamThreshold = 1 << 20;
+
+bool isStreamed(const sqlite_value* val)
+{
+	return val->type == SQLITE_BLOB && val->data1.iVal >= kStreamThreshold;
+}
+
+bool hasStreamedValue(const sqlite_value* values, int nVal)
+{
+	for (int i=0; i < nVal; i++) {
+		if (isStreamed(&values[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool hasRowid(sqlite3* db, const char* tableName)
+{
+	sqlite3_stmt* stmt;
+	std::string sql = std::string() + "SELECT rowid FROM " + tableName;
+	int rc = sqlite3_prepare_v2(db, sql.data(), sql.size(), &stmt, nullptr);
+	sqlite3_finalize(stmt);
+	return rc == SQLITE_OK;
+}
+
+/* Strips the quotes that safeId() may have put around a column name */
+std::string dequote(const std::string& name)
+{
+	if (name.size() < 2 || name[0] != '"') {
+		return name;
+	}
+	std::string result;
+	for (size_t i=1; i < name.size() - 1; i++) {
+		result += name[i];
+		if (name[i] == '"') {
+			i++;
+		}
+	}
+	return result;
+}
+
+int bindStreamedValue(sqlite3_stmt* stmt, int col, const sqlite_value* val, bool stream)
+{
+	if (stream && isStreamed(val)) {
+		return sqlite3_bind_zeroblob64(stmt, col, val->data1.iVal);
+	}
+	return bindValue(stmt, col, val);
+}
+
+int writeBlob(sqlite3* db, const char* tableName, const std::string& column,
+		sqlite3_int64 rowid, const sqlite_value* val)
+{
+	sqlite3_blob* blob;
+	int rc = sqlite3_blob_open(db, "main", tableName, dequote(column).c_str(), rowid, 1, &blob);
+	if (rc != SQLITE_OK) {
+		std::cerr << "Failed opening BLOB " << tableName << "." << column << ": " << sqlite3_errmsg(db) << std::endl;
+		return rc;
+	}
+
+	for (sqlite3_int64 offset=0; rc == SQLITE_OK && offset < val->data1.iVal; offset += SQLITEDIFF_CHUNK) {
+		sqlite3_int64 n = std::min<sqlite3_int64>(SQLITEDIFF_CHUNK, val->data1.iVal - offset);
+		rc = sqlite3_blob_write(blob, val->data2 + offset, (int)n, (int)offset);
+	}
+
+	int closeRc = sqlite3_blob_close(blob);
+	return rc != SQLITE_OK ? rc : closeRc;
+}
+
+/**
+ * Prepares "SELECT <what> FROM <table> WHERE <pk> = ? ..." with the PK values
+ * of instr bound.
+ */
+int prepareSelectByPk(sqlite3* db, const Instruction* instr,
+		const std::vector<std::string>& columnNames, const std::string& what,
+		sqlite3_stmt** stmt)
+{
+	int nCol = instr->table->nCol;
+
+	std::string sql = "SELECT " + what + " FROM " + instr->table->tableName + " WHERE";
+	for (int n=0, j=0; j < nCol; j++) {
+		if (instr->table->PKs[j]) {
+			sql = sql + (n++ > 0 ? " AND " : " ") + columnNames.at(j) + " = ?";
+		}
+	}
+
+	int rc = sqlite3_prepare_v2(db, sql.data(), sql.size(), stmt, nullptr);
+	if (rc != SQLITE_OK) {
+		std::cerr << "Failed preparing sql " << sql << std::endl;
+		return rc;
+	}
+	for (int n=1, j=0; j < nCol; j++) {
+		if (instr->table->PKs[j] && (rc = bindValue(*stmt, n++, &instr->values[j])) != SQLITE_OK) {
+			sqlite3_finalize(*stmt);
+			return rc;
+		}
+	}
+	return SQLITE_OK;
+}
+
 int applyInsert(sqlite3* db, const Instruction* instr)
 {
 	int rc;
@@ -155,7 +267,14 @@ int applyInsert(sqlite3* db, const Instruction* instr)
 	int nCol = instr->table->nCol;
 	const char* tableName = instr->table->tableName;
 
-	std::string sql = std::string() + "INSERT INTO " + tableName + " VALUES (";
+	std::string sql = std::string() + "INSERT INTO " + tableName;
+	if (instr->table->columnNames) {
+		for (int i=0; i < nCol; i++) {
+			sql = sql + (i == 0 ? " (" : ", ") + instr->table->columnNames[i];
+		}
+		sql += ")";
+	}
+	sql += " VALUES (";
 
 
 	for (int i=0; i < nCol; i++) {
@@ -174,9 +293,14 @@ int applyInsert(sqlite3* db, const Instruction* instr)
 	}
 
 
-	rc = bindValues(stmt, instr->values, nCol);
-	if (rc != SQLITE_OK) {
-		return rc;
+	bool stream = hasStreamedValue(instr->values, nCol) && hasRowid(db, tableName);
+
+	for (int i=0; i < nCol; i++) {
+		rc = bindStreamedValue(stmt, i+1, &instr->values[i], stream);
+		if (rc != SQLITE_OK) {
+			sqlite3_finalize(stmt);
+			return rc;
+		}
 	}
 
 	rc = sqlite3_step(stmt);
@@ -187,6 +311,17 @@ int applyInsert(sqlite3* db, const Instruction* instr)
 		return rc;
 	}
 
+	if (stream) {
+		sqlite3_int64 rowid = sqlite3_last_insert_rowid(db);
+		auto columnNames = getColumnNames(db, instr->table);
+		for (int i=0; i < nCol; i++) {
+			if (isStreamed(&instr->values[i])
+					&& (rc = writeBlob(db, tableName, columnNames.at(i), rowid, &instr->values[i])) != SQLITE_OK) {
+				return rc;
+			}
+		}
+	}
+
 	return SQLITE_OK;
 }
 
@@ -212,27 +347,51 @@ std::vector<std::string> getColumnNames(sqlite3* db, const char* tableName)
 	return result;
 }
 
+std::vector<std::string> getColumnNames(sqlite3* db, const TableInfo* table)
+{
+	if (table->columnNames) {
+		return std::vector<std::string>(table->columnNames, table->columnNames + table->nCol);
+	}
+	return getColumnNames(db, table->tableName);
+}
+
+/**
+ * Returns "(<a>, <b>, ...) IS (?, ?, ...)", which matches the named columns
+ * to values bound in that order, NULL to NULL. As one row value it stays
+ * within SQLite's expression depth limit for any number of columns.
+ */
+std::string matchColumns(const std::vector<std::string>& names)
+{
+	std::string sql = "(";
+	for (size_t i=0; i < names.size(); i++) {
+		sql += (i > 0 ? ", " : "") + names[i];
+	}
+	sql += ") IS (";
+	for (size_t i=0; i < names.size(); i++) {
+		sql += i > 0 ? ", ?" : "?";
+	}
+	return sql + ")";
+}
+
 int applyDelete(sqlite3* db, const Instruction* instr)
 {
 	int rc;
 
-	auto columnNames = getColumnNames(db, instr->table->tableName);
+	auto columnNames = getColumnNames(db, instr->table);
 	std::string sql = std::string() + "DELETE FROM " + instr->table->tableName + " WHERE ";
 
-	uint8_t nCol = instr->table->nCol;
+	int nCol = instr->table->nCol;
 
 	std::vector<std::string> wheres;
 	std::vector<sqlite_value> whereValues;
 	for (int i=0; i < nCol; i++)
 	{
 		if (instr->values[i].type) {
-			wheres.push_back(columnNames.at(i) + " = ?");
+			wheres.push_back(columnNames.at(i));
 			whereValues.push_back(instr->values[i]);
 		}
 	}
-	sql += std::accumulate(wheres.cbegin()+1, wheres.cend(), wheres.at(0), [&columnNames](const std::string&a, const std::string& b) {
-		return a + " AND " + b;
-	});
+	sql += matchColumns(wheres);
 
 	sqlite3_stmt* stmt;
 	rc = sqlite3_prepare_v2(db, sql.data(), sql.size(), &stmt, nullptr);
@@ -258,14 +417,76 @@ int applyDelete(sqlite3* db, const Instruction* instr)
 	return SQLITE_OK;
 }
 
+/**
+ * Replaces the delta-encoded values in valsAfter by the values they produce
+ * from the current column values of the row being updated. The rebuilt
+ * values point into buffers.
+ */
+int resolveDeltas(sqlite3* db, const Instruction* instr,
+		const std::vector<std::string>& columnNames,
+		sqlite_value* valsAfter, std::vector<std::vector<char>>& buffers)
+{
+	int nCol = instr->table->nCol;
+
+	for (int i=0; i < nCol; i++) {
+		sqlite_value* val = &valsAfter[i];
+		if (! (val->type & SQLITEDIFF_DELTA)) {
+			continue;
+		}
+
+		sqlite3_stmt* stmt;
+		int rc = prepareSelectByPk(db, instr, columnNames, columnNames.at(i), &stmt);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+
+		rc = sqlite3_step(stmt);
+		if (rc != SQLITE_ROW) {
+			sqlite3_finalize(stmt);
+			return rc == SQLITE_DONE ? SQLITE_NOTFOUND : rc;
+		}
+
+		const unsigned char* delta = (const unsigned char*)val->data2;
+		sqlite3_int64 nOut = sqlitediff_delta_output_size(delta, val->data1.iVal);
+		if (nOut < 0) {
+			sqlite3_finalize(stmt);
+			return CHANGESET_CORRUPT;
+		}
+		const unsigned char* src = (const unsigned char*)sqlite3_column_blob(stmt, 0);
+		int nSrc = sqlite3_column_bytes(stmt, 0);
+
+		buffers[i].resize(nOut);
+		rc = sqlitediff_delta_apply(src, nSrc, delta, val->data1.iVal,
+			(unsigned char*)buffers[i].data());
+		sqlite3_finalize(stmt);
+		if (rc != SQLITE_OK) {
+			std::cerr << "applyUpdate: Delta does not match current value of " << columnNames.at(i) << std::endl;
+			return rc;
+		}
+
+		val->type &= ~SQLITEDIFF_DELTA;
+		val->data1.iVal = nOut;
+		val->data2 = buffers[i].data();
+	}
+
+	return SQLITE_OK;
+}
+
 int applyUpdate(sqlite3* db, const Instruction* instr)
 {
 	int nCol = instr->table->nCol;
 
 	sqlite_value* valsBefore = instr->values;
-	sqlite_value* valsAfter = instr->values + nCol;
+	std::vector<sqlite_value> after(instr->values + nCol, instr->values + nCol*2);
+	sqlite_value* valsAfter = after.data();
+
+	std::vector<std::string> columnNames = getColumnNames(db, instr->table);
 
-	std::vector<std::string> columnNames = getColumnNames(db, instr->table->tableName);
+	std::vector<std::vector<char>> buffers(nCol);
+	int deltaRc = resolveDeltas(db, instr, columnNames, valsAfter, buffers);
+	if (deltaRc != SQLITE_OK) {
+		return deltaRc;
+	}
 
 	std::string sql;
 	sql = sql + "UPDATE " + instr->table->tableName + " SET";
@@ -284,20 +505,31 @@ int applyUpdate(sqlite3* db, const Instruction* instr)
 	}
 
 	//wheres
-	sql += " WHERE ";
-	for (int n=0, i=0; i < nCol; i++) {
-		const auto& name = columnNames.at(i);
-		const auto val = valsBefore[i];
-		if (val.type) {
-			if (n > 0) {
-				sql += " AND";
-			}
-			sql = sql + " " + name + " = " + "?";
-			n++;
+	std::vector<std::string> wheres;
+	for (int i=0; i < nCol; i++) {
+		if (valsBefore[i].type) {
+			wheres.push_back(columnNames.at(i));
 		}
 	}
+	sql += " WHERE " + matchColumns(wheres);
 
 	sqlite3_stmt* stmt; int rc;
+
+	sqlite3_int64 rowid = 0;
+	bool stream = hasStreamedValue(valsAfter, nCol) && hasRowid(db, instr->table->tableName);
+	if (stream) {
+		rc = prepareSelectByPk(db, instr, columnNames, "rowid", &stmt);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+		rc = sqlite3_step(stmt);
+		rowid = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+		if (rc != SQLITE_ROW) {
+			return rc == SQLITE_DONE ? SQLITE_NOTFOUND : rc;
+		}
+	}
+
 	rc = sqlite3_prepare_v2(db, sql.data(), sql.size(), &stmt, nullptr);
 
 	if (rc != SQLITE_OK) {
@@ -309,7 +541,7 @@ int applyUpdate(sqlite3* db, const Instruction* instr)
 	for (int i=0; i < nCol; i++) {
 		sqlite_value* val = &valsAfter[i];
 		if (val->type) {
-			if (bindValue(stmt, n, val)) {
+			if (bindStreamedValue(stmt, n, val, stream)) {
 				return 1;
 			}
 			n++;
@@ -333,21 +565,34 @@ int applyUpdate(sqlite3* db, const Instruction* instr)
 	if (rc != SQLITE_DONE) {
 		return rc;
 	}
+
+	for (int i=0; stream && i < nCol; i++) {
+		if (isStreamed(&valsAfter[i])
+				&& (rc = writeBlob(db, instr->table->tableName, columnNames.at(i), rowid, &valsAfter[i])) != SQLITE_OK) {
+			return rc;
+		}
+	}
 	return SQLITE_OK;
 }
 
 
 int applyInstruction(const Instruction* instr, sqlite3* db)
 {
-	switch(instr->iType) {
-	case SQLITE_INSERT:
-		return applyInsert(db, instr);
-	case SQLITE_UPDATE:
-		return applyUpdate(db, instr);
-	case SQLITE_DELETE:
-		return applyDelete(db, instr);
-	default:
-		return CHANGESET_CORRUPT;
+	try {
+		switch(instr->iType) {
+		case SQLITE_INSERT:
+			return applyInsert(db, instr);
+		case SQLITE_UPDATE:
+			return applyUpdate(db, instr);
+		case SQLITE_DELETE:
+			return applyDelete(db, instr);
+		default:
+			return CHANGESET_CORRUPT;
+		}
+	} catch (const std::out_of_range&) {
+		// The target lacks the table or some of its columns
+		std::cerr << "applyInstruction: No matching table " << instr->table->tableName << std::endl;
+		return SQLITE_ERROR;
 	}
 }
 
@@ -358,33 +603,7 @@ int applyInstructionCallback(const Instruction* instr, void* context)
 }
 
 
-size_t readInstructionFromBuffer(const char* buf, Instruction* instr)
-{
-	size_t nRead = 0;
-
-	instr->iType = *buf;
-	buf += 2; nRead += 2;
-
-	int nCol = instr->table->nCol;
-	if (instr->iType == SQLITE_UPDATE) {
-		nCol *= 2;
-	}
-
-	for (int i=0; i < nCol; i++) {
-		sqlite_value* val_p = instr->values + i;
-		size_t read = readValue(buf, val_p);
-		if (read == 0) {
-			return 0;
-		}
-		buf += read;
-		nRead += read;
-	}
-
-	return nRead;
-}
-
-
-int applyChangeset(sqlite3* db, const char* buf, size_t size)
+int applyBegin(sqlite3* db)
 {
 	int rc;
 
@@ -393,12 +612,17 @@ int applyChangeset(sqlite3* db, const char* buf, size_t size)
 		rc = sqlite3_exec(db, "PRAGMA defer_foreign_keys = 1", 0, 0, 0);
 	}
 
-	rc = readChangeset(buf, size, applyInstructionCallback, db);
+	return rc;
+}
 
+
+int applyEnd(sqlite3* db, int rc)
+{
 	if (rc) {
 		std::cerr << "Error occured." << std::endl;
-		rc = sqlite3_exec(db, "PRAGMA defer_foreign_keys = 0", 0, 0, 0);
-		rc = sqlite3_exec(db, "ROLLBACK TO SAVEPOINT changeset_apply", 0, 0, 0);
+		sqlite3_exec(db, "PRAGMA defer_foreign_keys = 0", 0, 0, 0);
+		sqlite3_exec(db, "ROLLBACK TO SAVEPOINT changeset_apply", 0, 0, 0);
+		sqlite3_exec(db, "RELEASE changeset_apply", 0, 0, 0);
 	} else {
 		rc = sqlite3_exec(db, "PRAGMA defer_foreign_keys = 0", 0, 0, 0);
 		rc = sqlite3_exec(db, "RELEASE changeset_apply", 0, 0, 0);
@@ -408,117 +632,291 @@ int applyChangeset(sqlite3* db, const char* buf, size_t size)
 }
 
 
-int applyChangeset(sqlite3* db, const char* filename)
+int applyChangeset(sqlite3* db, const char* buf, size_t size)
 {
-	std::ifstream file(filename, std::ios::binary | std::ios::ate);
-	const auto size = file.tellg();
+	int rc;
 
-	if (!size) {
-		return 1;
-	}
+	applyBegin(db);
 
-	file.seekg(0);
-	std::vector<char> buffer(size);
-	if (! file.read(buffer.data(), size)) {
+	rc = readChangeset(buf, size, applyInstructionCallback, db);
+
+	return applyEnd(db, rc);
+}
+
+
+int applyChangeset(sqlite3* db, const char* filename)
+{
+	MappedFile file(filename);
+	if (! file.ok()) {
 		return 1;
 	}
 
-	return applyChangeset(db, buffer.data(), size);
+	return applyChangeset(db, file.data(), file.size());
 }
 
 
-int readChangeset(const char* buf, size_t size, InstrCallback instr_callback, void* context)
+struct ChunkedApply
+{
+	sqlite3* db;
+	size_t nCommitInstr;
+	size_t nCommitBytes;
+	size_t nInstr;
+	size_t committedAt;
+	ChangesetCursor cursor;
+};
+
+/* Record the cursor, commit and start the next chunk's transaction */
+int commitChunk(ChunkedApply* state)
 {
-	const char* const bufStart = buf;
-	const char* const bufEnd = buf + size;
+	sqlite3_stmt* stmt;
+	int rc = sqlite3_prepare_v2(state->db, "UPDATE sqlitediff_progress SET block = ?, offset = ?", -1, &stmt, nullptr);
+	if (rc == SQLITE_OK) {
+		sqlite3_bind_int64(stmt, 1, state->cursor.block);
+		sqlite3_bind_int64(stmt, 2, state->cursor.next);
+		rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(state->db);
+		sqlite3_finalize(stmt);
+	}
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_exec(state->db, "COMMIT; BEGIN; PRAGMA defer_foreign_keys = 1", 0, 0, 0);
+	}
+	state->nInstr = 0;
+	state->committedAt = state->cursor.next;
+	return rc;
+}
 
-	double lastPos = .0;
-	auto t1 = std::chrono::high_resolution_clock::now();
+int chunkedApplyCallback(const Instruction* instr, void* context)
+{
+	ChunkedApply* state = (ChunkedApply*)context;
 
-	while(buf < bufEnd) {
-		char op = buf[0];
-		buf++;
+	int rc = applyInstruction(instr, state->db);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
 
-		// Read OP
-		if (op != 'T') {
-			return CHANGESET_CORRUPT;
-		}
+	state->nInstr++;
+	if ((state->nCommitInstr && state->nInstr >= state->nCommitInstr)
+			|| (state->nCommitBytes && state->cursor.next - state->committedAt >= state->nCommitBytes)) {
+		rc = commitChunk(state);
+	}
+	return rc;
+}
 
-		// Read number of columns
-		u32 nCol;
-		u8 varintLen = getVarint32((u8*)buf, nCol);
-		buf += varintLen;
+int applyChangesetChunked(sqlite3* db, const char* filename, size_t nCommitInstr, size_t nCommitBytes, bool resume)
+{
+	MappedFile file(filename);
+	if (! file.ok()) {
+		return 1;
+	}
 
-		// Read Primary Key flags
-		std::vector<int> PKs(nCol);
-		for (u32 i=0; i < nCol; i++) {
-			PKs[i] = (bool) buf[i];
+	/* Identifies the changeset the progress belongs to. Diffs of one database
+	 * share their leading tables, so all of it is checksummed. */
+	sqlite3_int64 size = file.size();
+	sqlite3_int64 crc = sqlitediff_crc32c(0, file.data(), file.size());
+
+	ChunkedApply state;
+	state.db = db;
+	state.nCommitInstr = nCommitInstr;
+	state.nCommitBytes = nCommitBytes;
+	state.nInstr = 0;
+	state.cursor.block = 0;
+	state.cursor.next = 0;
+
+	int rc = sqlite3_exec(db,
+		"BEGIN;"
+		"PRAGMA defer_foreign_keys = 1;"
+		"CREATE TABLE IF NOT EXISTS sqlitediff_progress (size INTEGER, crc INTEGER, block INTEGER, offset INTEGER);",
+		0, 0, 0);
+
+	sqlite3_stmt* stmt = nullptr;
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_prepare_v2(db, "SELECT size, crc, block, offset FROM sqlitediff_progress", -1, &stmt, nullptr);
+	}
+	if (rc == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			if (! resume) {
+				std::cerr << "An earlier apply to this database is unfinished, resume it first." << std::endl;
+				rc = SQLITE_ERROR;
+			} else if (sqlite3_column_int64(stmt, 0) != size || sqlite3_column_int64(stmt, 1) != crc) {
+				std::cerr << "The unfinished apply to this database is of a different changeset." << std::endl;
+				rc = SQLITE_MISMATCH;
+			} else {
+				state.cursor.block = sqlite3_column_int64(stmt, 2);
+				state.cursor.next = sqlite3_column_int64(stmt, 3);
+			}
+			sqlite3_finalize(stmt);
+		} else {
+			sqlite3_finalize(stmt);
+			char* sql = sqlite3_mprintf("INSERT INTO sqlitediff_progress VALUES (%lld, %lld, 0, 0)", size, crc);
+			rc = sqlite3_exec(db, sql, 0, 0, 0);
+			sqlite3_free(sql);
 		}
-		buf += nCol;
+	}
+	state.committedAt = state.cursor.next;
 
-		// Read table name
-		const char* tableName = buf;
-		size_t tableNameLen = std::strlen(tableName);
-		buf += tableNameLen + 1;
+	if (rc == SQLITE_OK) {
+		rc = readChangeset(file.data(), file.size(), chunkedApplyCallback, &state, &state.cursor);
+	}
 
-		size_t instrRead = 0;
+	if (rc == SQLITE_OK) {
+		rc = sqlite3_exec(db, "DROP TABLE sqlitediff_progress; COMMIT;", 0, 0, 0);
+	}
+	if (rc != SQLITE_OK) {
+		std::cerr << "Error occured." << std::endl;
+		sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+	}
 
-		TableInfo table;
-		table.PKs = PKs.data();
-		table.nCol = nCol;
-		table.tableName = tableName;
+	return rc;
+}
 
-		Instruction instr;
-		instr.table = &table;
-		instr.values = new sqlite_value[nCol*2];
 
+#ifdef SQLITE_ENABLE_SESSION
+int sessionConflict(void* context, int eConflict, sqlite3_changeset_iter* iter)
+{
+	switch (eConflict) {
+	case SQLITE_CHANGESET_DATA:
+		return SQLITE_CHANGESET_REPLACE;
+	case SQLITE_CHANGESET_NOTFOUND:
+		return SQLITE_CHANGESET_OMIT;
+	default:
+		return SQLITE_CHANGESET_ABORT;
+	}
+}
 
-		while (buf < bufEnd && buf[0] != 'T') {
-			instrRead = readInstructionFromBuffer(buf, &instr);
-			if (instrRead == 0) {
-				std::cerr << "Error reading instruction from buffer." << std::endl;
-				delete[] instr.values;
-				return CHANGESET_INSTRUCTION_CORRUPT;
-			}
+int applySessionChangeset(sqlite3* db, const char* filename)
+{
+	MappedFile file(filename);
+	if (! file.ok()) {
+		return 1;
+	}
+	if (file.size() > INT_MAX) {
+		return SQLITE_TOOBIG;
+	}
 
-			int rc;
-			if (instr_callback && (rc = instr_callback(&instr, context))) {
-				std::cerr << "Error applying instruction. Callback returned " << rc << std::endl;
-				delete[] instr.values;
-				return CHANGESET_CALLBACK_ERROR;
-			}
+	int rc = sqlite3changeset_apply_v2(db, (int)file.size(), (void*)file.data(),
+			nullptr, sessionConflict, nullptr, nullptr, nullptr, 0);
+	if (rc != SQLITE_OK) {
+		std::cerr << "sqlite3changeset_apply_v2: " << sqlite3_errstr(rc) << std::endl;
+	}
+	return rc;
+}
+#endif
 
-			buf += instrRead;
 
-			double pos = (double)(buf - bufStart) / (bufEnd - bufStart) * 100;
-			if ((pos - lastPos) > 0.1) {
-				auto t2 = std::chrono::high_resolution_clock::now();
-				auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-				std::cerr << pos << "%, " << (time_span.count() / pos) * 100 << std::endl;
-				lastPos = pos;
+int verifyChecksums(const char* buf, size_t size)
+{
+	struct Chunk
+	{
+		size_t offset;
+		size_t size;
+		uint32_t crc;
+	};
+
+	/* Walk the Checksum records from the end, so the chunks are known
+	 * without parsing any instruction */
+	std::vector<Chunk> chunks;
+	size_t end = size;
+	while (end > 0) {
+		if (end < kChecksumRecord || buf[end - kChecksumRecord] != 'C') {
+			return CHANGESET_CHECKSUM_MISMATCH;
+		}
+		const u8* rec = (const u8*)buf + end - kChecksumRecord + 1;
+		u64 n = 0;
+		uint32_t crc = 0;
+		for (int i=0; i < 8; i++) {
+			n |= (u64)rec[i] << (i*8);
+		}
+		for (int i=0; i < 4; i++) {
+			crc |= (uint32_t)rec[8 + i] << (i*8);
+		}
+		if (n > end - kChecksumRecord) {
+			return CHANGESET_CHECKSUM_MISMATCH;
+		}
+		end -= kChecksumRecord + n;
+		chunks.push_back(Chunk{end, (size_t)n, crc});
+	}
+
+	size_t nThread = std::min<size_t>(chunks.size(), std::max(1u, std::thread::hardware_concurrency()));
+	std::atomic<bool> bad(false);
+	auto verify = [&](size_t first) {
+		for (size_t i=first; i < chunks.size() && ! bad.load(std::memory_order_relaxed); i += nThread) {
+			if (sqlitediff_crc32c(0, buf + chunks[i].offset, chunks[i].size) != chunks[i].crc) {
+				bad.store(true);
 			}
 		}
+	};
 
-		delete[] instr.values;
+	std::vector<std::thread> threads;
+	for (size_t t=1; t < nThread; t++) {
+		threads.emplace_back(verify, t);
+	}
+	verify(0);
+	for (auto& thread : threads) {
+		thread.join();
 	}
 
-	return 0;
+	return bad.load() ? CHANGESET_CHECKSUM_MISMATCH : 0;
 }
 
-int readChangeset(const char* filename, InstrCallback instr_callback, void* context)
+
+int readChangeset(const char* buf, size_t size, InstrCallback instr_callback, void* context, ChangesetCursor* cursor)
+{
+	auto callback = [instr_callback, context](const Instruction* instr) {
+		return instr_callback ? instr_callback(instr, context) : 0;
+	};
+	return readChangesetWith(buf, size, callback, cursor);
+}
+
+int readChangesetBatch(const char* buf, size_t size, BatchCallback batch_callback, int nBatch, void* context)
 {
-	std::ifstream file(filename, std::ios::binary | std::ios::ate);
-	const auto size = file.tellg();
+	if (nBatch < 1) {
+		return SQLITE_MISUSE;
+	}
+
+	std::vector<Instruction> instrs(nBatch);
+	std::vector<sqlite_value> values;
+	int n = 0;
+
+	auto flush = [&]() {
+		int rc = n > 0 ? batch_callback(instrs.data(), n, context) : 0;
+		n = 0;
+		return rc;
+	};
+	auto callback = [&](const Instruction* instr) {
+		size_t nVal = instr->table->nCol * 2;
+		if (values.size() < nBatch * nVal) {
+			values.resize(nBatch * nVal);
+			for (int i=0; i < n; i++) {
+				instrs[i].values = &values[i * nVal];
+			}
+		}
+		Instruction& out = instrs[n];
+		out.table = instr->table;
+		out.iType = instr->iType;
+		out.values = &values[n * nVal];
+		out.valFlag = nullptr;
+		size_t nCopy = instr->iType == SQLITE_UPDATE ? nVal : nVal / 2;
+		std::copy(instr->values, instr->values + nCopy, out.values);
+		return ++n == nBatch ? flush() : 0;
+	};
+	return readChangesetWith(buf, size, callback, nullptr, flush);
+}
 
-	if (!size) {
+int readChangesetBatch(const char* filename, BatchCallback batch_callback, int nBatch, void* context)
+{
+	MappedFile file(filename);
+	if (! file.ok()) {
 		return 1;
 	}
 
-	file.seekg(0);
-	std::vector<char> buffer(size);
-	if (! file.read(buffer.data(), size)) {
+	return readChangesetBatch(file.data(), file.size(), batch_callback, nBatch, context);
+}
+
+int readChangeset(const char* filename, InstrCallback instr_callback, void* context)
+{
+	MappedFile file(filename);
+	if (! file.ok()) {
 		return 1;
 	}
 
-	return readChangeset(buffer.data(), size, instr_callback, context);
+	return readChangeset(file.data(), file.size(), instr_callback, context);
 }
@@ -7,16 +7,86 @@
 #include <string>
 
 std::vector<std::string> getColumnNames(sqlite3* db, const char* tableName);
+/* Names recorded in table, falling back to the schema of db */
+std::vector<std::string> getColumnNames(sqlite3* db, const TableInfo* table);
 
 int applyInstruction(const Instruction* instr, sqlite3* db);
 
+/* Verify the checksums of a changeset that starts with a 'K' record, in
+ * parallel across chunks. Returns 0 if all of them match. */
+int verifyChecksums(const char* buf, size_t size);
+
+/* Position in a changeset, as byte offsets */
+struct ChangesetCursor
+{
+	size_t block; //< Table header of the current block
+	size_t next;  //< Just past the current instruction
+};
+
+/* Checksummed changesets are verified completely before the first callback.
+ * If cursor is given it is updated before every callback, and reading
+ * resumes after the position it holds on entry if that is not zero. */
 int readChangeset(
 		const char* buf,
 		size_t size,
 		InstrCallback instr_callback,
-		void* context);
+		void* context,
+		ChangesetCursor* cursor = nullptr);
 int readChangeset(
 		const char* filename,
 		InstrCallback instr_callback,
 		void* context);
+/* Like readChangeset(), delivering up to nBatch consecutive instructions of
+ * one table per call. The values of a batch are copied into one reused
+ * array; TEXT and BLOB data still points into buf. */
+int readChangesetBatch(
+		const char* buf,
+		size_t size,
+		BatchCallback batch_callback,
+		int nBatch,
+		void* context);
+int readChangesetBatch(
+		const char* filename,
+		BatchCallback batch_callback,
+		int nBatch,
+		void* context);
+/* Open/close the savepoint every changeset is applied in. applyEnd() rolls
+ * back and returns rc if that is non-zero, and releases the savepoint
+ * otherwise. */
+int applyBegin(sqlite3* db);
+int applyEnd(sqlite3* db, int rc);
+
 int applyChangeset(sqlite3* db, const char* filename);
+
+/* Like applyChangeset(), but decode on a second thread that parses ahead
+ * into a bounded queue of instruction batches, so this thread only binds
+ * and steps. Instructions are applied in changeset order; an apply error
+ * stops the decoder.
+ *
+ * If minChurn is above 0, the instructions of every table block are counted
+ * first. A block of at least 1000 instructions and at least minChurn times
+ * as many as its table has rows is applied with the table's non-unique
+ * secondary indexes dropped; they are recreated from their saved SQL after
+ * the block, in the same savepoint, so each is built once by a sort instead
+ * of updated row by row. */
+int applyChangesetPipelined(sqlite3* db, const char* buf, size_t size, double minChurn = 0);
+int applyChangesetPipelined(sqlite3* db, const char* filename, double minChurn = 0);
+
+#ifdef SQLITE_ENABLE_SESSION
+/* Apply a changeset written with DiffOptions.bSessionFormat through
+ * sqlite3changeset_apply_v2(). Conflicts are resolved like applyChangeset()
+ * does: rows to delete or update that are missing are skipped, and updates
+ * overwrite whatever the row holds. */
+int applySessionChangeset(sqlite3* db, const char* filename);
+#endif
+
+/* Apply filename in transactions of at most nCommitInstr instructions or
+ * nCommitBytes bytes of the changeset (0 for no limit), recording how far it
+ * got in a sqlitediff_progress table of the target. An interrupted apply is
+ * refused unless resume is set, which continues after the last commit. */
+int applyChangesetChunked(
+		sqlite3* db,
+		const char* filename,
+		size_t nCommitInstr,
+		size_t nCommitBytes,
+		bool resume);
@@ -0,0 +1,265 @@
+#include "batch.h"
+#include "diff.h"
+#include "patch.h"
+#include "queue.h"
+#include "reader.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/* Instructions per batch and number of decoded batches queued ahead */
+const size_t kBatchSize = 256;
+const size_t kQueueDepth = 16;
+
+typedef std::unique_ptr<InstructionBatch> BatchPtr;
+
+/**
+ * Two queues between the decoder thread and the applying thread: decoded
+ * batches travel one way and emptied ones come back the other, so the
+ * pipeline allocates only while a batch grows to its working size.
+ */
+struct Pipeline
+{
+	Pipeline()
+		: ready(kQueueDepth), free(kQueueDepth + 2), applyRc(SQLITE_OK), readRc(SQLITE_OK),
+		  tableName(nullptr)
+	{
+	}
+
+	BoundedQueue<BatchPtr> ready;
+	BoundedQueue<BatchPtr> free;
+	std::atomic<int> applyRc; //< Stops the decoder
+	std::atomic<int> readRc;  //< Set before ready is closed
+
+	/* Decoder state. Table names point into the changeset, so they
+	 * identify a table block. */
+	const char* tableName;
+	std::shared_ptr<const OwnedTable> table;
+	BatchPtr current;
+};
+
+int pushBatch(Pipeline* p)
+{
+	if (! p->current || p->current->size() == 0) {
+		return SQLITE_OK;
+	}
+	p->current->seal();
+	if (! p->ready.push(std::move(p->current))) {
+		return SQLITE_ABORT;
+	}
+	p->current.reset();
+	return SQLITE_OK;
+}
+
+int decodeCallback(const Instruction* instr, void* context)
+{
+	Pipeline* p = (Pipeline*)context;
+	int rc;
+
+	if (p->applyRc.load(std::memory_order_relaxed) != SQLITE_OK) {
+		return SQLITE_ABORT;
+	}
+
+	if (instr->table->tableName != p->tableName) {
+		if ((rc = pushBatch(p)) != SQLITE_OK) {
+			return rc;
+		}
+		p->tableName = instr->table->tableName;
+		p->table = std::make_shared<OwnedTable>(instr->table);
+	}
+
+	if (! p->current) {
+		if (! p->free.pop(p->current)) {
+			return SQLITE_ABORT;
+		}
+		p->current->reset(p->table);
+	}
+
+	if ((rc = p->current->add(instr)) != SQLITE_OK) {
+		return rc;
+	}
+
+	return p->current->size() >= kBatchSize ? pushBatch(p) : SQLITE_OK;
+}
+
+void decodeLoop(Pipeline* p, const char* buf, size_t size)
+{
+	int rc = readChangeset(buf, size, decodeCallback, p);
+	if (rc == SQLITE_OK) {
+		rc = pushBatch(p);
+	}
+	p->current.reset();
+	p->readRc.store(rc);
+	p->ready.close();
+}
+
+/* Blocks of fewer instructions keep their indexes whatever their churn */
+const size_t kMinReindexBlock = 1000;
+
+int countCallback(const Instruction* instr, void* context)
+{
+	auto* counts = (std::vector<std::pair<const char*, size_t>>*)context;
+	if (counts->empty() || counts->back().first != instr->table->tableName) {
+		counts->emplace_back(instr->table->tableName, 0);
+	}
+	counts->back().second++;
+	return SQLITE_OK;
+}
+
+/**
+ * Drops the non-unique secondary indexes of a table for the duration of a
+ * table block that changes at least minChurn times as many rows as the
+ * table has, and recreates them from their saved SQL once the block is
+ * applied. Everything happens inside the apply's savepoint, so a failed
+ * apply rolls the indexes back with the rows.
+ */
+class IndexRebuild
+{
+public:
+	IndexRebuild(sqlite3* db, double minChurn) : m_db(db), m_minChurn(minChurn), m_block(0) {}
+
+	/* Counts the instructions of every block of the changeset. */
+	int count(const char* buf, size_t size)
+	{
+		return readChangeset(buf, size, countCallback, &m_counts);
+	}
+
+	/* Called with the first batch of every block, and with nullptr after
+	 * the last one. */
+	int nextBlock(const OwnedTable* table)
+	{
+		int rc = rebuild();
+		if (rc != SQLITE_OK || ! table || m_block >= m_counts.size()) {
+			return rc;
+		}
+
+		size_t nInstr = m_counts[m_block++].second;
+		if (nInstr < kMinReindexBlock) {
+			return SQLITE_OK;
+		}
+
+		/* Counting stops where the table is too large for the churn */
+		sqlite3_int64 limit = (sqlite3_int64)(nInstr / m_minChurn) + 1;
+		sqlite3_stmt* stmt;
+		char* sql = sqlite3_mprintf("SELECT count(*) FROM (SELECT 1 FROM main.\"%w\" LIMIT %lld)",
+				table->name.c_str(), limit);
+		rc = sqlite3_prepare_v2(m_db, sql, -1, &stmt, nullptr);
+		sqlite3_free(sql);
+		if (rc != SQLITE_OK) {
+			/* A missing table is the apply's error to report */
+			return SQLITE_OK;
+		}
+		bool churned = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 0) < limit;
+		sqlite3_finalize(stmt);
+		if (! churned) {
+			return SQLITE_OK;
+		}
+
+		/* Indexes of UNIQUE and PRIMARY KEY constraints have no SQL */
+		rc = sqlite3_prepare_v2(m_db,
+				"SELECT S.name, S.sql FROM main.sqlite_master S, pragma_index_list(?1, 'main') L"
+				" WHERE S.type = 'index' AND S.tbl_name = ?1 AND S.sql IS NOT NULL"
+				"   AND L.name = S.name AND NOT L.\"unique\"",
+				-1, &stmt, nullptr);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+		sqlite3_bind_text(stmt, 1, table->name.c_str(), -1, SQLITE_TRANSIENT);
+		std::vector<std::string> names;
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			names.push_back((const char*)sqlite3_column_text(stmt, 0));
+			m_dropped.push_back((const char*)sqlite3_column_text(stmt, 1));
+		}
+		rc = sqlite3_finalize(stmt);
+
+		for (size_t i=0; rc == SQLITE_OK && i < names.size(); i++) {
+			sql = sqlite3_mprintf("DROP INDEX main.\"%w\"", names[i].c_str());
+			rc = sqlite3_exec(m_db, sql, 0, 0, 0);
+			sqlite3_free(sql);
+		}
+		return rc;
+	}
+
+private:
+	int rebuild()
+	{
+		int rc = SQLITE_OK;
+		for (size_t i=0; rc == SQLITE_OK && i < m_dropped.size(); i++) {
+			rc = sqlite3_exec(m_db, m_dropped[i].c_str(), 0, 0, 0);
+		}
+		m_dropped.clear();
+		return rc;
+	}
+
+	sqlite3* m_db;
+	double m_minChurn;
+	std::vector<std::pair<const char*, size_t>> m_counts;
+	size_t m_block;
+	std::vector<std::string> m_dropped; //< CREATE INDEX statements
+};
+
+} // namespace
+
+int applyChangesetPipelined(sqlite3* db, const char* buf, size_t size, double minChurn)
+{
+	Pipeline p;
+	for (size_t i=0; i < kQueueDepth + 2; i++) {
+		p.free.push(BatchPtr(new InstructionBatch));
+	}
+
+	IndexRebuild reindex(db, minChurn);
+	std::shared_ptr<const OwnedTable> block;
+	int rc = minChurn > 0 ? reindex.count(buf, size) : SQLITE_OK;
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+
+	rc = applyBegin(db);
+	std::thread decoder(decodeLoop, &p, buf, size);
+
+	BatchPtr batch;
+	while (p.ready.pop(batch)) {
+		/* Holding on to the table keeps a new block from reusing its address */
+		if (rc == SQLITE_OK && minChurn > 0 && batch->ownedTable() != block) {
+			block = batch->ownedTable();
+			rc = reindex.nextBlock(block.get());
+		}
+		for (size_t i=0; rc == SQLITE_OK && i < batch->size(); i++) {
+			Instruction instr;
+			batch->get(i, &instr);
+			rc = applyInstruction(&instr, db);
+		}
+		if (rc != SQLITE_OK) {
+			/* Stop the decoder, wherever it waits */
+			p.applyRc.store(rc);
+			p.free.close();
+			p.ready.close();
+		}
+		p.free.push(std::move(batch));
+	}
+	decoder.join();
+
+	/* A changeset that could not be read completely is not applied at all */
+	if (rc == SQLITE_OK) {
+		rc = p.readRc.load();
+	}
+	if (rc == SQLITE_OK && minChurn > 0) {
+		rc = reindex.nextBlock(nullptr);
+	}
+	return applyEnd(db, rc);
+}
+
+int applyChangesetPipelined(sqlite3* db, const char* filename, double minChurn)
+{
+	MappedFile file(filename);
+	if (! file.ok()) {
+		return 1;
+	}
+
+	return applyChangesetPipelined(db, file.data(), file.size(), minChurn);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Bounded single-producer/single-consumer queue.
+ *
+ * A lock-free ring buffer: the producer only ever writes m_tail and the
+ * consumer only ever writes m_head. Blocking push()/pop() spin with
+ * std::this_thread::yield() until there is room or data, or until the queue
+ * has been closed.
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity)
+		: m_slots(capacity + 1), m_head(0), m_tail(0), m_closed(false)
+	{
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	bool tryPush(T& item)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t next = (tail + 1) % m_slots.size();
+		if (next == m_head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		m_slots[tail] = std::move(item);
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	/* Returns false if the queue was closed while waiting for room. */
+	bool push(T item)
+	{
+		while (! tryPush(item)) {
+			if (m_closed.load(std::memory_order_acquire)) {
+				return false;
+			}
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+	bool tryPop(T& item)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = std::move(m_slots[head]);
+		m_head.store((head + 1) % m_slots.size(), std::memory_order_release);
+		return true;
+	}
+
+	/* Returns false once the queue is closed and drained. */
+	bool pop(T& item)
+	{
+		while (! tryPop(item)) {
+			if (m_closed.load(std::memory_order_acquire)) {
+				return tryPop(item);
+			}
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+	void close()
+	{
+		m_closed.store(true, std::memory_order_release);
+	}
+
+private:
+	std::vector<T> m_slots;
+	std::atomic<size_t> m_head;
+	std::atomic<size_t> m_tail;
+	std::atomic<bool> m_closed;
+};
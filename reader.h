@@ -0,0 +1,547 @@
+#pragma once
+
+#include "diff.h"
+#include "patch.h"
+#include "sqliteint.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The changeset decoder, shared by readChangeset() and the C++ visitor API
+ * in visitor.h. It lives in a header so that the per-instruction callback
+ * of readChangesetWith() can be inlined into its decode loop. The format
+ * is documented in patch.cpp. */
+
+#define CHANGESET_CORRUPT 1
+#define CHANGESET_INSTRUCTION_CORRUPT 3
+#define CHANGESET_CALLBACK_ERROR 4
+#define CHANGESET_CHECKSUM_MISMATCH 5
+
+/* Size of a Checksum record */
+const size_t kChecksumRecord = 13;
+
+inline size_t readValue(const char* buf, sqlite_value* val)
+{
+	u8 type = buf[0];
+	val->type = type;
+	buf++;
+	void* data = (void*)(buf);
+
+	size_t read = 1;
+
+	switch(type)
+	{
+	case SQLITE_INTEGER: {
+		val->data1.iVal = sessionGetI64((u8*)data);
+		read += 8;
+		break;
+	}
+	case SQLITE_FLOAT: {
+		int64_t iVal = sessionGetI64((u8*)data);
+		std::memcpy(&val->data1.dVal, &iVal, sizeof(iVal));
+		read += 8;
+		break;
+	}
+
+	case SQLITE_TEXT: {
+		u32 textLen;
+		u8 varIntLen = getVarint32((u8*)data, textLen);
+
+		val->data1.iVal = textLen;
+		val->data2 = (char*)data + varIntLen;
+
+		read += textLen + varIntLen;
+		break;
+	}
+	case SQLITE_BLOB:
+	case SQLITEDIFF_DELTA|SQLITE_TEXT:
+	case SQLITEDIFF_DELTA|SQLITE_BLOB: {
+		u32 blobLen;
+		u8 varIntLen = getVarint32((u8*)data, blobLen);
+
+		val->data1.iVal = blobLen;
+		val->data2 = (char*)data + varIntLen;
+
+		read += blobLen + varIntLen;
+		break;
+	}
+	case SQLITEDIFF_DICTREF: {
+		u32 entry;
+		u8 varIntLen = getVarint32((u8*)data, entry);
+
+		val->data1.iVal = entry;
+		read += varIntLen;
+		break;
+	}
+	case SQLITE_NULL:
+		break;
+	case 0:
+		val->type = 0;
+		break;
+	default:
+		val->type = -1;
+		return 0;
+	}
+
+	return read;
+}
+
+
+/* Return true if the varint at p ends before end */
+inline bool varintFits(const char* p, const char* end)
+{
+	for (int i=0; i < 9 && p + i < end; i++) {
+		if (! ((u8)p[i] & 0x80) || i == 8) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Mirror of the value dictionary the writer keeps per table block (see
+ * putValue() in diff.c). Entries point into the changeset buffer, so
+ * resolving a reference does not copy.
+ */
+struct ValueDict
+{
+	ValueDict() : maxSize(0), maxEntries(0) {}
+
+	u32 maxSize;
+	u32 maxEntries;
+	std::vector<sqlite_value> entries;
+};
+
+/* Big-endian 64-bit integer, as sessionGetI64() reads it, but inlined */
+inline u64 readU64(const char* buf)
+{
+	const u8* p = (const u8*)buf;
+	return ((u64)p[0] << 56) | ((u64)p[1] << 48) | ((u64)p[2] << 40) | ((u64)p[3] << 32)
+		| ((u64)p[4] << 24) | ((u64)p[5] << 16) | ((u64)p[6] << 8) | (u64)p[7];
+}
+
+/* Decodes the nCol values of an INSERT or DELETE whose type bytes match
+ * types, all of them SQLITE_INTEGER or SQLITE_FLOAT. Returns the bytes read,
+ * or 0 if a type does not match. */
+typedef size_t (*FixedRowReader)(const char* buf, const u8* types, sqlite_value* values, int nCol);
+
+template<int N>
+size_t readFixedRow(const char* buf, const u8* types, sqlite_value* values, int)
+{
+	for (int i=0; i < N; i++) {
+		if ((u8)buf[i*9] != types[i]) {
+			return 0;
+		}
+	}
+	for (int i=0; i < N; i++) {
+		values[i].type = types[i];
+		values[i].data1.iVal = (int64_t)readU64(buf + i*9 + 1);
+	}
+	return N * 9;
+}
+
+inline size_t readFixedRowAny(const char* buf, const u8* types, sqlite_value* values, int nCol)
+{
+	for (int i=0; i < nCol; i++) {
+		if ((u8)buf[i*9] != types[i]) {
+			return 0;
+		}
+		values[i].type = types[i];
+		values[i].data1.iVal = (int64_t)readU64(buf + i*9 + 1);
+	}
+	return nCol * 9;
+}
+
+/**
+ * Type signature of the rows of a table block. Most blocks hold the same
+ * type in every row of a column, so once the first kProfileRows INSERTs and
+ * DELETEs agree on a signature of only INTEGERs and FLOATs, the rest are
+ * decoded by a FixedRowReader unrolled for the column count, which checks
+ * the type bytes up front instead of switching on each. Rows that do not
+ * match take the generic path.
+ */
+struct TypeProfile
+{
+	static const int kProfileRows = 8;
+	static const int kMaxUnrolled = 16;
+
+	TypeProfile() : nSeen(0), disabled(false), reader(nullptr) {}
+
+	void reset()
+	{
+		types.clear();
+		nSeen = 0;
+		disabled = false;
+		reader = nullptr;
+	}
+
+	void observe(const Instruction* instr)
+	{
+		int nCol = instr->table->nCol;
+		if (nSeen == 0) {
+			types.resize(nCol);
+		}
+		for (int i=0; i < nCol; i++) {
+			int type = instr->values[i].type;
+			if ((type != SQLITE_INTEGER && type != SQLITE_FLOAT) || (nSeen > 0 && types[i] != type)) {
+				disabled = true;
+				return;
+			}
+			types[i] = (u8)type;
+		}
+		if (++nSeen == kProfileRows) {
+			static const FixedRowReader kReaders[kMaxUnrolled + 1] = {
+				nullptr,
+				readFixedRow<1>, readFixedRow<2>, readFixedRow<3>, readFixedRow<4>,
+				readFixedRow<5>, readFixedRow<6>, readFixedRow<7>, readFixedRow<8>,
+				readFixedRow<9>, readFixedRow<10>, readFixedRow<11>, readFixedRow<12>,
+				readFixedRow<13>, readFixedRow<14>, readFixedRow<15>, readFixedRow<16>,
+			};
+			reader = nCol <= kMaxUnrolled ? kReaders[nCol] : readFixedRowAny;
+		}
+	}
+
+	std::vector<u8> types;
+	int nSeen;
+	bool disabled;
+	FixedRowReader reader;
+};
+
+inline size_t readInstructionFromBuffer(const char* buf, Instruction* instr, ValueDict* dict,
+		TypeProfile* profile = nullptr)
+{
+	size_t nRead = 0;
+
+	instr->iType = *buf;
+	int eUpdate = instr->iType == SQLITE_UPDATE ? (u8)buf[1] : 0;
+	buf += 2; nRead += 2;
+
+	bool plainRow = instr->iType == SQLITE_INSERT || instr->iType == SQLITE_DELETE;
+	if (profile && profile->reader && plainRow) {
+		// Fixed-width values never enter the dictionary
+		size_t read = profile->reader(buf, profile->types.data(), instr->values, instr->table->nCol);
+		if (read) {
+			return nRead + read;
+		}
+	}
+
+	int nTableCol = instr->table->nCol;
+	int nCol = nTableCol;
+	if (instr->iType == SQLITE_UPDATE) {
+		nCol *= 2;
+	}
+
+	// Column set of an UPDATE that leaves out its unchanged columns
+	const u8* bitmap = nullptr;
+	const u8* list = nullptr;
+	u32 nList = 0;
+	if (eUpdate == SQLITEDIFF_UPDATE_BITMAP) {
+		bitmap = (const u8*)buf;
+		buf += (nTableCol + 7) / 8;
+		nRead += (nTableCol + 7) / 8;
+	} else if (eUpdate == SQLITEDIFF_UPDATE_LIST) {
+		size_t read = getVarint32((u8*)buf, nList);
+		list = (const u8*)buf + read;
+		for (u32 k=0; k < nList; k++) {
+			u32 iCol;
+			read += getVarint32((u8*)buf + read, iCol);
+		}
+		buf += read;
+		nRead += read;
+	} else if (eUpdate != 0) {
+		return 0;
+	}
+	const u8* listPos = list;
+	u32 listLeft = 0;
+	u32 nextChanged = 0;
+
+	for (int i=0; i < nCol; i++) {
+		sqlite_value* val_p = instr->values + i;
+		if (eUpdate) {
+			int iCol = i % nTableCol;
+			bool changed;
+			if (bitmap) {
+				changed = (bitmap[iCol / 8] >> (iCol % 8)) & 1;
+			} else {
+				if (iCol == 0) {
+					listPos = list;
+					listLeft = nList;
+					nextChanged = UINT32_MAX;
+					if (listLeft) {
+						listPos += getVarint32((u8*)listPos, nextChanged);
+					}
+				}
+				changed = (u32)iCol == nextChanged;
+				if (changed) {
+					nextChanged = UINT32_MAX;
+					if (--listLeft) {
+						listPos += getVarint32((u8*)listPos, nextChanged);
+					}
+				}
+			}
+			if (! changed && ! (i < nTableCol && instr->table->PKs[iCol])) {
+				val_p->type = 0;
+				continue;
+			}
+		}
+		size_t read = readValue(buf, val_p);
+		if (read == 0) {
+			return 0;
+		}
+		if (val_p->type == SQLITEDIFF_DICTREF) {
+			if (! dict || (size_t)val_p->data1.iVal >= dict->entries.size()) {
+				return 0;
+			}
+			*val_p = dict->entries[val_p->data1.iVal];
+		} else if (dict && (val_p->type == SQLITE_TEXT || val_p->type == SQLITE_BLOB)
+				&& val_p->data1.iVal <= dict->maxSize && dict->entries.size() < dict->maxEntries) {
+			dict->entries.push_back(*val_p);
+		}
+		buf += read;
+		nRead += read;
+	}
+
+	if (profile && plainRow && ! profile->reader && ! profile->disabled) {
+		profile->observe(instr);
+	}
+
+	return nRead;
+}
+
+
+/**
+ * Read-only memory map of a whole changeset file. Unlike a copy on the heap,
+ * the pages of a large changeset are only brought in as they are read, and
+ * the kernel can drop them again, so large BLOBs do not pin memory.
+ *
+ * An empty file is an empty changeset: ok() with no data.
+ */
+class MappedFile
+{
+public:
+	explicit MappedFile(const char* filename) : m_data(nullptr), m_size(0), m_ok(false)
+	{
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			m_ok = false;
+		} else if (st.st_size == 0) {
+			m_ok = true;
+		} else {
+			void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				madvise(data, st.st_size, MADV_SEQUENTIAL);
+				m_data = (const char*)data;
+				m_size = st.st_size;
+				m_ok = true;
+			}
+		}
+		close(fd);
+	}
+
+	~MappedFile()
+	{
+		if (m_data) {
+			munmap((void*)m_data, m_size);
+		}
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	/* False if the file could not be opened or mapped */
+	bool ok() const { return m_ok; }
+	const char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	const char* m_data;
+	size_t m_size;
+	bool m_ok;
+};
+
+
+/* Default blockEnd of readChangesetWith() */
+struct NoBlockEnd
+{
+	int operator()() const { return 0; }
+};
+
+/* Decode the changeset in buf, calling callback(const Instruction*) for
+ * every instruction, and blockEnd() after the last instruction of every
+ * table block, while its TableInfo is still alive. See readChangeset() for
+ * the cursor. */
+template<typename F, typename E = NoBlockEnd>
+int readChangesetWith(const char* buf, size_t size, F& callback, ChangesetCursor* cursor = nullptr,
+		E blockEnd = E())
+{
+	const char* const bufStart = buf;
+	const char* const bufEnd = buf + size;
+
+	// Where to resume: the block to jump to and the first offset to call back for
+	size_t resumeBlock = cursor ? cursor->block : 0;
+	size_t resumeAt = cursor ? cursor->next : 0;
+	if (resumeAt > size || resumeBlock > resumeAt) {
+		return CHANGESET_CORRUPT;
+	}
+
+	double lastPos = .0;
+	auto t1 = std::chrono::high_resolution_clock::now();
+
+	ValueDict dict;
+	TypeProfile profile;
+
+	if (size > 0 && buf[0] == 'K') {
+		if (size < 2 || buf[1] != SQLITEDIFF_CHECKSUM_CRC32C) {
+			return CHANGESET_CORRUPT;
+		}
+		int rc = verifyChecksums(buf, size);
+		if (rc) {
+			std::cerr << "Changeset checksum mismatch." << std::endl;
+			return rc;
+		}
+		buf += 2;
+	}
+
+	while(buf < bufEnd) {
+		if (resumeAt && (size_t)(buf - bufStart) < resumeBlock && (buf[0] == 'T' || buf[0] == 'P')) {
+			buf = bufStart + resumeBlock;
+		}
+		const char* blockStart = buf;
+		char op = buf[0];
+		buf++;
+
+		if (op == 'C') {
+			buf += kChecksumRecord - 1;
+			continue;
+		}
+
+		// Read dictionary settings
+		if (op == 'D') {
+			if (! varintFits(buf, bufEnd)) {
+				return CHANGESET_CORRUPT;
+			}
+			buf += getVarint32((u8*)buf, dict.maxSize);
+			if (! varintFits(buf, bufEnd)) {
+				return CHANGESET_CORRUPT;
+			}
+			buf += getVarint32((u8*)buf, dict.maxEntries);
+			continue;
+		}
+
+		// Read OP
+		if (op != 'T' && op != 'P') {
+			return CHANGESET_CORRUPT;
+		}
+
+		// Read number of columns
+		u32 nCol;
+		u8 varintLen = getVarint32((u8*)buf, nCol);
+		buf += varintLen;
+
+		// Read Primary Key flags
+		std::vector<int> PKs(nCol);
+		for (u32 i=0; i < nCol; i++) {
+			PKs[i] = (bool) buf[i];
+		}
+		buf += nCol;
+
+		// Read table name
+		const char* tableName = buf;
+		size_t tableNameLen = std::strlen(tableName);
+		buf += tableNameLen + 1;
+
+		// Read column names of a projection
+		std::vector<const char*> columnNames;
+		if (op == 'P') {
+			for (u32 i=0; i < nCol && buf < bufEnd; i++) {
+				columnNames.push_back(buf);
+				buf += std::strlen(buf) + 1;
+			}
+			if (columnNames.size() != nCol) {
+				return CHANGESET_CORRUPT;
+			}
+		}
+
+		size_t instrRead = 0;
+
+		TableInfo table;
+		table.PKs = PKs.data();
+		table.nCol = nCol;
+		table.tableName = tableName;
+		table.columnNames = columnNames.empty() ? nullptr : columnNames.data();
+		table.bProjected = op == 'P';
+
+		Instruction instr;
+		instr.table = &table;
+		instr.values = new sqlite_value[nCol*2];
+		instr.valFlag = nullptr;
+
+
+		dict.entries.clear();
+		profile.reset();
+
+		while (buf < bufEnd && buf[0] != 'T' && buf[0] != 'P' && buf[0] != 'D') {
+			if (buf[0] == 'C') {
+				buf += kChecksumRecord;
+				continue;
+			}
+			bool skip = (size_t)(buf - bufStart) < resumeAt;
+			if (skip && ! dict.maxSize) {
+				buf = bufStart + resumeAt;
+				continue;
+			}
+			instrRead = readInstructionFromBuffer(buf, &instr, dict.maxSize ? &dict : nullptr, &profile);
+			if (instrRead == 0) {
+				std::cerr << "Error reading instruction from buffer." << std::endl;
+				delete[] instr.values;
+				return CHANGESET_INSTRUCTION_CORRUPT;
+			}
+			if (skip) {
+				// Only rebuild the dictionary up to the resume point
+				buf += instrRead;
+				continue;
+			}
+
+			if (cursor) {
+				cursor->block = blockStart - bufStart;
+				cursor->next = buf + instrRead - bufStart;
+			}
+
+			int rc;
+			if ((rc = callback(&instr))) {
+				std::cerr << "Error applying instruction. Callback returned " << rc << std::endl;
+				delete[] instr.values;
+				return CHANGESET_CALLBACK_ERROR;
+			}
+
+			buf += instrRead;
+
+			double pos = (double)(buf - bufStart) / (bufEnd - bufStart) * 100;
+			if ((pos - lastPos) > 0.1) {
+				auto t2 = std::chrono::high_resolution_clock::now();
+				auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+				std::cerr << pos << "%, " << (time_span.count() / pos) * 100 << std::endl;
+				lastPos = pos;
+			}
+		}
+
+		delete[] instr.values;
+		if (blockEnd()) {
+			return CHANGESET_CALLBACK_ERROR;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+** XXH64 (Yann Collet's xxHash, 64-bit variant) and the sqlitediff_rowhash()
+** SQL function built on it, which lets the diff query compare a row of any
+** width with a single integer comparison.
+*/
+#include <string.h>
+
+#include "rowhash.h"
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r){
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p){
+  uint64_t v;
+  memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static uint32_t read32(const unsigned char *p){
+  uint32_t v;
+  memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t v){
+  acc += v * XXH_P2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_P1;
+}
+
+static uint64_t xxhMerge(uint64_t h, uint64_t acc){
+  h ^= xxhRound(0, acc);
+  return h * XXH_P1 + XXH_P4;
+}
+
+uint64_t sqlitediff_xxh64(const void *pData, size_t n, uint64_t seed){
+  const unsigned char *p = (const unsigned char*)pData;
+  const unsigned char *pEnd = p + n;
+  uint64_t h;
+
+  if( n>=32 ){
+    uint64_t v1 = seed + XXH_P1 + XXH_P2;
+    uint64_t v2 = seed + XXH_P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_P1;
+    do{
+      v1 = xxhRound(v1, read64(p));
+      v2 = xxhRound(v2, read64(p+8));
+      v3 = xxhRound(v3, read64(p+16));
+      v4 = xxhRound(v4, read64(p+24));
+      p += 32;
+    }while( pEnd-p>=32 );
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxhMerge(h, v1);
+    h = xxhMerge(h, v2);
+    h = xxhMerge(h, v3);
+    h = xxhMerge(h, v4);
+  }else{
+    h = seed + XXH_P5;
+  }
+  h += (uint64_t)n;
+
+  for(; pEnd-p>=8; p+=8){
+    h ^= xxhRound(0, read64(p));
+    h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if( pEnd-p>=4 ){
+    h ^= (uint64_t)read32(p) * XXH_P1;
+    h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for(; p<pEnd; p++){
+    h ^= (*p) * XXH_P5;
+    h = rotl64(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+/*
+** Each value is hashed with the hash of the values before it, mixed with
+** its type, as the seed, so neither the order nor the types can be swapped
+** without changing the result. Numbers are hashed as their 8 bytes, TEXT
+** and BLOBs as their bytes.
+*/
+static void rowhashFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  uint64_t h = 0;
+  int i;
+  for(i=0; i<argc; i++){
+    int type = sqlite3_value_type(argv[i]);
+    uint64_t seed = h + (uint64_t)type * XXH_P5;
+    switch( type ){
+      case SQLITE_INTEGER: {
+        sqlite3_int64 v = sqlite3_value_int64(argv[i]);
+        h = sqlitediff_xxh64(&v, 8, seed);
+        break;
+      }
+      case SQLITE_FLOAT: {
+        double v = sqlite3_value_double(argv[i]);
+        h = sqlitediff_xxh64(&v, 8, seed);
+        break;
+      }
+      case SQLITE_TEXT: {
+        const unsigned char *z = sqlite3_value_text(argv[i]);
+        h = sqlitediff_xxh64(z, sqlite3_value_bytes(argv[i]), seed);
+        break;
+      }
+      case SQLITE_BLOB: {
+        const void *z = sqlite3_value_blob(argv[i]);
+        h = sqlitediff_xxh64(z, sqlite3_value_bytes(argv[i]), seed);
+        break;
+      }
+      default: {
+        h = sqlitediff_xxh64(0, 0, seed);
+        break;
+      }
+    }
+  }
+  sqlite3_result_int64(ctx, (sqlite3_int64)h);
+}
+
+int sqlitediff_rowhash_register(sqlite3 *db){
+  return sqlite3_create_function(db, "sqlitediff_rowhash", -1,
+      SQLITE_UTF8|SQLITE_DETERMINISTIC|SQLITE_INNOCUOUS, 0, rowhashFunc, 0, 0);
+}
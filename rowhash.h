@@ -0,0 +1,27 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+/*
+** XXH64 of the n bytes at p with the given seed.
+*/
+uint64_t sqlitediff_xxh64(const void *p, size_t n, uint64_t seed);
+
+/*
+** Register sqlitediff_rowhash(...) on db: a 64-bit hash of the types and
+** values of its arguments, equal for arguments that are identical byte for
+** byte. Values that compare equal without being identical, like 1 and 1.0
+** or strings equal under a collation, may hash differently.
+*/
+int sqlitediff_rowhash_register(sqlite3 *db);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,435 @@
+#include "serve.h"
+
+#include "diff.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+/* Largest request accepted, in bytes */
+const size_t kMaxRequest = 1 << 20;
+
+/* Seconds a client has to send its request, and for each send of the
+   reply, before it is dropped so that it cannot stall the server */
+const int kClientTimeout = 5;
+
+/* A database pair whose connection stays open between requests */
+struct WarmDb
+{
+	std::string db1;
+	std::string db2;
+	struct stat st1;
+	struct stat st2;
+	sqlite3* db;
+	DiffCache* cache;
+};
+
+void closeWarm(WarmDb& warm)
+{
+	sqlitediff_cache_close(warm.cache);
+	sqlite3_close(warm.db);
+}
+
+bool sameFile(const struct stat& a, const struct stat& b)
+{
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+struct Request
+{
+	Request() : check(false), shutdown(false), options() {}
+
+	bool check;
+	bool shutdown;
+	DiffOptions options;
+	std::vector<const char*> includeTables;
+	std::vector<const char*> excludeTables;
+	std::vector<const char*> excludeColumns;
+	std::vector<std::string> paths;
+};
+
+bool parseRequest(const std::vector<std::string>& args, Request* req, std::string* error)
+{
+	size_t i = 0;
+	for (; i < args.size() && args[i].compare(0, 2, "--") == 0; i++) {
+		const std::string& opt = args[i];
+		bool hasValue = i + 1 < args.size();
+		if (opt == "--check") {
+			req->check = true;
+		} else if (opt == "--shutdown") {
+			req->shutdown = true;
+		} else if (opt == "--live") {
+			req->options.bLive = 1;
+		} else if (opt == "--session") {
+			req->options.bSessionFormat = 1;
+		} else if (opt == "--checksum") {
+			req->options.bChecksum = 1;
+		} else if (hasValue && opt == "--table") {
+			req->includeTables.push_back(args[++i].c_str());
+		} else if (hasValue && opt == "--exclude-table") {
+			req->excludeTables.push_back(args[++i].c_str());
+		} else if (hasValue && opt == "--exclude-column") {
+			req->excludeColumns.push_back(args[++i].c_str());
+		} else if (hasValue && opt == "--delta-threshold") {
+			req->options.nDeltaThreshold = atoll(args[++i].c_str());
+		} else if (hasValue && opt == "--stream-threshold") {
+			req->options.nStreamThreshold = atoll(args[++i].c_str());
+		} else if (hasValue && opt == "--dict-max-size") {
+			req->options.nDictMaxSize = atoi(args[++i].c_str());
+		} else {
+			*error = "Unsupported option " + opt;
+			return false;
+		}
+	}
+	req->paths.assign(args.begin() + i, args.end());
+
+	if (! req->shutdown && req->paths.size() != 2) {
+		*error = "Wrong number of arguments";
+		return false;
+	}
+
+	if (! req->includeTables.empty()) {
+		req->includeTables.push_back(nullptr);
+		req->options.azIncludeTables = req->includeTables.data();
+	}
+	req->excludeTables.push_back(nullptr);
+	req->options.azExcludeTables = req->excludeTables.data();
+	req->excludeColumns.push_back(nullptr);
+	req->options.azExcludeColumns = req->excludeColumns.data();
+	return true;
+}
+
+/* The connection of db1 and db2, most recently used first */
+class WarmPool
+{
+public:
+	explicit WarmPool(size_t maxDb) : m_maxDb(maxDb < 1 ? 1 : maxDb) {}
+
+	~WarmPool()
+	{
+		for (auto& warm : m_dbs) {
+			closeWarm(warm);
+		}
+	}
+
+	sqlite3* get(const std::string& db1, const std::string& db2, std::string* error)
+	{
+		/* sqlitediff_open() would create missing databases */
+		struct stat st1, st2;
+		if (stat(db1.c_str(), &st1) != 0) {
+			*error = "Cannot open " + db1 + ": " + strerror(errno);
+			return nullptr;
+		}
+		if (stat(db2.c_str(), &st2) != 0) {
+			*error = "Cannot open " + db2 + ": " + strerror(errno);
+			return nullptr;
+		}
+
+		for (auto it = m_dbs.begin(); it != m_dbs.end(); ++it) {
+			if (it->db1 != db1 || it->db2 != db2) {
+				continue;
+			}
+			if (sameFile(it->st1, st1) && sameFile(it->st2, st2)) {
+				m_dbs.splice(m_dbs.begin(), m_dbs, it);
+				return it->db;
+			}
+			/* Replaced, e.g. by a patched copy that was renamed over it */
+			closeWarm(*it);
+			m_dbs.erase(it);
+			break;
+		}
+
+		WarmDb warm;
+		warm.db1 = db1;
+		warm.db2 = db2;
+		warm.st1 = st1;
+		warm.st2 = st2;
+		if (sqlitediff_open(db1.c_str(), db2.c_str(), &warm.db) != SQLITE_OK) {
+			*error = "Cannot open " + db1 + " and " + db2;
+			return nullptr;
+		}
+		warm.cache = sqlitediff_cache_open(warm.db);
+
+		m_dbs.push_front(warm);
+		if (m_dbs.size() > m_maxDb) {
+			closeWarm(m_dbs.back());
+			m_dbs.pop_back();
+		}
+		return warm.db;
+	}
+
+private:
+	size_t m_maxDb;
+	std::list<WarmDb> m_dbs;
+};
+
+bool sendAll(int fd, const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while (size > 0) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool sendReply(int fd, int status, const char* data, size_t size)
+{
+	std::string head = std::to_string(status) + " " + std::to_string(size) + "\n";
+	return sendAll(fd, head.data(), head.size()) && sendAll(fd, data, size);
+}
+
+/* Reads NUL-terminated arguments up to an empty one, within kClientTimeout. */
+bool readRequest(int fd, std::vector<std::string>* args)
+{
+	std::string buf;
+	char chunk[4096];
+	size_t start = 0;
+	time_t deadline = time(nullptr) + kClientTimeout;
+
+	while (buf.size() < kMaxRequest) {
+		time_t left = deadline - time(nullptr);
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int ready = left > 0 ? poll(&pfd, 1, left * 1000) : 0;
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ready <= 0) {
+			return false;
+		}
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf.append(chunk, n);
+
+		size_t end;
+		while ((end = buf.find('\0', start)) != std::string::npos) {
+			if (end == start) {
+				return true;
+			}
+			args->push_back(buf.substr(start, end - start));
+			start = end + 1;
+		}
+	}
+	return false;
+}
+
+/* Returns false once the server is asked to shut down. */
+bool serveOne(int fd, WarmPool* pool)
+{
+	std::vector<std::string> args;
+	Request req;
+	std::string error;
+
+	if (! readRequest(fd, &args)) {
+		return true;
+	}
+	if (! parseRequest(args, &req, &error)) {
+		sendReply(fd, 2, error.data(), error.size());
+		return true;
+	}
+	if (req.shutdown) {
+		sendReply(fd, 0, nullptr, 0);
+		return false;
+	}
+
+	sqlite3* db = pool->get(req.paths[0], req.paths[1], &error);
+	if (! db) {
+		sendReply(fd, 2, error.data(), error.size());
+		return true;
+	}
+
+	sqlitediff_set_options(&req.options);
+
+	int rc;
+	int status = 0;
+	char* data = nullptr;
+	size_t size = 0;
+	if (req.check) {
+		int differ = 0;
+		rc = sqlitediff_check_prepared(db, nullptr, &differ);
+		status = differ ? 1 : 0;
+	} else {
+		FILE* out = open_memstream(&data, &size);
+		rc = out ? sqlitediff_diff_prepared(db, nullptr, out) : SQLITE_NOMEM;
+		if (out) {
+			fclose(out);
+		}
+	}
+
+	/* The request owns the option arrays */
+	sqlitediff_set_options(nullptr);
+
+	if (rc != SQLITE_OK) {
+		error = std::string("Could not diff: ") + sqlite3_errstr(rc);
+		sendReply(fd, 2, error.data(), error.size());
+	} else {
+		sendReply(fd, status, data, size);
+	}
+	free(data);
+	return true;
+}
+
+bool socketAddress(const char* zPath, struct sockaddr_un* addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(zPath) >= sizeof(addr->sun_path)) {
+		return false;
+	}
+	strcpy(addr->sun_path, zPath);
+	return true;
+}
+
+} // namespace
+
+int sqlitediff_serve(const char* zPath, int nMaxDb)
+{
+	struct sockaddr_un addr;
+	if (! socketAddress(zPath, &addr)) {
+		std::cerr << "Socket path too long: " << zPath << std::endl;
+		return SQLITE_CANTOPEN;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return SQLITE_CANTOPEN;
+	}
+
+	/* Take over the socket file of a server that is gone, not of a live one */
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		std::cerr << "A server is already listening on " << zPath << std::endl;
+		close(fd);
+		return SQLITE_BUSY;
+	}
+	if (errno == ECONNREFUSED) {
+		unlink(zPath);
+	}
+	close(fd);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+		std::cerr << "Cannot listen on " << zPath << ": " << strerror(errno) << std::endl;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return SQLITE_CANTOPEN;
+	}
+
+	{
+		WarmPool pool(nMaxDb);
+		bool running = true;
+		while (running) {
+			int client = accept(fd, nullptr, nullptr);
+			if (client < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				break;
+			}
+			struct timeval timeout = {kClientTimeout, 0};
+			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			running = serveOne(client, &pool);
+			close(client);
+		}
+	}
+
+	close(fd);
+	unlink(zPath);
+	return SQLITE_OK;
+}
+
+int sqlitediff_request(const char* zPath, int argc, const char** argv, FILE* out, int* pStatus)
+{
+	struct sockaddr_un addr;
+	if (! socketAddress(zPath, &addr)) {
+		return SQLITE_CANTOPEN;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return SQLITE_CANTOPEN;
+	}
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return SQLITE_CANTOPEN;
+	}
+
+	std::string request;
+	for (int i=0; i < argc; i++) {
+		request.append(argv[i]);
+		request.push_back('\0');
+	}
+	request.push_back('\0');
+
+	int rc = sendAll(fd, request.data(), request.size()) ? SQLITE_OK : SQLITE_IOERR;
+
+	/* Status line, then the data */
+	std::string head;
+	char c;
+	while (rc == SQLITE_OK && head.size() < 64) {
+		ssize_t n = recv(fd, &c, 1, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			rc = SQLITE_IOERR;
+		} else if (c == '\n') {
+			break;
+		} else {
+			head.push_back(c);
+		}
+	}
+
+	int status = 2;
+	unsigned long long size = 0;
+	if (rc == SQLITE_OK && sscanf(head.c_str(), "%d %llu", &status, &size) != 2) {
+		rc = SQLITE_IOERR;
+	}
+
+	FILE* dest = status == 2 ? stderr : out;
+	char chunk[65536];
+	while (rc == SQLITE_OK && size > 0) {
+		ssize_t n = recv(fd, chunk, size < sizeof(chunk) ? size : sizeof(chunk), 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0 || fwrite(chunk, 1, n, dest) != (size_t)n) {
+			rc = SQLITE_IOERR;
+			break;
+		}
+		size -= n;
+	}
+	if (rc == SQLITE_OK && status == 2) {
+		fputc('\n', stderr);
+	}
+	close(fd);
+
+	*pStatus = status;
+	return rc;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Serve diffs and checks on the UNIX socket zPath, one request at a time,
+** until a request asks the server to shut down.
+**
+** The connections of the last nMaxDb database pairs stay open between
+** requests, each with a DiffCache: SQLite keeps their page caches across
+** transactions as long as the files are not written, and the cache keeps
+** their table metadata and prepared diff queries until a schema cookie
+** changes. A pair is reopened if either path now names a different file.
+**
+** A request is the arguments of an sqlite-diff run, each terminated by a
+** NUL byte, followed by an empty argument. The supported options are
+** --check, --table, --exclude-table, --exclude-column, --delta-threshold,
+** --stream-threshold, --dict-max-size, --live, --session and --checksum,
+** and --shutdown instead of the databases. Paths are resolved by the
+** server, so they should be absolute. A client that does not send its
+** whole request within 5 seconds, or stops reading the reply, is dropped.
+**
+** The reply is a line "<status> <length>" followed by length bytes. The
+** status is the exit code sqlite-diff would return: 0, or 1 if --check
+** found differences, with the changeset as the data; 2 with an error
+** message.
+*/
+int sqlitediff_serve(const char* zPath, int nMaxDb);
+
+/*
+** Send one request to the server on zPath and write the changeset it
+** returns to out, or its error message to stderr. *pStatus receives the
+** status of the reply. Returns SQLITE_CANTOPEN if no server is listening
+** and SQLITE_IOERR if the exchange failed.
+*/
+int sqlitediff_request(
+  const char* zPath,
+  int argc,
+  const char** argv,
+  FILE* out,
+  int* pStatus
+);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -14,6 +14,7 @@ typedef uint64_t u64;
 typedef int64_t i64;
 typedef uint8_t u8;
 
+int sqlite3PutVarint(unsigned char *p, u64 v);
 u8 sqlite3GetVarint(const unsigned char *p, u64 *v);
 u8 sqlite3GetVarint32(const unsigned char *p, u32 *v);
 sqlite3_int64 sessionGetI64(u8 *aRec);
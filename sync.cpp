@@ -0,0 +1,153 @@
+#include "sync.h"
+
+#include "batch.h"
+#include "diff.h"
+#include "patch.h"
+#include "queue.h"
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/* Instructions per batch and number of batches in flight */
+const size_t kBatchSize = 256;
+const size_t kQueueDepth = 16;
+
+struct SyncState
+{
+	SyncState() : ready(kQueueDepth), free(kQueueDepth), applyRc(SQLITE_OK), current(nullptr) {}
+
+	BoundedQueue<InstructionBatch*> ready; //< diff thread -> apply thread
+	BoundedQueue<InstructionBatch*> free;  //< apply thread -> diff thread
+	std::atomic<int> applyRc;
+
+	std::shared_ptr<const OwnedTable> table;
+	InstructionBatch* current;
+};
+
+int flushBatch(SyncState* state)
+{
+	if (! state->current) {
+		return SQLITE_OK;
+	}
+
+	state->current->seal();
+	InstructionBatch* batch = state->current;
+	state->current = nullptr;
+
+	if (! state->ready.push(batch)) {
+		return SQLITE_ABORT;
+	}
+	return state->applyRc.load();
+}
+
+int syncTableCallback(const TableInfo* table, void* context)
+{
+	SyncState* state = (SyncState*)context;
+
+	int rc = flushBatch(state);
+	state->table = std::make_shared<OwnedTable>(table);
+
+	return rc;
+}
+
+int syncInstrCallback(const Instruction* instr, void* context)
+{
+	SyncState* state = (SyncState*)context;
+
+	if (! state->current) {
+		if (! state->free.pop(state->current)) {
+			return SQLITE_ABORT;
+		}
+		state->current->reset(state->table);
+	}
+
+	int rc = state->current->add(instr);
+	if (rc != SQLITE_OK) {
+		return rc;
+	}
+
+	if (state->current->size() >= kBatchSize) {
+		return flushBatch(state);
+	}
+	return state->applyRc.load();
+}
+
+void applyLoop(SyncState* state, sqlite3* db)
+{
+	int rc = SQLITE_OK;
+	InstructionBatch* batch;
+
+	while (state->ready.pop(batch)) {
+		/* After an error keep draining, so the diff thread never blocks. It
+		 * stops at its next callback once it sees applyRc. */
+		for (size_t i=0; rc == SQLITE_OK && i < batch->size(); i++) {
+			Instruction instr;
+			batch->get(i, &instr);
+			rc = applyInstruction(&instr, db);
+		}
+		if (rc != SQLITE_OK) {
+			state->applyRc.store(rc);
+		}
+		state->free.push(batch);
+	}
+}
+
+} // namespace
+
+int sqlitediff_sync(const char* zDb1, const char* zDb2, const char* zTab, const char* zTarget)
+{
+	int rc;
+	sqlite3* db;
+	sqlite3* target;
+
+	rc = sqlite3_open_v2(zTarget, &target, SQLITE_OPEN_READWRITE, nullptr);
+	if (rc != SQLITE_OK) {
+		std::cerr << "Could not open sqlite DB " << zTarget << ": " << sqlite3_errstr(rc) << std::endl;
+		sqlite3_close(target);
+		return rc;
+	}
+
+	rc = sqlitediff_open(zDb1, zDb2, &db);
+	if (rc != SQLITE_OK) {
+		sqlite3_close(target);
+		return rc;
+	}
+
+	SyncState state;
+	std::vector<std::unique_ptr<InstructionBatch>> batches;
+	for (size_t i=0; i < kQueueDepth; i++) {
+		batches.emplace_back(new InstructionBatch);
+		state.free.push(batches.back().get());
+	}
+
+	rc = applyBegin(target);
+	if (rc == SQLITE_OK) {
+		std::thread applier(applyLoop, &state, target);
+
+		rc = slitediff_diff_prepared_callback(db, zTab, syncTableCallback, syncInstrCallback, &state);
+		if (rc == SQLITE_OK) {
+			rc = flushBatch(&state);
+		}
+
+		state.ready.close();
+		applier.join();
+
+		if (state.applyRc.load() != SQLITE_OK) {
+			rc = state.applyRc.load();
+		}
+		int rc2 = applyEnd(target, rc);
+		if (rc == SQLITE_OK) {
+			rc = rc2;
+		}
+	}
+
+	sqlite3_close(db);
+	sqlite3_close(target);
+
+	return rc;
+}
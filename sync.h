@@ -0,0 +1,25 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Bring zTarget from the state of zDb1 to the state of zDb2 without an
+** intermediate changeset file.
+**
+** The diff of zDb1 against zDb2 runs on the calling thread and hands batches
+** of instructions through a bounded queue to an apply thread writing
+** zTarget, so diffing and applying overlap. zTarget is written inside a
+** single savepoint and left unchanged if any instruction fails.
+*/
+int sqlitediff_sync(
+  const char* zDb1,
+  const char* zDb2,
+  const char* zTab,   /* name of table to sync, or NULL for all tables */
+  const char* zTarget
+);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -1,11 +1,26 @@
 #include <iostream>
 
+#include <batch.h>
+#include <changeset.h>
+#include <crc32c.h>
 #include <diff.h>
+#include <fanout.h>
 #include <patch.h>
+#include <serve.h>
+#include <sync.h>
+#include <visitor.h>
 
+#include <chrono>
 #include <cstdio>
 #include <cerrno>
 #include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #define F(X) do {															\
 	rc = X; 																\
@@ -26,6 +41,7 @@ int main(int argc, char const *argv[])
 
 	const char* aF = "a.sqlite";
 	const char* bF = "b.sqlite";
+	const char* cF = "c.sqlite";
 
 	rc = remove(aF);
 	if (rc) {
@@ -35,6 +51,10 @@ int main(int argc, char const *argv[])
 	if (rc) {
 		T(errno == ENOENT);
 	}
+	rc = remove(cF);
+	if (rc) {
+		T(errno == ENOENT);
+	}
 
 	sqlite3 *db;
 	F(sqlite3_open_v2(aF, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr));
@@ -95,6 +115,45 @@ int main(int argc, char const *argv[])
 
 	F(checkB("aux"));
 
+	// Sync a copy of main to aux without an intermediate changeset
+	F(sqlite3_exec(db, "ATTACH 'c.sqlite' AS 'target'", nullptr, nullptr, nullptr));
+	F(sqlite3_exec(db,
+		"CREATE TABLE target.Entries (ID PRIMARY KEY, Name, Farbe)",
+		nullptr, nullptr, nullptr));
+	F(sqlite3_exec(db,
+		"INSERT INTO target.Entries SELECT * FROM main.Entries",
+		nullptr, nullptr, nullptr));
+
+	F(sqlitediff_sync(aF, bF, nullptr, cF));
+
+	F(checkB("target"));
+
+	// Projection: Audit is never diffed, so main keeps its own values
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Docs (ID PRIMARY KEY, Title, Audit);"
+		"CREATE TABLE aux.Docs (ID PRIMARY KEY, Title, Audit);"
+		"INSERT INTO main.Docs VALUES (0, 'Draft', 'a-0'), (1, 'Old', 'a-1');"
+		"INSERT INTO aux.Docs VALUES (0, 'Final', 'b-0'), (2, 'New', 'b-2');",
+		nullptr, nullptr, nullptr));
+
+	// Delta: one character of a 4 KB value changes
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Pages (ID PRIMARY KEY, Body);"
+		"CREATE TABLE aux.Pages (ID PRIMARY KEY, Body);"
+		"INSERT INTO main.Pages VALUES (0, hex(randomblob(2048)));"
+		"INSERT INTO aux.Pages SELECT ID, substr(Body, 1, 1000) || 'x' || substr(Body, 1002) FROM main.Pages;",
+		nullptr, nullptr, nullptr));
+
+	const char* excludeColumns[] = {"Doc?.Audit", nullptr};
+	DiffOptions options = {};
+	options.azExcludeColumns = excludeColumns;
+	options.nDeltaThreshold = 1024;
+	sqlitediff_set_options(&options);
+
+	int differ = 0;
+	F(sqlitediff_check_prepared(db, nullptr, &differ));
+	T(differ == 1);
+
 	// Diff
 	FILE* out = fopen("out.diff", "wb");
 	F(sqlitediff_diff_prepared(
@@ -102,6 +161,7 @@ int main(int argc, char const *argv[])
 		nullptr,
 		out      /* Output stream */
 	));
+	T(ftell(out) < 1024);
 	fclose(out);
 
 
@@ -111,7 +171,1201 @@ int main(int argc, char const *argv[])
 
 	F(checkB("main"));
 
+	F(sqlitediff_check_prepared(db, nullptr, &differ));
+	T(differ == 0);
+
+	sqlite3_stmt* stmt;
+	F(sqlite3_prepare(db, "SELECT group_concat(ID || Title || ifnull(Audit, '-'), ' ') FROM main.Docs;", -1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW);
+	F(strcmp((const char*) sqlite3_column_text(stmt, 0), "0Finala-0 2New-"));
+	F(sqlite3_finalize(stmt));
+
+	// The schema is compared through the same filters: aux alone has Extra
+	F(sqlite3_exec(db, "CREATE TABLE aux.Extra (ID PRIMARY KEY, V); CREATE INDEX aux.ExtraV ON Extra (V);",
+		nullptr, nullptr, nullptr));
+	F(sqlitediff_check_prepared(db, nullptr, &differ));
+	T(differ == 1);
+	const char* excludeTables[] = {"Ex*", nullptr};
+	options.azExcludeTables = excludeTables;
+	sqlitediff_set_options(&options);
+	F(sqlitediff_check_prepared(db, nullptr, &differ));
+	T(differ == 0);
+	F(sqlite3_exec(db, "DROP TABLE aux.Extra", nullptr, nullptr, nullptr));
+
+	sqlitediff_set_options(nullptr);
+	F(sqlitediff_check_prepared(db, nullptr, &differ));
+	T(differ == 1);
+
+	// Dictionary: a 'D' record, then repeats of 'same' as entry 0
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Dict (ID PRIMARY KEY, V);"
+		"CREATE TABLE aux.Dict (ID PRIMARY KEY, V);"
+		"INSERT INTO aux.Dict VALUES (1, 'same'), (2, 'same'), (3, 'same');",
+		nullptr, nullptr, nullptr));
+	options = DiffOptions();
+	options.nDictMaxSize = 64;
+	sqlitediff_set_options(&options);
+	out = fopen("dict.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Dict", out));
+	fclose(out);
+	sqlitediff_set_options(nullptr);
+	std::vector<char> dict(4096);
+	out = fopen("dict.diff", "rb");
+	dict.resize(fread(dict.data(), 1, dict.size(), out));
+	fclose(out);
+	T(dict.size() > 2 && dict[0] == 'D' && dict[1] == 64);
+	int dictRefs = 0;
+	for (size_t i=0; i + 1 < dict.size(); i++) {
+		dictRefs += dict[i] == SQLITEDIFF_DICTREF && dict[i + 1] == 0;
+	}
+	T(dictRefs == 2);
+	F(applyChangeset(db, "dict.diff"));
+	F(sqlitediff_check_prepared(db, "Dict", &differ));
+	T(differ == 0);
+	F(sqlite3_exec(db, "DROP TABLE main.Dict; DROP TABLE aux.Dict;", nullptr, nullptr, nullptr));
+
+	// A 'D' record cut off in its varints is corrupt
+	ParsedChangeset cut;
+	T(cut.parse("D\x40\x84", 3) != 0);
+	T(cut.parse("D", 1) != 0);
+
+	// Streamed BLOBs, larger than the apply side's threshold of 1 MB
+	F(sqlite3_exec(db,
+		"DROP TABLE main.Docs; DROP TABLE aux.Docs;"
+		"CREATE TABLE main.Files (ID PRIMARY KEY, Data);"
+		"CREATE TABLE aux.Files (ID PRIMARY KEY, Data);"
+		"INSERT INTO main.Files VALUES (0, randomblob(1500000)), (1, x'00');"
+		"INSERT INTO aux.Files VALUES (0, randomblob(1500000)), (1, randomblob(2000)), (2, randomblob(1500000));",
+		nullptr, nullptr, nullptr));
+
+	options = DiffOptions();
+	options.nStreamThreshold = 1000;
+	options.nMemoryBudget = 4 * 1024 * 1024;
+	sqlitediff_set_options(&options);
+
+	auto cacheSize = [](sqlite3* db) {
+		sqlite3_stmt* stmt;
+		sqlite3_int64 size = 0;
+		if (sqlite3_prepare_v2(db, "PRAGMA aux.cache_size", -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+			size = sqlite3_column_int64(stmt, 0);
+		}
+		sqlite3_finalize(stmt);
+		return size;
+	};
+	sqlite3_int64 cacheBefore = cacheSize(db);
+	sqlite3_int64 heapLimitBefore = sqlite3_soft_heap_limit64(-1);
+
+	out = fopen("out2.diff", "wb");
+	F(sqlitediff_diff_prepared(db, nullptr, out));
+	fclose(out);
+
+	// The memory budget only holds for the call
+	T(cacheSize(db) == cacheBefore);
+	T(sqlite3_soft_heap_limit64(-1) == heapLimitBefore);
+
+	DiffStats stats;
+	sqlitediff_stats(&stats);
+	T(stats.nTable >= 1 && stats.nInsert == 1 && stats.nUpdate == 2 && stats.nDelete == 0);
+	T(stats.nSqliteHighwater > 0 && stats.nPeakRss > 0);
+	F(applyChangeset(db, "out2.diff"));
+
+	F(sqlitediff_check_prepared(db, nullptr, &differ));
+	T(differ == 0);
+	sqlitediff_set_options(nullptr);
+
+	// A streamed BLOB that cannot be read fails the instruction
+	{
+		int pk[2] = {1, 0};
+		TableInfo table = {"Files", 2, pk, nullptr, 0};
+		BlobRef ref = {db, "main", "Files", "Data", 99};
+		sqlite_value values[2];
+		values[0].type = SQLITE_INTEGER;
+		values[0].data1.iVal = 99;
+		values[1].type = SQLITEDIFF_BLOBREF;
+		values[1].data1.iVal = 1500000;
+		values[1].data2 = (const char*)&ref;
+		Instruction instr = {&table, SQLITE_INSERT, values, nullptr};
+		out = fopen("out2bad.diff", "wb");
+		ChangesetWriter* writer = sqlitediff_writer_open(out);
+		F(sqlitediff_writer_table(&table, writer));
+		T(sqlitediff_writer_instruction(&instr, writer) != 0);
+		sqlitediff_writer_close(writer);
+		fclose(out);
+
+		// ... and the copy sync, fan-out and the pipeline hand to their apply
+		// threads, which is left as it was
+		InstructionBatch batch;
+		batch.reset(std::make_shared<OwnedTable>(&table));
+		values[1].type = SQLITE_BLOB;
+		values[1].data1.iVal = 3;
+		values[1].data2 = "abc";
+		F(batch.add(&instr));
+		values[1].type = SQLITEDIFF_BLOBREF;
+		values[1].data1.iVal = 1500000;
+		values[1].data2 = (const char*)&ref;
+		T(batch.add(&instr) != 0);
+		batch.seal();
+		T(batch.size() == 1);
+		Instruction copy;
+		batch.get(0, &copy);
+		T(copy.values[1].type == SQLITE_BLOB && copy.values[1].data1.iVal == 3);
+		T(memcmp(copy.values[1].data2, "abc", 3) == 0);
+	}
+
+	// Sharded output, by PK hash and by a callback
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Shards (ID PRIMARY KEY, Name);"
+		"CREATE TABLE aux.Shards (ID PRIMARY KEY, Name);"
+		"INSERT INTO main.Shards VALUES (1, 'a'), (2, 'b'), (3, 'c'), (4, 'd');"
+		"INSERT INTO aux.Shards VALUES (2, 'B'), (3, 'c'), (5, 'e'), ('six', 'f'), (7.5, 'g');",
+		nullptr, nullptr, nullptr));
+
+	FILE* shards[3];
+	auto oddEven = [](const Instruction* instr, int nShard, void*) {
+		return instr->values[0].type == SQLITE_INTEGER ? (int)(instr->values[0].data1.iVal % nShard) : 0;
+	};
+	const char* shardFiles[2] = {"shard0.diff", "shard1.diff"};
+	for (int i=0; i < 2; i++) {
+		shards[i] = fopen(shardFiles[i], "wb");
+	}
+	F(sqlitediff_diff_sharded(db, "Shards", shards, 2, oddEven, nullptr));
+	for (int i=0; i < 2; i++) {
+		fclose(shards[i]);
+	}
+
+	// Shard 1 holds the odd keys only: delete 1, insert 5
+	F(applyChangeset(db, shardFiles[1]));
+	F(sqlite3_prepare(db, "SELECT group_concat(ID || Name, ' ') FROM main.Shards;", -1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW);
+	F(strcmp((const char*) sqlite3_column_text(stmt, 0), "2b 3c 4d 5e"));
+	F(sqlite3_finalize(stmt));
+
+	F(applyChangeset(db, shardFiles[0]));
+	F(sqlitediff_check_prepared(db, nullptr, &differ));
+	T(differ == 0);
+
+	F(sqlite3_exec(db,
+		"UPDATE aux.Shards SET Name = upper(Name);"
+		"INSERT INTO aux.Shards VALUES (x'0102', 'h'), (NULL, 'i');",
+		nullptr, nullptr, nullptr));
+	const char* hashFiles[3] = {"shard0.diff", "shard1.diff", "shard2.diff"};
+	for (int i=0; i < 3; i++) {
+		shards[i] = fopen(hashFiles[i], "wb");
+	}
+	F(sqlitediff_diff_sharded(db, "Shards", shards, 3, nullptr, nullptr));
+	for (int i=0; i < 3; i++) {
+		fclose(shards[i]);
+	}
+	for (int i=0; i < 3; i++) {
+		F(applyChangeset(db, hashFiles[i]));
+	}
+	// The NULL key never matches, so the check agrees with the diff, which
+	// repeats that row, but everything else is in sync
+	F(sqlitediff_check_prepared(db, "Shards", &differ));
+	T(differ == 1);
+	F(sqlite3_prepare(db, "SELECT count(*) FROM main.Shards A JOIN aux.Shards B USING (ID, Name)", -1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 6);
+	F(sqlite3_finalize(stmt));
+
+	// Shards without rows, 1 and 3, are empty changesets that apply as such
+	F(sqlite3_exec(db, "UPDATE aux.Shards SET Name = 'two' WHERE ID = 2;", nullptr, nullptr, nullptr));
+	const char* sparseFiles[4] = {"sparse0.diff", "sparse1.diff", "sparse2.diff", "sparse3.diff"};
+	FILE* sparse[4];
+	for (int i=0; i < 4; i++) {
+		sparse[i] = fopen(sparseFiles[i], "wb");
+	}
+	F(sqlitediff_diff_sharded(db, "Shards", sparse, 4, oddEven, nullptr));
+	for (int i=0; i < 4; i++) {
+		fclose(sparse[i]);
+	}
+	for (int i=0; i < 4; i++) {
+		FILE* f = fopen(sparseFiles[i], "rb");
+		fseek(f, 0, SEEK_END);
+		T((ftell(f) == 0) == (i % 2 == 1));
+		fclose(f);
+		F(applyChangeset(db, sparseFiles[i]));
+		if (i % 2 == 1) {
+			F(applyChangesetPipelined(db, sparseFiles[i]));
+		}
+	}
+	F(sqlite3_prepare(db, "SELECT Name FROM main.Shards WHERE ID = 2", -1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW && strcmp((const char*)sqlite3_column_text(stmt, 0), "two") == 0);
+	F(sqlite3_finalize(stmt));
+
+	// Fan-out apply, fan2 lacks the table and fails on its own
+	const char* fanFiles[3] = {"fan0.sqlite", "fan1.sqlite", "fan2.sqlite"};
+	for (int i=0; i < 3; i++) {
+		remove(fanFiles[i]);
+		sqlite3* fan;
+		F(sqlite3_open_v2(fanFiles[i], &fan, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr));
+		F(sqlite3_exec(fan, i < 2 ? "CREATE TABLE Shards (ID PRIMARY KEY, Name)" : "CREATE TABLE Other (ID)",
+			nullptr, nullptr, nullptr));
+		F(sqlite3_close(fan));
+	}
+	F(sqlite3_exec(db,
+		"ATTACH 'fan0.sqlite' AS fan0; ATTACH 'fan1.sqlite' AS fan1;"
+		"INSERT INTO fan0.Shards SELECT * FROM main.Shards;"
+		"INSERT INTO fan1.Shards SELECT * FROM main.Shards;"
+		"DETACH fan0; DETACH fan1;"
+		"DELETE FROM aux.Shards WHERE ID = 2;"
+		"UPDATE aux.Shards SET Name = 'x' WHERE ID = 3;"
+		"INSERT INTO aux.Shards VALUES (8, 'y');",
+		nullptr, nullptr, nullptr));
+
+	out = fopen("fan.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Shards", out));
+	fclose(out);
+
+	int fanRc[3];
+	T(sqlitediff_apply_fanout("fan.diff", fanFiles, 3, fanRc) != SQLITE_OK);
+	T(fanRc[0] == SQLITE_OK && fanRc[1] == SQLITE_OK && fanRc[2] != SQLITE_OK);
+	for (int i=0; i < 2; i++) {
+		// The check counts the NULL key as a difference, so compare the rows
+		sqlite3* fan;
+		F(sqlite3_open_v2(fanFiles[i], &fan, SQLITE_OPEN_READWRITE, nullptr));
+		F(sqlite3_exec(fan, "ATTACH 'b.sqlite' AS b", nullptr, nullptr, nullptr));
+		F(sqlite3_prepare(fan,
+			"SELECT (SELECT count(*) FROM main.Shards) = (SELECT count(*) FROM b.Shards)"
+			"   AND NOT EXISTS(SELECT * FROM main.Shards EXCEPT SELECT * FROM b.Shards)"
+			"   AND EXISTS(SELECT * FROM main.Shards WHERE ID IS NULL)", -1, &stmt, nullptr));
+		T(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 1);
+		F(sqlite3_finalize(stmt));
+		F(sqlite3_close(fan));
+	}
+	// A NULL key never matches, so every later diff of Shards would repeat it
+	F(sqlite3_exec(db, "DELETE FROM main.Shards WHERE ID IS NULL; DELETE FROM aux.Shards WHERE ID IS NULL;",
+		nullptr, nullptr, nullptr));
+
+	// The check agrees with the diff: duplicate NULL keys differ with equal
+	// row counts, tables without a PRIMARY KEY are skipped by both
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Twins (ID PRIMARY KEY, V);"
+		"CREATE TABLE aux.Twins (ID PRIMARY KEY, V);"
+		"INSERT INTO main.Twins VALUES (NULL, 'a'), (NULL, 'a'), (1, 'b');"
+		"INSERT INTO aux.Twins VALUES (NULL, 'a'), (1, 'b'), (2, 'c');"
+		"CREATE TABLE main.Keyless (V);"
+		"CREATE TABLE aux.Keyless (V);"
+		"INSERT INTO main.Keyless VALUES ('x'), ('x');"
+		"INSERT INTO aux.Keyless VALUES ('x'), ('y');",
+		nullptr, nullptr, nullptr));
+	F(sqlitediff_check_prepared(db, "Twins", &differ));
+	T(differ == 1);
+	F(sqlitediff_check_prepared(db, "Keyless", &differ));
+	T(differ == 0);
+	out = fopen("keyless.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Keyless", out));
+	T(ftell(out) == 0);
+	fclose(out);
+
+	// A table the check cannot query is an error, not a difference
+	auto reverse = [](void*, int nA, const void* a, int nB, const void* b) {
+		return -memcmp(a, b, nA < nB ? nA : nB);
+	};
+	F(sqlite3_create_collation(db, "Reverse", SQLITE_UTF8, nullptr, reverse));
+	F(sqlite3_exec(db,
+		"DROP TABLE main.Twins; DROP TABLE aux.Twins; DROP TABLE main.Keyless; DROP TABLE aux.Keyless;"
+		"CREATE TABLE main.Collated (ID PRIMARY KEY, V COLLATE Reverse);"
+		"CREATE TABLE aux.Collated (ID PRIMARY KEY, V COLLATE Reverse);",
+		nullptr, nullptr, nullptr));
+	T(sqlitediff_check(aF, bF, "Collated", &differ) != SQLITE_OK);
+	F(sqlite3_exec(db, "DROP TABLE main.Collated; DROP TABLE aux.Collated;", nullptr, nullptr, nullptr));
+
+	// Deltas survive batching, in the pipelined apply and in the fan-out
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Deltas (ID PRIMARY KEY, Body);"
+		"CREATE TABLE aux.Deltas (ID PRIMARY KEY, Body);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 300)"
+		"  INSERT INTO main.Deltas SELECT i, hex(randomblob(1024)) FROM n;"
+		"INSERT INTO aux.Deltas SELECT ID, substr(Body, 1, 100) || 'x' || substr(Body, 102) FROM main.Deltas;",
+		nullptr, nullptr, nullptr));
+	const char* deltaFiles[2] = {"delta0.sqlite", "delta1.sqlite"};
+	for (int i=0; i < 2; i++) {
+		remove(deltaFiles[i]);
+		F(sqlite3_exec(db, (std::string("ATTACH '") + deltaFiles[i] + "' AS delta;"
+			"CREATE TABLE delta.Deltas (ID PRIMARY KEY, Body);"
+			"INSERT INTO delta.Deltas SELECT * FROM main.Deltas;"
+			"DETACH delta;").c_str(),
+			nullptr, nullptr, nullptr));
+	}
+	options = DiffOptions();
+	options.nDeltaThreshold = 512;
+	sqlitediff_set_options(&options);
+	out = fopen("deltas.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Deltas", out));
+	T(ftell(out) < 300 * 100);
+	fclose(out);
+	sqlitediff_set_options(nullptr);
+	{
+		sqlite3* target;
+		F(sqlite3_open_v2(deltaFiles[0], &target, SQLITE_OPEN_READWRITE, nullptr));
+		F(applyChangesetPipelined(target, "deltas.diff"));
+		F(sqlite3_close(target));
+	}
+	F(sqlitediff_apply_fanout("deltas.diff", deltaFiles + 1, 1, nullptr));
+	for (int i=0; i < 2; i++) {
+		F(sqlitediff_check(deltaFiles[i], bF, "Deltas", &differ));
+		T(differ == 0);
+	}
+
+	// Parsed changeset: the NULL key row deleted and inserted, delete 2, update 3, insert 8
+	ParsedChangeset parsed;
+	F(parsed.parse("fan.diff"));
+	F(parsed.parse("fan.diff"));
+	T(parsed.size() == 10 && parsed.blocks().size() == 2);
+	int nUpdate = 0;
+	parsed.forEach("Shards", SQLITE_UPDATE, [&nUpdate](const Instruction& instr) {
+		nUpdate += instr.values[1].type == SQLITE_TEXT;
+	});
+	T(nUpdate == 2);
+	sqlite_value pk;
+	pk.type = SQLITE_INTEGER;
+	pk.data1.iVal = 8;
+	auto found = parsed.findByPk("Shards", &pk);
+	T(found.size() == 2 && found[0]->iType == SQLITE_INSERT && found[0]->values[1].data1.iVal == 1 && found[0]->values[1].data2[0] == 'y');
+	T(parsed.pkIndex("Shards").size() == 10);
+	parsed.clear();
+	T(parsed.size() == 0);
+
+	// Checksums
+	T(sqlitediff_crc32c(0, "123456789", 9) == 0xe3069283);
+	T(sqlitediff_crc32c(sqlitediff_crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+	options = DiffOptions();
+	options.bChecksum = 1;
+	sqlitediff_set_options(&options);
+	out = fopen("crc.diff", "w+b");
+	F(sqlitediff_diff_prepared(db, "Shards", out));
+	sqlitediff_set_options(nullptr);
+
+	std::vector<char> crcDiff(ftell(out));
+	rewind(out);
+	T(fread(crcDiff.data(), 1, crcDiff.size(), out) == crcDiff.size());
+	fclose(out);
+	T(crcDiff[0] == 'K' && crcDiff[crcDiff.size() - 13] == 'C');
+	F(parsed.parse(crcDiff.data(), crcDiff.size()));
+	T(parsed.size() == 3);
+
+	crcDiff[crcDiff.size() / 2] ^= 1;
+	T(parsed.parse(crcDiff.data(), crcDiff.size()) != 0);
+	T(parsed.parse(crcDiff.data(), crcDiff.size() - 1) != 0);
+	T(parsed.size() == 3);
+	parsed.clear();
+
+	// Chunked apply, interrupted by the missing table Zeta and resumed
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Zeta (ID PRIMARY KEY, V);"
+		"CREATE TABLE aux.Zeta (ID PRIMARY KEY, V);"
+		"INSERT INTO aux.Zeta VALUES (1, 'same'), (2, 'same'), (3, 'other');",
+		nullptr, nullptr, nullptr));
+	remove("chunk.sqlite");
+	F(sqlite3_exec(db,
+		"ATTACH 'chunk.sqlite' AS chunk;"
+		"CREATE TABLE chunk.Shards (ID PRIMARY KEY, Name);"
+		"INSERT INTO chunk.Shards SELECT * FROM main.Shards;"
+		"DETACH chunk;",
+		nullptr, nullptr, nullptr));
+
+	const char* chunkTables[] = {"Shards", "Zeta", nullptr};
+	options = DiffOptions();
+	options.azIncludeTables = chunkTables;
+	options.nDictMaxSize = 16;
+	options.bChecksum = 1;
+	sqlitediff_set_options(&options);
+	out = fopen("chunk.diff", "wb");
+	F(sqlitediff_diff_prepared(db, nullptr, out));
+	fclose(out);
+	sqlitediff_set_options(nullptr);
+
+	sqlite3* chunkDb;
+	F(sqlite3_open_v2("chunk.sqlite", &chunkDb, SQLITE_OPEN_READWRITE, nullptr));
+	T(applyChangesetChunked(chunkDb, "chunk.diff", 1, 0, false) != SQLITE_OK);
+	T(applyChangesetChunked(chunkDb, "chunk.diff", 1, 0, false) != SQLITE_OK);
+	F(sqlitediff_check("chunk.sqlite", bF, "Shards", &differ));
+	T(differ == 0);
+
+	F(sqlite3_exec(chunkDb, "CREATE TABLE Zeta (ID PRIMARY KEY, V)", nullptr, nullptr, nullptr));
+	F(applyChangesetChunked(chunkDb, "chunk.diff", 1, 0, true));
+	F(sqlite3_prepare(chunkDb, "SELECT count(*) FROM sqlite_master WHERE name = 'sqlitediff_progress'", -1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 0);
+	F(sqlite3_finalize(stmt));
+	F(sqlite3_close(chunkDb));
+	F(sqlitediff_check("chunk.sqlite", bF, "Zeta", &differ));
+	T(differ == 0);
+
+	// Resuming with a changeset of the same size that only differs after its
+	// first 64 KiB is refused
+	remove("resume.sqlite");
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Bulk (ID PRIMARY KEY, V);"
+		"CREATE TABLE aux.Bulk (ID PRIMARY KEY, V);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 5000)"
+		"  INSERT INTO aux.Bulk SELECT i, printf('%040d', i) FROM n;"
+		"ATTACH 'resume.sqlite' AS resume;"
+		"CREATE TABLE resume.Bulk (ID PRIMARY KEY, V);"
+		"DETACH resume;",
+		nullptr, nullptr, nullptr));
+	const char* resumeTables[] = {"Bulk", "Zeta", nullptr};
+	options = DiffOptions();
+	options.azIncludeTables = resumeTables;
+	sqlitediff_set_options(&options);
+	out = fopen("resume1.diff", "wb");
+	F(sqlitediff_diff_prepared(db, nullptr, out));
+	fclose(out);
+	sqlitediff_set_options(nullptr);
+	{
+		std::string resumeDiff;
+		FILE* in = fopen("resume1.diff", "rb");
+		char chunk[4096];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+			resumeDiff.append(chunk, n);
+		}
+		fclose(in);
+		T(resumeDiff.size() > (1 << 16) + 100);
+		resumeDiff[resumeDiff.size() - 100] ^= 1;
+		out = fopen("resume2.diff", "wb");
+		fwrite(resumeDiff.data(), 1, resumeDiff.size(), out);
+		fclose(out);
+	}
+	sqlite3* resumeDb;
+	F(sqlite3_open_v2("resume.sqlite", &resumeDb, SQLITE_OPEN_READWRITE, nullptr));
+	T(applyChangesetChunked(resumeDb, "resume1.diff", 1000, 0, false) != SQLITE_OK);
+	T(applyChangesetChunked(resumeDb, "resume2.diff", 1000, 0, true) == SQLITE_MISMATCH);
+	F(sqlite3_exec(resumeDb, "CREATE TABLE Zeta (ID PRIMARY KEY, V)", nullptr, nullptr, nullptr));
+	F(applyChangesetChunked(resumeDb, "resume1.diff", 1000, 0, true));
+	F(sqlite3_close(resumeDb));
+	F(sqlitediff_check("resume.sqlite", bF, "Bulk", &differ));
+	T(differ == 0);
+	F(sqlite3_exec(db, "DROP TABLE main.Bulk; DROP TABLE aux.Bulk;", nullptr, nullptr, nullptr));
+
+#ifdef SQLITE_ENABLE_SESSION
+	// Session extension format, read by SQLite itself and by applyChangeset
+	options = DiffOptions();
+	options.azIncludeTables = chunkTables;
+	options.nDictMaxSize = 16;
+	options.bSessionFormat = 1;
+	sqlitediff_set_options(&options);
+	out = fopen("session.diff", "w+b");
+	F(sqlitediff_diff_prepared(db, nullptr, out));
+	sqlitediff_set_options(nullptr);
+
+	std::vector<char> sessionDiff(ftell(out));
+	rewind(out);
+	T(fread(sessionDiff.data(), 1, sessionDiff.size(), out) == sessionDiff.size());
+	fclose(out);
+
+	sqlite3_changeset_iter* iter;
+	F(sqlite3changeset_start(&iter, sessionDiff.size(), sessionDiff.data()));
+	int nChange = 0;
+	while (sqlite3changeset_next(iter) == SQLITE_ROW) {
+		nChange++;
+	}
+	F(sqlite3changeset_finalize(iter));
+	T(nChange == 6);
+
+	remove("session.sqlite");
+	F(sqlite3_exec(db,
+		"ATTACH 'session.sqlite' AS session;"
+		"CREATE TABLE session.Shards (ID PRIMARY KEY, Name);"
+		"CREATE TABLE session.Zeta (ID PRIMARY KEY, V);"
+		"INSERT INTO session.Shards SELECT * FROM main.Shards;"
+		"DETACH session;",
+		nullptr, nullptr, nullptr));
+	sqlite3* sessionDb;
+	F(sqlite3_open_v2("session.sqlite", &sessionDb, SQLITE_OPEN_READWRITE, nullptr));
+	F(applySessionChangeset(sessionDb, "session.diff"));
+	F(sqlite3_close(sessionDb));
+	F(sqlitediff_check("session.sqlite", bF, "Shards", &differ));
+	T(differ == 0);
+	F(sqlitediff_check("session.sqlite", bF, "Zeta", &differ));
+	T(differ == 0);
+
+	F(applyChangeset(db, "session.diff"));
+	F(sqlitediff_check_prepared(db, "Shards", &differ));
+	T(differ == 0);
+#endif
+
+	// Live diff: a writer commits to WAL database live1 after the table's
+	// schema is read and before its rows are, unblocked; only a live diff
+	// does not see the row
+	remove("live1.sqlite");
+	remove("live1.sqlite-wal");
+	remove("live2.sqlite");
+	sqlite3* writer;
+	F(sqlite3_open_v2("live1.sqlite", &writer, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr));
+	F(sqlite3_exec(writer,
+		"PRAGMA journal_mode=WAL;"
+		"CREATE TABLE Live (ID PRIMARY KEY, V);"
+		"INSERT INTO Live VALUES (1, 'a'), (2, 'b');"
+		"VACUUM INTO 'live2.sqlite';"
+		"INSERT INTO Live VALUES (3, 'c');",
+		nullptr, nullptr, nullptr));
+
+	sqlite3* live;
+	F(sqlitediff_open_v2("live1.sqlite", "live2.sqlite", SQLITEDIFF_OPEN_IMMUTABLE2, &live));
+	struct LiveState { sqlite3* writer; int nInstr; int writeRc; };
+	for (int bLive : {1, 0}) {
+		F(sqlite3_exec(writer, "DELETE FROM Live WHERE ID = 4", nullptr, nullptr, nullptr));
+		options = DiffOptions();
+		options.bLive = bLive;
+		sqlitediff_set_options(&options);
+		LiveState liveState = {writer, 0, -1};
+		F(slitediff_diff_prepared_callback(live, "Live", [](const TableInfo* table, void* context) {
+			LiveState* state = (LiveState*)context;
+			state->writeRc = sqlite3_exec(state->writer, "INSERT INTO Live VALUES (4, 'd')", nullptr, nullptr, nullptr);
+			return 0;
+		}, [](const Instruction* instr, void* context) {
+			((LiveState*)context)->nInstr++;
+			return 0;
+		}, &liveState));
+		sqlitediff_set_options(nullptr);
+		T(liveState.writeRc == SQLITE_OK);
+		T(liveState.nInstr == (bLive ? 1 : 2));
+		if (bLive) {
+			DiffStats liveStats;
+			sqlitediff_stats(&liveStats);
+			T(liveStats.nWalGrowth > 0);
+		}
+	}
+	F(sqlite3_close(live));
+	F(sqlite3_close(writer));
+
+	// Captured changes: only rows recorded by the capture triggers are diffed
+	remove("cap1.sqlite");
+	remove("cap2.sqlite");
+	sqlite3* source;
+	F(sqlite3_open_v2("cap2.sqlite", &source, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr));
+	F(sqlite3_exec(source,
+		"CREATE TABLE Cap (ID PRIMARY KEY, V);"
+		"WITH RECURSIVE r(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM r WHERE i < 100)"
+		" INSERT INTO Cap SELECT i, i FROM r;"
+		"VACUUM INTO 'cap1.sqlite';",
+		nullptr, nullptr, nullptr));
+	F(sqlitediff_capture_install(source, "main", nullptr));
+	F(sqlite3_exec(source,
+		"UPDATE Cap SET V = 'x' WHERE ID IN (10, 20);"
+		"UPDATE Cap SET ID = 200 WHERE ID = 30;"
+		"DELETE FROM Cap WHERE ID = 40;"
+		"INSERT INTO Cap VALUES (101, 'new');",
+		nullptr, nullptr, nullptr));
+
+	sqlite3* capDb;
+	F(sqlitediff_open("cap1.sqlite", "cap2.sqlite", &capDb));
+	F(sqlite3_exec(capDb, "UPDATE main.Cap SET V = 'uncaptured' WHERE ID = 50", nullptr, nullptr, nullptr));
+	options = DiffOptions();
+	options.bCaptured = 1;
+	sqlitediff_set_options(&options);
+	int nCaptured = 0;
+	F(slitediff_diff_prepared_callback(capDb, nullptr, nullptr, [](const Instruction* instr, void* context) {
+		(*(int*)context)++;
+		return 0;
+	}, &nCaptured));
+	sqlitediff_set_options(nullptr);
+	T(nCaptured == 6);
+	F(sqlitediff_check_prepared(capDb, nullptr, &differ));
+	T(differ == 1);
+	F(sqlite3_close(capDb));
+
+	// Only the capture tables are reset, not tables LIKE would match
+	F(sqlite3_exec(source,
+		"CREATE TABLE \"SQLITEDIFF_CAPTURE_Keep\" (ID PRIMARY KEY);"
+		"CREATE TABLE sqlitediffXcaptureXKeep (ID PRIMARY KEY);"
+		"INSERT INTO \"SQLITEDIFF_CAPTURE_Keep\" VALUES (1);"
+		"INSERT INTO sqlitediffXcaptureXKeep VALUES (1);",
+		nullptr, nullptr, nullptr));
+	F(sqlitediff_capture_reset(source, "main"));
+	F(sqlite3_prepare(source,
+		"SELECT (SELECT count(*) FROM sqlitediff_capture_Cap),"
+		" (SELECT count(*) FROM \"SQLITEDIFF_CAPTURE_Keep\"), (SELECT count(*) FROM sqlitediffXcaptureXKeep)",
+		-1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 0);
+	T(sqlite3_column_int(stmt, 1) == 1 && sqlite3_column_int(stmt, 2) == 1);
+	F(sqlite3_finalize(stmt));
+
+	// The capture table and triggers are not part of the comparison
+	remove("cap3.sqlite");
+	F(sqlite3_exec(source,
+		"VACUUM INTO 'cap3.sqlite';"
+		"ATTACH 'cap3.sqlite' AS cap3;"
+		"DROP TRIGGER cap3.sqlitediff_capture_Cap_insert;"
+		"DROP TRIGGER cap3.sqlitediff_capture_Cap_update;"
+		"DROP TRIGGER cap3.sqlitediff_capture_Cap_delete;"
+		"DROP TABLE cap3.sqlitediff_capture_Cap;"
+		"DETACH cap3;",
+		nullptr, nullptr, nullptr));
+	F(sqlitediff_check("cap3.sqlite", "cap2.sqlite", nullptr, &differ));
+	T(differ == 0);
+	F(sqlitediff_check("cap2.sqlite", "cap3.sqlite", nullptr, &differ));
+	T(differ == 0);
+	F(sqlite3_close(source));
+
+	// N-way diff: one base against two targets, one lacking the table and an identical one
+	const char* multiFiles[5] = {"multi0.sqlite", "multi1.sqlite", "multi2.sqlite", "multi3.sqlite", "multi4.sqlite"};
+	for (int i=0; i < 5; i++) {
+		remove(multiFiles[i]);
+	}
+	sqlite3* base;
+	F(sqlite3_open_v2(multiFiles[0], &base, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr));
+	F(sqlite3_exec(base,
+		"CREATE TABLE Multi (ID PRIMARY KEY, V, W);"
+		"INSERT INTO Multi VALUES (1, 'a', 1), (2, 'b', 2.5), (3, 'n', x'00'), ('k', 'c', 3), (x'01', 'd', 4);"
+		"VACUUM INTO 'multi1.sqlite'; VACUUM INTO 'multi2.sqlite'; VACUUM INTO 'multi4.sqlite';"
+		"ATTACH 'multi1.sqlite' AS t1; ATTACH 'multi2.sqlite' AS t2; ATTACH 'multi3.sqlite' AS t3;"
+		"UPDATE t1.Multi SET V = 'B' WHERE ID = 2;"
+		"DELETE FROM t1.Multi WHERE ID = 'k';"
+		"INSERT INTO t1.Multi VALUES (0, 'first', 0), ('z', 'last', 0);"
+		"DELETE FROM t2.Multi WHERE ID IN (1, 3);"
+		"UPDATE t2.Multi SET W = 4.0 WHERE ID = x'01';"
+		"UPDATE t2.Multi SET W = 'changed' WHERE ID = 2;"
+		"INSERT INTO t2.Multi VALUES (x'02', 'blob', NULL);"
+		"CREATE TABLE t3.Other (ID PRIMARY KEY);"
+		"DETACH t1; DETACH t2; DETACH t3;",
+		nullptr, nullptr, nullptr));
+	sqlite3* multiTargets[4];
+	FILE* multiOuts[4];
+	const char* multiDiffs[4] = {"multi1.diff", "multi2.diff", "multi3.diff", "multi4.diff"};
+	for (int i=0; i < 4; i++) {
+		F(sqlite3_open_v2(multiFiles[i + 1], &multiTargets[i], SQLITE_OPEN_READONLY, nullptr));
+		multiOuts[i] = fopen(multiDiffs[i], "wb");
+	}
+	F(sqlitediff_diff_multi(base, nullptr, multiTargets, multiOuts, 4));
+	for (int i=0; i < 4; i++) {
+		fclose(multiOuts[i]);
+		F(sqlite3_close(multiTargets[i]));
+	}
+	for (int i=0; i < 4; i++) {
+		if (i == 2) {
+			continue;
+		}
+		remove("multicopy.sqlite");
+		F(sqlite3_exec(base, "VACUUM INTO 'multicopy.sqlite'", nullptr, nullptr, nullptr));
+		sqlite3* copy;
+		F(sqlite3_open_v2("multicopy.sqlite", &copy, SQLITE_OPEN_READWRITE, nullptr));
+		F(applyChangeset(copy, multiDiffs[i]));
+		F(sqlite3_close(copy));
+		F(sqlitediff_check("multicopy.sqlite", multiFiles[i + 1], "Multi", &differ));
+		T(differ == 0);
+	}
+	ParsedChangeset multiParsed;
+	F(multiParsed.parse(multiDiffs[2]));
+	T(multiParsed.size() == 0);
+	// The identical target gets an empty changeset, which still applies
+	FILE* multiEmpty = fopen(multiDiffs[3], "rb");
+	fseek(multiEmpty, 0, SEEK_END);
+	T(ftell(multiEmpty) == 0);
+	fclose(multiEmpty);
+	F(sqlite3_close(base));
+
+	// Visitor API: the diff and the changeset it was written to agree
+	struct MultiVisitor : sqlitediff::Visitor {
+		int tables = 0;
+		int rows[3] = {0, 0, 0};
+		bool updated = false;
+		int table(const TableInfo& table) {
+			tables += strcmp(table.tableName, "Multi") == 0;
+			return 0;
+		}
+		int row(const sqlitediff::RowView& row) {
+			rows[row.op() == SQLITE_INSERT ? 0 : row.op() == SQLITE_UPDATE ? 1 : 2]++;
+			if (row.op() == SQLITE_UPDATE) {
+				updated = row.changed(2) && ! row.changed(1)
+					&& row.newValue(2).bytes() == sqlitediff::BytesView("changed", 7);
+			}
+			return 0;
+		}
+	};
+	MultiVisitor fromDiff, fromChangeset;
+	{
+		sqlitediff::Connection conn;
+		F(conn.open(multiFiles[0], multiFiles[2]));
+		F(sqlitediff::diff(conn, fromDiff, "Multi"));
+		sqlitediff::Statement count(conn, "SELECT count(*) FROM aux.Multi");
+		T(count.step() == SQLITE_ROW && count.column(0).asInt() == 4);
+	}
+	F(sqlitediff::readChangeset(multiDiffs[1], fromChangeset));
+	T(fromDiff.tables == 1 && fromChangeset.tables == 1);
+	for (int i=0; i < 3; i++) {
+		T(fromDiff.rows[i] == fromChangeset.rows[i]);
+	}
+	T(fromDiff.rows[0] == 1 && fromDiff.rows[1] == 1 && fromDiff.rows[2] == 2);
+	T(fromDiff.updated && fromChangeset.updated);
+
+	// Type-profiled decoding: rows that break the profile still read right
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Profiled (ID INTEGER PRIMARY KEY, I, R);"
+		"CREATE TABLE aux.Profiled (ID INTEGER PRIMARY KEY, I, R);"
+		"WITH RECURSIVE r(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM r WHERE i < 40)"
+		" INSERT INTO aux.Profiled SELECT i, i * 1000, i + 0.5 FROM r;"
+		"UPDATE aux.Profiled SET I = 'text' WHERE ID = 20;"
+		"UPDATE aux.Profiled SET R = 7 WHERE ID = 30;",
+		nullptr, nullptr, nullptr));
+	out = fopen("profiled.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Profiled", out));
+	fclose(out);
+	struct ProfiledVisitor : sqlitediff::Visitor {
+		int rows = 0;
+		int bad = 0;
+		int row(const sqlitediff::RowView& row) {
+			sqlite3_int64 id = row.value(0).asInt();
+			rows++;
+			if (id == 20) {
+				bad += row.value(1).bytes() != sqlitediff::BytesView("text", 4);
+			} else {
+				bad += row.value(1).type() != SQLITE_INTEGER || row.value(1).asInt() != id * 1000;
+			}
+			if (id == 30) {
+				bad += row.value(2).type() != SQLITE_INTEGER || row.value(2).asInt() != 7;
+			} else {
+				bad += row.value(2).type() != SQLITE_FLOAT || row.value(2).asDouble() != id + 0.5;
+			}
+			return 0;
+		}
+	} profiled;
+	F(sqlitediff::readChangeset("profiled.diff", profiled));
+	T(profiled.rows == 40 && profiled.bad == 0);
+
+	// Batch callbacks: 40 INSERTs in batches of 16, 16 and 8
+	struct BatchCheck {
+		std::vector<int> sizes;
+		int bad = 0;
+		static int callback(const Instruction* aInstr, int nInstr, void* context) {
+			BatchCheck* p = (BatchCheck*)context;
+			p->sizes.push_back(nInstr);
+			for (int i=0; i < nInstr; i++) {
+				const Instruction& instr = aInstr[i];
+				p->bad += instr.table != aInstr[0].table || instr.iType != SQLITE_INSERT;
+				p->bad += i > 0 && instr.values != aInstr[i - 1].values + instr.table->nCol * 2;
+				if (instr.values[0].data1.iVal == 20) {
+					p->bad += instr.values[1].type != SQLITE_TEXT || memcmp(instr.values[1].data2, "text", 4) != 0;
+				}
+			}
+			return 0;
+		}
+	};
+	BatchCheck diffBatches, readBatches;
+	F(slitediff_diff_prepared_batch(db, "Profiled", nullptr, BatchCheck::callback, 16, &diffBatches));
+	F(readChangesetBatch("profiled.diff", BatchCheck::callback, 16, &readBatches));
+	T(diffBatches.sizes == std::vector<int>({16, 16, 8}) && diffBatches.bad == 0);
+	T(readBatches.sizes == diffBatches.sizes && readBatches.bad == 0);
+
+	// Pipelined apply, and an error on the applying side stopping it
+	F(applyChangesetPipelined(db, "profiled.diff"));
+	F(sqlitediff_check_prepared(db, "Profiled", &differ));
+	T(differ == 0);
+	{
+		sqlite3* other;
+		F(sqlite3_open_v2("multicopy.sqlite", &other, SQLITE_OPEN_READWRITE, nullptr));
+		T(applyChangesetPipelined(other, "profiled.diff") != SQLITE_OK);
+		T(sqlite3_get_autocommit(other));
+		F(sqlite3_close(other));
+	}
+
+	// Deltas, streamed BLOBs and dictionary references apply through the
+	// pipeline as through applyChangeset()
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Kinds (ID PRIMARY KEY, Body, Data, Tag);"
+		"CREATE TABLE aux.Kinds (ID PRIMARY KEY, Body, Data, Tag);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 100)"
+		"  INSERT INTO main.Kinds SELECT i, hex(randomblob(1024)), randomblob(3000), 'tag' || (i % 3) FROM n;"
+		"INSERT INTO aux.Kinds SELECT ID, substr(Body, 1, 10) || 'x' || substr(Body, 12),"
+		"  CASE WHEN ID % 2 THEN randomblob(3000) ELSE Data END, 'new' || (ID % 3) FROM main.Kinds WHERE ID % 10;"
+		"INSERT INTO aux.Kinds VALUES (1000, 'new', randomblob(5000), 'new1');",
+		nullptr, nullptr, nullptr));
+	for (int kind=0; kind < 3; kind++) {
+		const char* kindFiles[2] = {"kinds0.sqlite", "kinds1.sqlite"};
+		for (int i=0; i < 2; i++) {
+			remove(kindFiles[i]);
+			F(sqlite3_exec(db, (std::string("ATTACH '") + kindFiles[i] + "' AS kinds;"
+				"CREATE TABLE kinds.Kinds (ID PRIMARY KEY, Body, Data, Tag);"
+				"INSERT INTO kinds.Kinds SELECT * FROM main.Kinds;"
+				"DETACH kinds;").c_str(),
+				nullptr, nullptr, nullptr));
+		}
+		options = DiffOptions();
+		options.nDeltaThreshold = kind == 0 ? 512 : 0;
+		options.nStreamThreshold = kind == 1 ? 1000 : 0;
+		options.nDictMaxSize = kind == 2 ? 16 : 0;
+		sqlitediff_set_options(&options);
+		out = fopen("kinds.diff", "wb");
+		F(sqlitediff_diff_prepared(db, "Kinds", out));
+		fclose(out);
+		sqlitediff_set_options(nullptr);
+
+		sqlite3* target;
+		F(sqlite3_open_v2(kindFiles[0], &target, SQLITE_OPEN_READWRITE, nullptr));
+		F(applyChangeset(target, "kinds.diff"));
+		F(sqlite3_close(target));
+		F(sqlite3_open_v2(kindFiles[1], &target, SQLITE_OPEN_READWRITE, nullptr));
+		F(applyChangesetPipelined(target, "kinds.diff"));
+		F(sqlite3_close(target));
+		F(sqlitediff_check(kindFiles[0], kindFiles[1], "Kinds", &differ));
+		T(differ == 0);
+		F(sqlitediff_check(kindFiles[1], bF, "Kinds", &differ));
+		T(differ == 0);
+	}
+
+	// A block that rewrites most of its table applies without the non-unique indexes
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Churn (ID INTEGER PRIMARY KEY, K UNIQUE, V, W);"
+		"CREATE INDEX main.ChurnV ON Churn (V);"
+		"CREATE INDEX main.ChurnW ON Churn (W) WHERE W IS NOT NULL;"
+		"CREATE TABLE aux.Churn (ID INTEGER PRIMARY KEY, K UNIQUE, V, W);"
+		"INSERT INTO main.Churn VALUES (1, 1, 'a', 1), (2, 2, 'b', 2);"
+		"WITH RECURSIVE N(I) AS (SELECT 1 UNION ALL SELECT I + 1 FROM N WHERE I < 3000)"
+		"  INSERT INTO aux.Churn SELECT I, -I, I % 7, nullif(I % 3, 0) FROM N;",
+		nullptr, nullptr, nullptr));
+	out = fopen("churn.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Churn", out));
+	fclose(out);
+	int dropped = 0;
+	sqlite3_trace_v2(db, SQLITE_TRACE_STMT, [](unsigned, void* context, void*, void* x) {
+		*(int*)context += strncmp((const char*)x, "DROP INDEX", 10) == 0;
+		return 0;
+	}, &dropped);
+	F(applyChangesetPipelined(db, "churn.diff", 0.5));
+	sqlite3_trace_v2(db, 0, nullptr, nullptr);
+	T(dropped == 2);
+	F(sqlitediff_check_prepared(db, "Churn", &differ));
+	T(differ == 0);
+	F(sqlite3_prepare_v2(db, "SELECT count(*) FROM main.sqlite_master WHERE tbl_name = 'Churn' AND type = 'index'",
+		-1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 3);
+	F(sqlite3_finalize(stmt));
+	F(sqlite3_prepare_v2(db, "PRAGMA main.integrity_check", -1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW && strcmp((const char*)sqlite3_column_text(stmt, 0), "ok") == 0);
+	F(sqlite3_finalize(stmt));
+
+	// Wide tables: 800 columns, an UPDATE of one costs a few bytes
+	std::string wideCols;
+	for (int i=0; i < 799; i++) {
+		wideCols += ", C" + std::to_string(i);
+	}
+	F(sqlite3_exec(db, ("CREATE TABLE main.Wide (ID INTEGER PRIMARY KEY" + wideCols + ");"
+		"CREATE TABLE aux.Wide (ID INTEGER PRIMARY KEY" + wideCols + ");"
+		"INSERT INTO main.Wide (ID, C0, C500, C798) VALUES (1, 'a', 2, 3), (2, 'b', 4, 5);"
+		"INSERT INTO aux.Wide SELECT * FROM main.Wide;"
+		"UPDATE aux.Wide SET C500 = 42 WHERE ID = 2;").c_str(),
+		nullptr, nullptr, nullptr));
+	out = fopen("wide.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Wide", out));
+	long wideSize = ftell(out);
+	fclose(out);
+	// 'T', varint nCol, PK flags and the name, then the UPDATE
+	T(wideSize > 808 && wideSize - 808 < 40);
+
+	F(sqlite3_exec(db,
+		"UPDATE aux.Wide SET C0 = 'changed', C798 = NULL WHERE ID = 1;"
+		"INSERT INTO aux.Wide (ID, C1, C797) VALUES (3, 'new', x'00');"
+		"DELETE FROM aux.Wide WHERE ID = 2;",
+		nullptr, nullptr, nullptr));
+	out = fopen("wide.diff", "wb");
+	F(sqlitediff_diff_prepared(db, "Wide", out));
+	fclose(out);
+	F(applyChangeset(db, "wide.diff"));
+	F(sqlitediff_check_prepared(db, "Wide", &differ));
+	T(differ == 0);
+
+	// Too wide to select both sides of every column: the rows are looked up.
+	// An UPDATE from NULL must still match the row it was diffed from.
+	std::string widestCols;
+	for (int i=0; i < 1998; i++) {
+		widestCols += ", C" + std::to_string(i);
+	}
+	const char* widestKinds[2] = {")", ") WITHOUT ROWID"};
+	for (int kind=0; kind < 2; kind++) {
+		F(sqlite3_exec(db, ("DROP TABLE IF EXISTS main.Widest; DROP TABLE IF EXISTS aux.Widest;"
+			"CREATE TABLE main.Widest (ID INTEGER PRIMARY KEY" + widestCols + widestKinds[kind] + ";"
+			"CREATE TABLE aux.Widest (ID INTEGER PRIMARY KEY" + widestCols + widestKinds[kind] + ";"
+			"INSERT INTO main.Widest (ID, C0, C1500, C1997) VALUES (1, 'a', 2, 3), (2, 'b', 4, 5), (4, 'd', NULL, 6);"
+			"INSERT INTO aux.Widest SELECT * FROM main.Widest;"
+			"UPDATE aux.Widest SET C1500 = 'filled' WHERE ID = 4;"
+			"UPDATE aux.Widest SET C0 = 'changed', C1997 = NULL WHERE ID = 1;"
+			"INSERT INTO aux.Widest (ID, C1, C1996) VALUES (3, 'new', x'00');"
+			"DELETE FROM aux.Widest WHERE ID = 2;").c_str(),
+			nullptr, nullptr, nullptr));
+		out = fopen("widest.diff", "wb");
+		F(sqlitediff_diff_prepared(db, "Widest", out));
+		fclose(out);
+		sqlitediff_stats(&stats);
+		T(stats.nInsert == 1 && stats.nUpdate == 2 && stats.nDelete == 1);
+		F(applyChangeset(db, "widest.diff"));
+		F(sqlitediff_check_prepared(db, "Widest", &differ));
+		T(differ == 0);
+		F(sqlite3_prepare_v2(db, "SELECT C1500 FROM main.Widest WHERE ID = 4", -1, &stmt, nullptr));
+		T(sqlite3_step(stmt) == SQLITE_ROW && strcmp((const char*)sqlite3_column_text(stmt, 0), "filled") == 0);
+		F(sqlite3_finalize(stmt));
+	}
+	F(sqlite3_exec(db, "DROP TABLE main.Widest; DROP TABLE aux.Widest;", nullptr, nullptr, nullptr));
+
+	// A cache keeps plans across diffs, checks until a database is written
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Warm (ID INTEGER PRIMARY KEY, V);"
+		"CREATE TABLE aux.Warm (ID INTEGER PRIMARY KEY, V);"
+		"INSERT INTO main.Warm VALUES (1, 'a'), (2, 'b');"
+		"INSERT INTO aux.Warm VALUES (1, 'a'), (2, 'c');",
+		nullptr, nullptr, nullptr));
+	struct WarmCount {
+		int nCol = 0;
+		int nUpdate = 0;
+		int nOther = 0;
+		static int table(const TableInfo* table, void* context) {
+			((WarmCount*)context)->nCol = table->nCol;
+			return 0;
+		}
+		static int callback(const Instruction* instr, void* context) {
+			WarmCount* p = (WarmCount*)context;
+			(instr->iType == SQLITE_UPDATE ? p->nUpdate : p->nOther)++;
+			return 0;
+		}
+	};
+	DiffCache* cache = sqlitediff_cache_open(db);
+	T(cache != nullptr);
+	for (int i=0; i < 2; i++) {
+		WarmCount warm;
+		F(slitediff_diff_prepared_callback(db, "Warm", nullptr, WarmCount::callback, &warm));
+		T(warm.nUpdate == 1 && warm.nOther == 0);
+	}
+	F(sqlitediff_check_prepared(db, "Warm", &differ));
+	T(differ == 1);
+	F(sqlite3_exec(db, "UPDATE aux.Warm SET V = 'b' WHERE ID = 2", nullptr, nullptr, nullptr));
+	F(sqlitediff_check_prepared(db, "Warm", &differ));
+	T(differ == 0);
+	F(sqlite3_exec(db,
+		"ALTER TABLE main.Warm ADD COLUMN W;"
+		"ALTER TABLE aux.Warm ADD COLUMN W;"
+		"UPDATE aux.Warm SET W = 1 WHERE ID = 1;",
+		nullptr, nullptr, nullptr));
+	{
+		WarmCount warm;
+		F(slitediff_diff_prepared_callback(db, "Warm", WarmCount::table, WarmCount::callback, &warm));
+		T(warm.nCol == 3 && warm.nUpdate == 1);
+	}
+	sqlitediff_cache_close(cache);
+
+	// Join and merge write the same changeset, NULL PRIMARY KEYs included
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Strategy (K PRIMARY KEY, V);"
+		"CREATE TABLE aux.Strategy (K PRIMARY KEY, V);"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 20000)"
+		"  INSERT INTO main.Strategy SELECT CASE WHEN i % 3 THEN i ELSE 'k' || i END, i FROM n;"
+		"INSERT INTO main.Strategy VALUES (NULL, 1), (NULL, 2), (x'01', 3), (2.5, 4);"
+		"INSERT INTO aux.Strategy SELECT K, CASE WHEN V % 50 THEN V ELSE -V END"
+		"  FROM main.Strategy WHERE V % 70 AND K IS NOT NULL;"
+		"INSERT INTO aux.Strategy VALUES (NULL, 1), (-1, 'new'), (x'00', 'blob');",
+		nullptr, nullptr, nullptr));
+	std::string strategyDiffs[3];
+	for (int i=0; i < 3; i++) {
+		char* data = nullptr;
+		size_t size = 0;
+		out = open_memstream(&data, &size);
+		FILE* log = tmpfile();
+		options = DiffOptions();
+		options.eStrategy = i;
+		options.pPlanLog = log;
+		sqlitediff_set_options(&options);
+		F(sqlitediff_diff_prepared(db, "Strategy", out));
+		sqlitediff_set_options(nullptr);
+		fclose(out);
+		strategyDiffs[i].assign(data, size);
+		free(data);
+
+		char line[256] = "";
+		rewind(log);
+		T(fgets(line, sizeof(line), log) != nullptr);
+		fclose(log);
+		T(strstr(line, i == SQLITEDIFF_STRATEGY_JOIN ? ": join" : ": merge") != nullptr);
+	}
+	T(strategyDiffs[0].size() > 1000);
+	T(strategyDiffs[1] == strategyDiffs[0] && strategyDiffs[2] == strategyDiffs[0]);
+
+	// Wide tables are merged by row hashes, which are seeded with the value
+	// types: 1 and 1.0 hash differently but are equal, 1 and '1' are not
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.StrategyWide (K PRIMARY KEY, C0, C1, C2, C3, C4, C5, C6, C7, C8);"
+		"CREATE TABLE aux.StrategyWide (K PRIMARY KEY, C0, C1, C2, C3, C4, C5, C6, C7, C8);"
+		"INSERT INTO main.StrategyWide SELECT K, V, V * 2, 'v' || V, NULL, x'01', V, V, V, 1"
+		"  FROM main.Strategy WHERE K IS NOT NULL;"
+		"INSERT INTO aux.StrategyWide SELECT K, C0, C1, C2, C3, C4, C5, C6, C7,"
+		"  CASE WHEN C0 % 9 THEN 1 WHEN C0 % 2 THEN 1.0 ELSE '1' END"
+		"  FROM main.StrategyWide WHERE C0 % 70;",
+		nullptr, nullptr, nullptr));
+	int wideUpdates = 0, wideDeletes = 0, wideReals = 0;
+	F(sqlite3_prepare(db,
+		"SELECT (SELECT count(*) FROM aux.StrategyWide WHERE typeof(C8) = 'text'),"
+		" (SELECT count(*) FROM main.StrategyWide) - (SELECT count(*) FROM aux.StrategyWide),"
+		" (SELECT count(*) FROM aux.StrategyWide WHERE typeof(C8) = 'real')",
+		-1, &stmt, nullptr));
+	T(sqlite3_step(stmt) == SQLITE_ROW);
+	wideUpdates = sqlite3_column_int(stmt, 0);
+	wideDeletes = sqlite3_column_int(stmt, 1);
+	wideReals = sqlite3_column_int(stmt, 2);
+	F(sqlite3_finalize(stmt));
+	T(wideUpdates > 0 && wideDeletes > 0 && wideReals > 0);
+	std::string wideDiffs[3];
+	for (int i=0; i < 3; i++) {
+		char* data = nullptr;
+		size_t size = 0;
+		out = open_memstream(&data, &size);
+		FILE* log = tmpfile();
+		options = DiffOptions();
+		options.eStrategy = i;
+		options.pPlanLog = log;
+		sqlitediff_set_options(&options);
+		F(sqlitediff_diff_prepared(db, "StrategyWide", out));
+		WarmCount wide;
+		F(slitediff_diff_prepared_callback(db, "StrategyWide", nullptr, WarmCount::callback, &wide));
+		sqlitediff_set_options(nullptr);
+		fclose(out);
+		wideDiffs[i].assign(data, size);
+		free(data);
+		T(wide.nUpdate == wideUpdates && wide.nOther == wideDeletes);
+
+		char line[256] = "";
+		rewind(log);
+		T(fgets(line, sizeof(line), log) != nullptr);
+		fclose(log);
+		T(strstr(line, i == SQLITEDIFF_STRATEGY_JOIN ? ": join" : ": merge") != nullptr);
+		T(i == SQLITEDIFF_STRATEGY_JOIN || strstr(line, "hashed") != nullptr);
+	}
+	T(wideDiffs[1] == wideDiffs[0] && wideDiffs[2] == wideDiffs[0]);
+
+	// A sparse rowid range is bounded by the rows that fit in the file
+	F(sqlite3_exec(db,
+		"CREATE TABLE main.Sparse (ID INTEGER PRIMARY KEY, V);"
+		"CREATE TABLE aux.Sparse (ID INTEGER PRIMARY KEY, V);"
+		"INSERT INTO main.Sparse VALUES (-9223372036854775808, 'min'), (0, 'zero'), (9223372036854775807, 'max');"
+		"INSERT INTO aux.Sparse VALUES (-9223372036854775808, 'min'), (9223372036854775807, 'MAX');",
+		nullptr, nullptr, nullptr));
+	{
+		FILE* log = tmpfile();
+		options = DiffOptions();
+		options.pPlanLog = log;
+		sqlitediff_set_options(&options);
+		WarmCount sparse;
+		F(slitediff_diff_prepared_callback(db, "Sparse", nullptr, WarmCount::callback, &sparse));
+		sqlitediff_set_options(nullptr);
+		T(sparse.nUpdate == 1 && sparse.nOther == 1);
+
+		char line[256] = "";
+		long long nA = -1, nB = -1, nJoin = -1, nMerge = -1;
+		rewind(log);
+		T(fgets(line, sizeof(line), log) != nullptr);
+		fclose(log);
+		const char* rows = strstr(line, "rows ");
+		T(rows != nullptr && sscanf(rows, "rows %lld (rowid range) + %lld (rowid range), cost join %lld merge %lld",
+			&nA, &nB, &nJoin, &nMerge) == 4);
+		T(nA > 0 && nA < 100000000 && nB > 0 && nB < 100000000);
+		T(nJoin > 0 && nMerge > 0);
+	}
+	F(sqlite3_exec(db, "DROP TABLE main.Sparse; DROP TABLE aux.Sparse;", nullptr, nullptr, nullptr));
+
+	// UTF-16 text sorts differently from UTF-8, so it is never merged
+	{
+		sqlite3* utf16 = nullptr;
+		F(sqlite3_open(":memory:", &utf16));
+		F(sqlite3_exec(utf16,
+			"PRAGMA encoding = 'UTF-16be';"
+			"ATTACH ':memory:' AS aux;"
+			"CREATE TABLE main.Wide16 (K TEXT PRIMARY KEY, V);"
+			"CREATE TABLE aux.Wide16 (K TEXT PRIMARY KEY, V);"
+			"INSERT INTO main.Wide16 VALUES (char(65313), 1), (char(128512), 2);"
+			"INSERT INTO aux.Wide16 VALUES (char(65313), 3), (char(128512), 4);",
+			nullptr, nullptr, nullptr));
+		FILE* log = tmpfile();
+		options = DiffOptions();
+		options.eStrategy = SQLITEDIFF_STRATEGY_MERGE;
+		options.pPlanLog = log;
+		sqlitediff_set_options(&options);
+		WarmCount wide16;
+		F(slitediff_diff_prepared_callback(utf16, "Wide16", nullptr, WarmCount::callback, &wide16));
+		sqlitediff_set_options(nullptr);
+		T(wide16.nUpdate == 2 && wide16.nOther == 0);
+
+		char line[256] = "";
+		rewind(log);
+		T(fgets(line, sizeof(line), log) != nullptr);
+		fclose(log);
+		T(strstr(line, ": join (only possible)") != nullptr);
+		F(sqlite3_close(utf16));
+	}
+
+	// A join that fails mid-scan fails the diff instead of ending the table
+	{
+		sqlite3* joinDb = nullptr;
+		F(sqlite3_open(":memory:", &joinDb));
+		F(sqlite3_exec(joinDb,
+			"ATTACH ':memory:' AS aux;"
+			"CREATE TABLE main.Halted (ID PRIMARY KEY, V);"
+			"CREATE TABLE aux.Halted (ID PRIMARY KEY, V);"
+			"INSERT INTO main.Halted VALUES (1, 'a'), (2, 'b'), (3, 'c');",
+			nullptr, nullptr, nullptr));
+		options = DiffOptions();
+		options.eStrategy = SQLITEDIFF_STRATEGY_JOIN;
+		sqlitediff_set_options(&options);
+		struct HaltState { sqlite3* db; int n; } halt = {joinDb, 0};
+		rc = slitediff_diff_prepared_callback(joinDb, "Halted", nullptr, [](const Instruction* instr, void* context) {
+			HaltState* state = (HaltState*)context;
+			state->n++;
+			sqlite3_interrupt(state->db);
+			return 0;
+		}, &halt);
+		sqlitediff_set_options(nullptr);
+		T(rc == SQLITE_INTERRUPT && halt.n == 1);
+		F(sqlite3_close(joinDb));
+	}
+
+	// The diff server answers like a direct diff
+	out = fopen("all.diff", "wb");
+	F(sqlitediff_diff_prepared(db, nullptr, out));
+	fclose(out);
 	F(sqlite3_close(db));
+	{
+		std::thread server(sqlitediff_serve, "serve.sock", 4);
+		const char* diffArgs[] = {"a.sqlite", "b.sqlite"};
+		const char* shutdownArgs[] = {"--shutdown"};
+		int status = -1;
+		for (int i=0; i < 500; i++) {
+			out = fopen("served.diff", "wb");
+			rc = sqlitediff_request("serve.sock", 2, diffArgs, out, &status);
+			fclose(out);
+			if (rc != SQLITE_CANTOPEN) {
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		F(rc);
+		T(status == 0);
+
+		// A client that stalls mid-request is dropped, not waited for
+		int stalled = socket(AF_UNIX, SOCK_STREAM, 0);
+		struct sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, "serve.sock");
+		T(connect(stalled, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+		T(send(stalled, "--check", 8, 0) == 8);
+		F(sqlitediff_request("serve.sock", 1, shutdownArgs, stdout, &status));
+		T(status == 0);
+		server.join();
+		char reply;
+		T(recv(stalled, &reply, 1, 0) == 0);
+		close(stalled);
+
+		auto readAll = [](const char* name) {
+			std::string data;
+			FILE* in = fopen(name, "rb");
+			char chunk[4096];
+			size_t n;
+			while (in && (n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+				data.append(chunk, n);
+			}
+			if (in) {
+				fclose(in);
+			}
+			return data;
+		};
+		std::string served = readAll("served.diff");
+		T(! served.empty() && served == readAll("all.diff"));
+	}
 
 	return 0;
 }
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "diff.h"
+#include "reader.h"
+#include "sqlite3.h"
+
+#include <cstring>
+#include <string>
+#include <utility>
+
+/**
+ * Header-only C++ layer over the diff and changeset reader callbacks.
+ *
+ * The visitor is a template parameter rather than a function pointer and
+ * void* context, so when reading a changeset its row() is inlined into the
+ * decode loop. The diff itself runs in diff.c and calls back through a
+ * single trampoline per row.
+ *
+ * A visitor derives from sqlitediff::Visitor and hides the members it
+ * needs:
+ *
+ *   struct Counter : sqlitediff::Visitor {
+ *       int rows = 0;
+ *       int row(const sqlitediff::RowView&) { rows++; return 0; }
+ *   };
+ *
+ * A non-zero return value stops the diff or read and is reported as its
+ * error.
+ */
+namespace sqlitediff {
+
+/** Non-owning view of TEXT or BLOB bytes, like C++17's std::string_view */
+class BytesView
+{
+public:
+	BytesView() : m_data(nullptr), m_size(0) {}
+	BytesView(const char* data, size_t size) : m_data(data), m_size(size) {}
+
+	const char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	const char* begin() const { return m_data; }
+	const char* end() const { return m_data + m_size; }
+	char operator[](size_t i) const { return m_data[i]; }
+
+	std::string str() const { return std::string(m_data, m_size); }
+
+	bool operator==(const BytesView& other) const
+	{
+		return m_size == other.m_size && (m_size == 0 || std::memcmp(m_data, other.m_data, m_size) == 0);
+	}
+	bool operator!=(const BytesView& other) const { return ! (*this == other); }
+
+private:
+	const char* m_data;
+	size_t m_size;
+};
+
+/** A value of a row: a copy of the small sqlite_value, never of its bytes */
+class ValueView
+{
+public:
+	explicit ValueView(const sqlite_value& value) : m_value(value) {}
+
+	/* SQLITE_INTEGER, ..., SQLITE_NULL, SQLITEDIFF_BLOBREF, a SQLITEDIFF_DELTA
+	 * type, or 0 for the unchanged columns of an UPDATE */
+	int type() const { return m_value.type; }
+	bool present() const { return m_value.type != 0; }
+	bool isNull() const { return m_value.type == SQLITE_NULL; }
+
+	sqlite3_int64 asInt() const { return m_value.type == SQLITE_INTEGER ? m_value.data1.iVal : 0; }
+	double asDouble() const
+	{
+		return m_value.type == SQLITE_FLOAT ? m_value.data1.dVal
+			: m_value.type == SQLITE_INTEGER ? (double)m_value.data1.iVal : 0.0;
+	}
+	/* Bytes of a TEXT or BLOB value, or of a delta */
+	BytesView bytes() const
+	{
+		if (m_value.type == SQLITE_INTEGER || m_value.type == SQLITE_FLOAT
+				|| m_value.type == SQLITE_NULL || m_value.type == 0
+				|| m_value.type == SQLITEDIFF_BLOBREF) {
+			return BytesView();
+		}
+		return BytesView((const char*)m_value.data2, (size_t)m_value.data1.iVal);
+	}
+
+	const sqlite_value& get() const { return m_value; }
+
+private:
+	sqlite_value m_value;
+};
+
+/** One instruction of a diff or changeset, valid during the row() call */
+class RowView
+{
+public:
+	explicit RowView(const Instruction* instr) : m_instr(instr) {}
+
+	/* SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE */
+	int op() const { return m_instr->iType; }
+	const TableInfo& table() const { return *m_instr->table; }
+	const char* tableName() const { return m_instr->table->tableName; }
+	int columns() const { return m_instr->table->nCol; }
+	bool isPk(int i) const { return m_instr->table->PKs[i] != 0; }
+
+	/* The inserted or deleted value, or the old value of an UPDATE */
+	ValueView value(int i) const { return ValueView(m_instr->values[i]); }
+	/* The new value of an UPDATE */
+	ValueView newValue(int i) const { return ValueView(m_instr->values[m_instr->table->nCol + i]); }
+	/* Whether an UPDATE changes column i */
+	bool changed(int i) const
+	{
+		if (m_instr->iType != SQLITE_UPDATE) {
+			return false;
+		}
+		return m_instr->valFlag ? m_instr->valFlag[i] != 0
+			: m_instr->values[m_instr->table->nCol + i].type != 0;
+	}
+
+	const Instruction* get() const { return m_instr; }
+
+private:
+	const Instruction* m_instr;
+};
+
+/** Base of visitors, doing nothing */
+struct Visitor
+{
+	/* Called before the rows of a table. When reading a changeset only for
+	 * tables that have rows. */
+	int table(const TableInfo&) { return 0; }
+	int row(const RowView&) { return 0; }
+};
+
+/** Owning handle of a connection, closed on destruction */
+class Connection
+{
+public:
+	Connection() : m_db(nullptr) {}
+	explicit Connection(sqlite3* db) : m_db(db) {}
+	~Connection() { sqlite3_close(m_db); }
+
+	Connection(Connection&& other) : m_db(other.release()) {}
+	Connection& operator=(Connection&& other)
+	{
+		if (this != &other) {
+			sqlite3_close(m_db);
+			m_db = other.release();
+		}
+		return *this;
+	}
+	Connection(const Connection&) = delete;
+	Connection& operator=(const Connection&) = delete;
+
+	int open(const char* filename, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)
+	{
+		sqlite3_close(m_db);
+		m_db = nullptr;
+		int rc = sqlite3_open_v2(filename, &m_db, flags, nullptr);
+		if (rc != SQLITE_OK) {
+			sqlite3_close(m_db);
+			m_db = nullptr;
+		}
+		return rc;
+	}
+	/* Open zDb1 as main and zDb2 as aux, see sqlitediff_open() */
+	int open(const char* zDb1, const char* zDb2)
+	{
+		sqlite3_close(m_db);
+		m_db = nullptr;
+		return sqlitediff_open(zDb1, zDb2, &m_db);
+	}
+
+	int exec(const char* sql) { return sqlite3_exec(m_db, sql, nullptr, nullptr, nullptr); }
+
+	sqlite3* get() const { return m_db; }
+	operator sqlite3*() const { return m_db; }
+	sqlite3* release() { sqlite3* db = m_db; m_db = nullptr; return db; }
+
+private:
+	sqlite3* m_db;
+};
+
+/** Owning handle of a prepared statement, finalized on destruction */
+class Statement
+{
+public:
+	Statement() : m_stmt(nullptr) {}
+	Statement(sqlite3* db, const char* sql) : m_stmt(nullptr) { prepare(db, sql); }
+	~Statement() { sqlite3_finalize(m_stmt); }
+
+	Statement(Statement&& other) : m_stmt(other.m_stmt) { other.m_stmt = nullptr; }
+	Statement& operator=(Statement&& other)
+	{
+		std::swap(m_stmt, other.m_stmt);
+		return *this;
+	}
+	Statement(const Statement&) = delete;
+	Statement& operator=(const Statement&) = delete;
+
+	int prepare(sqlite3* db, const char* sql)
+	{
+		sqlite3_finalize(m_stmt);
+		m_stmt = nullptr;
+		return sqlite3_prepare_v2(db, sql, -1, &m_stmt, nullptr);
+	}
+
+	int step() { return sqlite3_step(m_stmt); }
+	int reset() { return sqlite3_reset(m_stmt); }
+
+	/* Column i of the current row, valid until the next step() */
+	ValueView column(int i) const
+	{
+		sqlite_value value;
+		sqlite3_value_to_sqlite_value(sqlite3_column_value(m_stmt, i), &value);
+		return ValueView(value);
+	}
+
+	sqlite3_stmt* get() const { return m_stmt; }
+	operator sqlite3_stmt*() const { return m_stmt; }
+
+private:
+	sqlite3_stmt* m_stmt;
+};
+
+namespace detail {
+
+template<class V>
+int visitTable(const TableInfo* table, void* context)
+{
+	return static_cast<V*>(context)->table(*table);
+}
+
+template<class V>
+int visitRow(const Instruction* instr, void* context)
+{
+	return static_cast<V*>(context)->row(RowView(instr));
+}
+
+} // namespace detail
+
+/* Diff main against aux of db, see slitediff_diff_prepared_callback() */
+template<class V>
+int diff(sqlite3* db, V& visitor, const char* zTab = nullptr)
+{
+	return slitediff_diff_prepared_callback(db, zTab, detail::visitTable<V>, detail::visitRow<V>, &visitor);
+}
+
+/* Read the changeset in buf, see readChangeset() */
+template<class V>
+int readChangeset(const char* buf, size_t size, V& visitor)
+{
+	const char* tableName = nullptr;
+	auto callback = [&visitor, &tableName](const Instruction* instr) {
+		// Table blocks are told apart by their name inside buf
+		if (instr->table->tableName != tableName) {
+			tableName = instr->table->tableName;
+			int rc = visitor.table(*instr->table);
+			if (rc) {
+				return rc;
+			}
+		}
+		return visitor.row(RowView(instr));
+	};
+	return readChangesetWith(buf, size, callback);
+}
+
+template<class V>
+int readChangeset(const char* filename, V& visitor)
+{
+	MappedFile file(filename);
+	if (! file.ok()) {
+		return 1;
+	}
+	return readChangeset(file.data(), file.size(), visitor);
+}
+
+} // namespace sqlitediff